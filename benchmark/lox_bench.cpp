@@ -0,0 +1,346 @@
+/* Lox benchmark runner.
+ *
+ *   lox_bench [--lox=path] [--runs=N] [--warmup=N] [--filter=text]
+ *             [--out=file.json] [--compare=baseline.json] [--threshold=percent]
+ *             [-- lox arguments...]
+ *
+ * Runs each case of the corpus, the scripts next to this file plus a large
+ * generated program, as a separate lox process with stdout discarded. After
+ * the warmup runs every run is measured: wall time, instructions retired in
+ * user space (from perf_event_open, where the kernel allows it) and peak
+ * RSS. Prints the median and p99 of each as JSON. With --compare, cases
+ * whose median time or instructions grew by more than the threshold over a
+ * JSON file written earlier are listed on stderr, and the exit status is 1.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include <fmt/format.h>
+
+
+#ifndef LOX_PATH
+#define LOX_PATH "lox"
+#endif
+
+#ifndef LOX_BENCH_DIR
+#define LOX_BENCH_DIR "."
+#endif
+
+struct Case {
+    const char* name;
+    const char* script;   // In LOX_BENCH_DIR, nullptr for the generated program
+};
+
+static const Case CORPUS[] = {
+    { "fib", "fib.l" },
+    { "loops", "loops.l" },
+    { "strings", "strings.l" },
+    { "closures", "closures.l" },
+    { "scopes", "scopes.l" },
+    { "generated", nullptr },
+};
+
+struct Sample {
+    double milliseconds;
+    long long instructions;   // -1 if not counted
+    long peakKilobytes;
+};
+
+struct Result {
+    std::string name;
+    double medianMs;
+    double p99Ms;
+    long long instructions;   // Median, -1 if not counted
+    long peakKilobytes;       // Largest over the runs
+};
+
+
+/* Many small functions called once each: mostly scanning, parsing and
+ * resolving, which the other cases barely exercise */
+static std::string synthesize(int functions) {
+    std::string source;
+    for (int i = 0; i < functions; i++) {
+        source += fmt::format(
+            "fun compute{}(alpha, beta) {{\n"
+            "    var total = alpha * {}.5 + beta;\n"
+            "    if (total >= 1000) {{ return \"overflow in compute{}\"; }}\n"
+            "    while (total < 10) {{ total = total + 1; }}\n"
+            "    return total;\n"
+            "}}\n"
+            "compute{}({}, 2);\n\n", i, i % 97, i, i, i % 7);
+    }
+    return source;
+}
+
+#ifdef __linux__
+/* Counts user space instructions of pid and its children from its next exec */
+static int openCounter(pid_t pid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+#else
+static int openCounter(pid_t) {
+    return -1;
+}
+#endif
+
+/* Runs lox once; returns false if it could not run or did not exit with 0 */
+static bool measure(const std::vector<std::string>& command, Sample& sample) {
+    std::vector<char*> argv;
+    for (auto& arg: command) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    /* The child waits until its counter is open */
+    int ready[2];
+    if (pipe(ready) != 0) return false;
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) != 1) _exit(127);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(ready[0]);
+    int counter = openCounter(pid);
+
+    auto begin = std::chrono::steady_clock::now();
+    bool started = write(ready[1], "g", 1) == 1;
+    close(ready[1]);
+    int status;
+    rusage usage;
+    pid_t waited = wait4(pid, &status, 0, &usage);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+
+    sample.milliseconds = elapsed.count();
+    sample.peakKilobytes = usage.ru_maxrss;
+    sample.instructions = -1;
+    if (counter >= 0) {
+        long long count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) sample.instructions = count;
+        close(counter);
+    }
+    return started && waited == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Nearest rank, over sorted values */
+template <typename T>
+static T percentile(const std::vector<T>& sorted, double percent) {
+    size_t rank = static_cast<size_t>(std::ceil(percent / 100 * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+static std::string toJson(const std::string& lox, const std::vector<std::string>& args,
+                          int runs, int warmup, const std::vector<Result>& results) {
+    std::string json = fmt::format("{{\n  \"lox\": \"{}\",\n  \"args\": [", lox);
+    for (size_t i = 0; i < args.size(); i++) {
+        json += fmt::format("{}\"{}\"", i == 0 ? "" : ", ", args[i]);
+    }
+    json += fmt::format("],\n  \"runs\": {},\n  \"warmup\": {},\n  \"cases\": [\n", runs, warmup);
+    /* One case per line, which is all readBaseline() relies on */
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        json += fmt::format("    {{\"name\": \"{}\", \"median_ms\": {:.3f}, \"p99_ms\": {:.3f}, "
+                            "\"instructions\": {}, \"peak_rss_kb\": {}}}{}\n",
+                            r.name, r.medianMs, r.p99Ms,
+                            r.instructions < 0 ? std::string("null") : std::to_string(r.instructions),
+                            r.peakKilobytes, i + 1 == results.size() ? "" : ",");
+    }
+    json += "  ]\n}\n";
+    return json;
+}
+
+static bool field(const std::string& line, const char* key, std::string& value) {
+    std::string quoted = fmt::format("\"{}\": ", key);
+    size_t start = line.find(quoted);
+    if (start == std::string::npos) return false;
+    start += quoted.size();
+    size_t end = line.find_first_of(",}", start);
+    value = line.substr(start, end - start);
+    if (value.size() >= 2 && value.front() == '"') value = value.substr(1, value.size() - 2);
+    return true;
+}
+
+/* Reads the cases of a file written by lox_bench */
+static bool readBaseline(const char* path, std::map<std::string, Result>& baseline) {
+    std::ifstream file(path);
+    if (!file) return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        Result r;
+        std::string median, instructions;
+        if (!field(line, "name", r.name) || !field(line, "median_ms", median)) continue;
+        r.medianMs = std::atof(median.c_str());
+        r.instructions = field(line, "instructions", instructions) && instructions != "null"
+                       ? std::atoll(instructions.c_str()) : -1;
+        baseline[r.name] = r;
+    }
+    return true;
+}
+
+/* Lists on stderr every case that got slower than baseline by more than
+ * threshold percent; returns how many did */
+static int compare(const std::vector<Result>& results, const std::map<std::string, Result>& baseline,
+                   double threshold) {
+    int regressions = 0;
+    double limit = 1 + threshold / 100;
+    fmt::print(stderr, "{:<12} {:>12} {:>12} {:>8} {:>16} {:>8}\n",
+               "case", "base ms", "median ms", "change", "instructions", "change");
+    for (auto& r: results) {
+        auto found = baseline.find(r.name);
+        if (found == baseline.end()) {
+            fmt::print(stderr, "{:<12} not in the baseline\n", r.name);
+            continue;
+        }
+        const Result& base = found->second;
+        double time = r.medianMs / base.medianMs;
+        bool counted = r.instructions >= 0 && base.instructions > 0;
+        double instructions = counted ? static_cast<double>(r.instructions) / base.instructions : 1;
+        bool regressed = time > limit || instructions > limit;
+        if (regressed) regressions++;
+        fmt::print(stderr, "{:<12} {:>12.3f} {:>12.3f} {:>+7.1f}% {:>16} {:>7}{}\n",
+                   r.name, base.medianMs, r.medianMs, (time - 1) * 100,
+                   counted ? std::to_string(r.instructions) : std::string("-"),
+                   counted ? fmt::format("{:+.1f}%", (instructions - 1) * 100) : std::string("-"),
+                   regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    std::string lox = LOX_PATH;
+    int runs = 10;
+    int warmup = 2;
+    std::string filter;
+    const char* out = nullptr;
+    const char* baselinePath = nullptr;
+    double threshold = 5;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "--lox=") == 0) {
+            lox = arg.substr(6);
+        } else if (arg.compare(0, 7, "--runs=") == 0) {
+            runs = std::max(1, std::atoi(argv[i] + 7));
+        } else if (arg.compare(0, 9, "--warmup=") == 0) {
+            warmup = std::max(0, std::atoi(argv[i] + 9));
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+            filter = arg.substr(9);
+        } else if (arg.compare(0, 6, "--out=") == 0) {
+            out = argv[i] + 6;
+        } else if (arg.compare(0, 10, "--compare=") == 0) {
+            baselinePath = argv[i] + 10;
+        } else if (arg.compare(0, 12, "--threshold=") == 0) {
+            threshold = std::atof(argv[i] + 12);
+        } else if (arg == "--") {
+            args.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            fmt::print("Usage: lox_bench [--lox=path] [--runs=N] [--warmup=N] [--filter=text] [--out=file.json] "
+                       "[--compare=baseline.json] [--threshold=percent] [-- lox arguments...]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::map<std::string, Result> baseline;
+    if (baselinePath != nullptr && !readBaseline(baselinePath, baseline)) {
+        fmt::print(stderr, "Cannot read {}\n", baselinePath);
+        return EXIT_FAILURE;
+    }
+
+    char generated[] = "/tmp/lox_bench_XXXXXX";
+    int fd = mkstemp(generated);
+    if (fd < 0) {
+        fmt::print(stderr, "Cannot create the generated program\n");
+        return EXIT_FAILURE;
+    }
+    std::string source = synthesize(20000);
+    bool written = write(fd, source.data(), source.size()) == static_cast<ssize_t>(source.size());
+    close(fd);
+
+    std::vector<Result> results;
+    bool failed = !written;
+    for (auto& c: CORPUS) {
+        if (failed) break;
+        if (std::string(c.name).find(filter) == std::string::npos) continue;
+
+        std::vector<std::string> command { lox };
+        command.insert(command.end(), args.begin(), args.end());
+        command.push_back(c.script == nullptr ? std::string(generated)
+                                              : std::string(LOX_BENCH_DIR) + "/" + c.script);
+
+        std::vector<double> times;
+        std::vector<long long> instructions;
+        Result r { c.name, 0, 0, -1, 0 };
+        for (int i = 0; i < warmup + runs; i++) {
+            Sample sample;
+            if (!measure(command, sample)) {
+                fmt::print(stderr, "{}: {} failed\n", c.name, command.back());
+                failed = true;
+                break;
+            }
+            if (i < warmup) continue;
+            times.push_back(sample.milliseconds);
+            if (sample.instructions >= 0) instructions.push_back(sample.instructions);
+            r.peakKilobytes = std::max(r.peakKilobytes, sample.peakKilobytes);
+        }
+        if (failed) break;
+
+        std::sort(times.begin(), times.end());
+        std::sort(instructions.begin(), instructions.end());
+        r.medianMs = percentile(times, 50);
+        r.p99Ms = percentile(times, 99);
+        if (instructions.size() == times.size()) r.instructions = percentile(instructions, 50);
+        results.push_back(r);
+        fmt::print(stderr, "{:<12} {:>10.3f} ms\n", r.name, r.medianMs);
+    }
+    unlink(generated);
+    if (failed) return EXIT_FAILURE;
+
+    std::string json = toJson(lox, args, runs, warmup, results);
+    if (out != nullptr) {
+        std::ofstream file(out);
+        if (!(file << json)) {
+            fmt::print(stderr, "Cannot write {}\n", out);
+            return EXIT_FAILURE;
+        }
+    } else {
+        fmt::print("{}", json);
+    }
+
+    if (baselinePath != nullptr && compare(results, baseline, threshold) > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+/* Lox differential runner.
+ *
+ *   lox_diff [--lox=path] [--filter=text] [-- lox arguments...]
+ *
+ * Runs every script in lox-example-programs/ and benchmark/ under each
+ * engine, with the cache off, and compares what it printed to stdout and
+ * stderr and its exit status against the tree walker's, the reference. The
+ * tree walker then runs it twice more with the cache in a directory of its
+ * own, once to write the entry and once to load it, and both must print
+ * the same as the reference too. Each script that differs is listed on
+ * stderr with the first line that does, and the exit status is 1.
+ * Arguments after `--` are passed to every run, e.g. `-- -O1` to check the
+ * optimizer too.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+
+#ifndef LOX_PATH
+#define LOX_PATH "lox"
+#endif
+
+#ifndef LOX_BENCH_DIR
+#define LOX_BENCH_DIR "."
+#endif
+
+#ifndef LOX_EXAMPLE_DIR
+#define LOX_EXAMPLE_DIR "../lox-example-programs"
+#endif
+
+/* The reference comes first */
+static const std::vector<std::vector<std::string>> ENGINES = {
+    { "--engine=tree" },
+    { "--engine=vm" },
+    { "--engine=closure" },
+#if defined(__x86_64__) && defined(__linux__)
+    /* Elsewhere lox says on stderr that it runs the VM alone */
+    { "--jit" },
+#endif
+};
+
+/* Written by the first run of a script with the cache on, read by the second */
+static const std::vector<std::vector<std::string>> CACHED_RUNS = {
+    { "--engine=tree", "(writing the cache)" },
+    { "--engine=tree", "(reading the cache)" },
+};
+
+struct Output {
+    std::string out;
+    std::string err;
+    int status;     // -1 if lox did not exit normally
+};
+
+
+/* Every .l file in directory, sorted */
+static std::vector<std::string> scripts(const std::string& directory) {
+    std::vector<std::string> paths;
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) return paths;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > 2 && name.compare(name.size() - 2, 2, ".l") == 0) {
+            paths.push_back(directory + "/" + name);
+        }
+    }
+    closedir(dir);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+static std::string readAll(FILE* file) {
+    std::string text;
+    char buffer[4096];
+    std::rewind(file);
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, n);
+    }
+    std::fclose(file);
+    return text;
+}
+
+/* Runs lox once; returns false if it could not be started */
+static bool run(const std::vector<std::string>& command, Output& output) {
+    std::vector<char*> argv;
+    for (auto& arg: command) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    /* Files rather than pipes, so neither stream can fill up and block lox */
+    FILE* out = std::tmpfile();
+    FILE* err = std::tmpfile();
+    pid_t pid = out != nullptr && err != nullptr ? fork() : -1;
+    if (pid < 0) {
+        if (out != nullptr) std::fclose(out);
+        if (err != nullptr) std::fclose(err);
+        return false;
+    }
+    if (pid == 0) {
+        dup2(fileno(out), STDOUT_FILENO);
+        dup2(fileno(err), STDERR_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid) return false;
+    output.out = readAll(out);
+    output.err = readAll(err);
+    output.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == 127);
+}
+
+/* The first line where a and b differ, 1-based */
+static size_t firstDifference(const std::string& a, const std::string& b, std::string& left, std::string& right) {
+    size_t line = 1;
+    size_t i = 0;
+    while (true) {
+        size_t endA = a.find('\n', i);
+        size_t endB = b.find('\n', i);
+        left = a.substr(i, endA == std::string::npos ? std::string::npos : endA - i);
+        right = b.substr(i, endB == std::string::npos ? std::string::npos : endB - i);
+        if (left != right || endA != endB || endA == std::string::npos) return line;
+        i = endA + 1;
+        line++;
+    }
+}
+
+/* Removes the entries the cached runs left in directory, then directory */
+static void removeCache(const std::string& directory) {
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) return;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") unlink((directory + "/" + name).c_str());
+    }
+    closedir(dir);
+    rmdir(directory.c_str());
+}
+
+static std::string join(const std::vector<std::string>& args) {
+    std::string text;
+    for (auto& arg: args) text += (text.empty() ? "" : " ") + arg;
+    return text;
+}
+
+/* Lists on stderr how output differs from the reference */
+static void report(const std::string& script, const std::vector<std::string>& args,
+                   const Output& reference, const Output& output) {
+    fmt::print(stderr, "{}: {} differs from {}\n", script, join(args), ENGINES.front().front());
+    if (output.status != reference.status) {
+        fmt::print(stderr, "  exit status {}, expected {}\n", output.status, reference.status);
+    }
+    const char* streams[] = { "stdout", "stderr" };
+    const std::string* expected[] = { &reference.out, &reference.err };
+    const std::string* actual[] = { &output.out, &output.err };
+    for (int i = 0; i < 2; i++) {
+        if (*actual[i] == *expected[i]) continue;
+        std::string left, right;
+        size_t line = firstDifference(*expected[i], *actual[i], left, right);
+        fmt::print(stderr, "  {} line {}:\n    expected: {}\n    got:      {}\n", streams[i], line, left, right);
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string lox = LOX_PATH;
+    std::string filter;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "--lox=") == 0) {
+            lox = arg.substr(6);
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+            filter = arg.substr(9);
+        } else if (arg == "--") {
+            args.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            fmt::print("Usage: lox_diff [--lox=path] [--filter=text] [-- lox arguments...]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> corpus = scripts(LOX_EXAMPLE_DIR);
+    std::vector<std::string> benchmarks = scripts(LOX_BENCH_DIR);
+    corpus.insert(corpus.end(), benchmarks.begin(), benchmarks.end());
+    if (corpus.empty()) {
+        fmt::print(stderr, "No scripts in {} or {}\n", LOX_EXAMPLE_DIR, LOX_BENCH_DIR);
+        return EXIT_FAILURE;
+    }
+
+    char cache[] = "/tmp/lox_diff_XXXXXX";
+    if (mkdtemp(cache) == nullptr || setenv("LOX_CACHE_DIR", cache, 1) != 0) {
+        fmt::print(stderr, "Cannot create a cache directory\n");
+        return EXIT_FAILURE;
+    }
+
+    int checked = 0;
+    int differing = 0;
+    bool failed = false;
+    for (auto& script: corpus) {
+        if (script.find(filter) == std::string::npos) continue;
+        checked++;
+
+        Output reference;
+        bool same = true;
+        for (auto& engine: ENGINES) {
+            std::vector<std::string> command { lox, "--no-cache" };
+            command.insert(command.end(), engine.begin(), engine.end());
+            command.insert(command.end(), args.begin(), args.end());
+            command.push_back(script);
+
+            Output output;
+            if (!run(command, output)) {
+                failed = true;
+                break;
+            }
+            if (&engine == &ENGINES.front()) {
+                reference = output;
+            } else if (output.out != reference.out || output.err != reference.err ||
+                       output.status != reference.status) {
+                report(script, engine, reference, output);
+                same = false;
+            }
+        }
+        for (auto& cached: CACHED_RUNS) {
+            if (failed) break;
+            std::vector<std::string> command { lox, cached.front() };
+            command.insert(command.end(), args.begin(), args.end());
+            command.push_back(script);
+
+            Output output;
+            if (!run(command, output)) {
+                failed = true;
+            } else if (output.out != reference.out || output.err != reference.err ||
+                       output.status != reference.status) {
+                report(script, cached, reference, output);
+                same = false;
+            }
+        }
+        if (failed) break;
+        if (!same) differing++;
+    }
+    removeCache(cache);
+    if (failed) {
+        fmt::print(stderr, "Cannot run {}\n", lox);
+        return EXIT_FAILURE;
+    }
+
+    fmt::print(stderr, "{} of {} scripts differ between engines\n", differing, checked);
+    return differing > 0 ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+/* Writes a synthetic Lox program to stdout.
+ *
+ *   lox_gen [--size=1M] [--nesting=N] [--identifier=N]
+ *
+ * See SourceShape. Sizes take a K, M or G suffix.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "source_generator.h"
+
+
+int main(int argc, char** argv) {
+    SourceShape shape;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 7, "--size=") == 0 && ParseSize(argv[i] + 7) > 0) {
+            shape.bytes = ParseSize(argv[i] + 7);
+        } else if (arg.compare(0, 10, "--nesting=") == 0) {
+            shape.nesting = std::max(0, std::atoi(argv[i] + 10));
+        } else if (arg.compare(0, 13, "--identifier=") == 0) {
+            shape.identifierLength = std::max(4, std::atoi(argv[i] + 13));
+        } else {
+            fmt::print(stderr, "Usage: lox_gen [--size=1M] [--nesting=N] [--identifier=N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string source = GenerateSource(shape);
+    return std::fwrite(source.data(), 1, source.size(), stdout) == source.size() ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,333 @@
+/* Component microbenchmarks, linked against lox_core.
+ *
+ *   micro_bench [--max-size=16M] [--filter=text]
+ *
+ * scanner      Scanner::ScanTokens() throughput in MB/s
+ * parser       Parser::Parse() throughput in AST nodes/s and MB/s
+ * environment  Environment::Slot() and Get() ns per lookup, and the cost of
+ *              a variable read in a running program by how far out it is
+ *              declared: a global, a local d blocks out, or an upvalue
+ *              d functions out
+ * value        Value copies, arithmetic and comparisons in ns per op
+ *
+ * The scanner and parser run over generated sources from 1KB up to
+ * --max-size, then over 1MB sources of varying nesting and identifier
+ * length, so each phase shows how it scales. Every figure is the best of a
+ * few runs. Benchmarks whose name does not contain --filter are skipped.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "environment.h"
+#include "heap.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "resolver.h"
+#include "scanner.h"
+#include "value.h"
+
+#include "source_generator.h"
+
+
+/* Keeps the compiler from optimizing value away */
+template <typename T>
+static void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/* Best of runs, in seconds */
+template <typename F>
+static double best(int runs, F run) {
+    double best = 1e300;
+    for (int i = 0; i < runs; i++) {
+        auto begin = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+/* Fewer runs for bigger inputs, so a run over 100MB does not take minutes */
+static int runsFor(size_t bytes) {
+    return bytes >= (16 << 20) ? 2 : 5;
+}
+
+
+class NodeCounter: public Expression::Visitor, public Statement::Visitor {
+public:
+    size_t Count(Span<Statement*> statements) {
+        count = 0;
+        visit(statements);
+        return count;
+    }
+
+    void Visit(PrintStatement& stmt) override { count++; visit(stmt.expression); }
+    void Visit(ExpressionStatement& stmt) override { count++; visit(stmt.expression); }
+    void Visit(VarStatement& stmt) override { count++; visit(stmt.init); }
+    void Visit(ReturnStatement& stmt) override { count++; visit(stmt.value); }
+    void Visit(BlockStatement& stmt) override { count++; visit(stmt.statements); }
+    void Visit(FunctionStatement& stmt) override { count++; visit(stmt.stmts); }
+
+    void Visit(IfStatement& stmt) override {
+        count++;
+        visit(stmt.expression);
+        visit(stmt.thenBranch);
+        visit(stmt.elseBranch);
+    }
+
+    void Visit(WhileStatement& stmt) override {
+        count++;
+        visit(stmt.expression);
+        visit(stmt.statement);
+    }
+
+    void Visit(BinaryExpression& expr) override { count++; visit(expr.left); visit(expr.right); }
+    void Visit(LogicalExpression& expr) override { count++; visit(expr.left); visit(expr.right); }
+    void Visit(UnaryExpression& expr) override { count++; visit(expr.expression); }
+    void Visit(GroupingExpression& expr) override { count++; visit(expr.expression); }
+    void Visit(AssignmentExpression& expr) override { count++; visit(expr.value); }
+    void Visit(LiteralExpression&) override { count++; }
+    void Visit(VariableExpression&) override { count++; }
+
+    void Visit(CallExpression& expr) override {
+        count++;
+        visit(expr.callee);
+        for (Expression* argument: expr.arguments) visit(argument);
+    }
+
+private:
+    void visit(Span<Statement*> statements) {
+        for (Statement* statement: statements) visit(statement);
+    }
+
+    void visit(Statement* statement) {
+        if (statement != nullptr) statement->Accept(*this);
+    }
+
+    void visit(Expression* expression) {
+        if (expression != nullptr) expression->Accept(*this);
+    }
+
+    size_t count = 0;
+};
+
+
+/* Sources the scanner and parser run over, smallest first */
+static std::vector<SourceShape> shapes(size_t maxSize) {
+    std::vector<SourceShape> result;
+    for (size_t bytes: { size_t(1) << 10, size_t(64) << 10, size_t(1) << 20, size_t(16) << 20, size_t(100) << 20 }) {
+        if (bytes > maxSize) break;
+        SourceShape shape;
+        shape.bytes = bytes;
+        result.push_back(shape);
+    }
+    for (int nesting: { 0, 32, 256 }) {
+        SourceShape shape;
+        shape.nesting = nesting;
+        result.push_back(shape);
+    }
+    for (int length: { 4, 64, 1024 }) {
+        SourceShape shape;
+        shape.identifierLength = length;
+        result.push_back(shape);
+    }
+    return result;
+}
+
+static std::string describe(const SourceShape& shape) {
+    return fmt::format("{} nesting={} identifier={}", FormatSize(shape.bytes), shape.nesting, shape.identifierLength);
+}
+
+static void scanner(size_t maxSize) {
+    for (auto& shape: shapes(maxSize)) {
+        std::string source = GenerateSource(shape);
+        size_t tokens = 0;
+        double seconds = best(runsFor(source.size()), [&]() {
+            Scanner scanner(source.data(), source.size());
+            std::vector<Token> scanned = scanner.ScanTokens();
+            tokens = scanned.size();
+            keep(scanned.data());
+        });
+        fmt::print("scanner      {:<36} {:>10} tokens {:>10.1f} MB/s\n",
+                   describe(shape), tokens, source.size() / seconds / 1e6);
+    }
+}
+
+static void parser(size_t maxSize) {
+    for (auto& shape: shapes(maxSize)) {
+        std::string source = GenerateSource(shape);
+        size_t nodes = 0;
+        auto parse = [&](bool count) {
+            Heap heap;
+            Arena arena;
+            Heap::Pin pin(heap);
+            Scanner scanner(source.data(), source.size());
+            Parser parser(scanner, heap, arena);
+            Span<Statement*> statements = parser.Parse();
+            keep(statements);
+            if (count) nodes = NodeCounter().Count(statements);
+        };
+        parse(true);
+        double seconds = best(runsFor(source.size()), [&]() { parse(false); });
+        fmt::print("parser       {:<36} {:>10} nodes  {:>10.2f} M nodes/s {:>8.1f} MB/s\n",
+                   describe(shape), nodes, nodes / seconds / 1e6, source.size() / seconds / 1e6);
+    }
+}
+
+/* Runs source on the tree walker; returns the best time in seconds */
+static double interpret(const std::string& source) {
+    Heap heap;
+    Arena arena;
+    Span<Statement*> statements;
+    {
+        Heap::Pin pin(heap);
+        Scanner scanner(source.data(), source.size());
+        Parser parser(scanner, heap, arena);
+        statements = parser.Parse();
+    }
+    Resolver resolver(arena);
+    int slotCount = resolver.Resolve(statements);
+    Interpreter interpreter(heap);
+    /* Declarations run again each time, redefining the same globals */
+    return best(3, [&]() { interpreter.Interpret(statements, slotCount); });
+}
+
+/* A loop adding variable to a sum, nested so that variable is declared
+ * depth blocks or functions out from where it is read */
+static std::string lookupProgram(const char* variable, const char* kind, int depth, int iterations) {
+    std::string source = "var global = 1;\nfun bench() {\n    var local = 1;\n";
+    std::string close;
+    for (int i = 0; i < depth; i++) {
+        if (std::string(kind) == "function") {
+            source += fmt::format("fun nested{}() {{\n", i);
+            close = fmt::format("}}\nnested{}();\n", i) + close;
+        } else {
+            source += "{\n";
+            close = "}\n" + close;
+        }
+    }
+    source += fmt::format("var sum = 0;\nfor (var i = 0; i < {}; i = i + 1) sum = sum + {};\n", iterations, variable);
+    return source + close + "}\nbench();\n";
+}
+
+static void environment() {
+    Heap heap;
+    Environment globals(heap);
+    std::vector<std::string> names;
+    for (int i = 0; i < 1024; i++) names.push_back(fmt::format("global{}", i));
+    std::vector<int> slots;
+    for (auto& name: names) slots.push_back(globals.Slot(name));
+    for (int slot: slots) globals.Define(slot, Value(1.0));
+
+    const int lookups = 1 << 22;
+    Token token(TokenType::IDENTIFIER, names[0].data(), static_cast<uint32_t>(names[0].size()), 1);
+    double seconds = best(5, [&]() {
+        for (int i = 0; i < lookups; i++) {
+            keep(globals.Get(slots[i & 1023], token));
+        }
+    });
+    fmt::print("environment  {:<36} {:>10.2f} ns/lookup\n", "Environment::Get", seconds / lookups * 1e9);
+
+    const int slotLookups = 1 << 20;
+    seconds = best(5, [&]() {
+        for (int i = 0; i < slotLookups; i++) {
+            keep(globals.Slot(names[i & 1023]));
+        }
+    });
+    fmt::print("environment  {:<36} {:>10.2f} ns/lookup\n", "Environment::Slot", seconds / slotLookups * 1e9);
+
+    const int iterations = 1000000;
+    auto report = [&](const std::string& name, const std::string& source) {
+        double seconds = interpret(source);
+        fmt::print("environment  {:<36} {:>10.2f} ns/iteration\n", name, seconds / iterations * 1e9);
+    };
+    report("read literal", lookupProgram("1", "block", 0, iterations));
+    report("read global", lookupProgram("global", "block", 0, iterations));
+    for (int depth: { 0, 1, 4, 16, 64 }) {
+        report(fmt::format("read local {} blocks out", depth), lookupProgram("local", "block", depth, iterations));
+    }
+    for (int depth: { 1, 4, 16, 64 }) {
+        report(fmt::format("read upvalue {} functions out", depth), lookupProgram("local", "function", depth, iterations));
+    }
+}
+
+static void value() {
+    const size_t count = 4096;
+    const int rounds = 1024;
+    std::vector<Value> from(count), to(count);
+    for (size_t i = 0; i < count; i++) from[i] = Value(static_cast<double>(i));
+    double ops = static_cast<double>(count) * rounds;
+
+    double seconds = best(5, [&]() {
+        for (int r = 0; r < rounds; r++) {
+            std::copy(from.begin(), from.end(), to.begin());
+            keep(to.data());
+        }
+    });
+    fmt::print("value        {:<36} {:>10.3f} ns/op\n", "copy", seconds / ops * 1e9);
+
+    /* The interpreter checks both operand types before every arithmetic */
+    seconds = best(5, [&]() {
+        for (int r = 0; r < rounds; r++) {
+            Value sum(0.0);
+            for (size_t i = 0; i < count; i++) {
+                const Value& v = from[i];
+                if (sum.IsNumber() && v.IsNumber()) sum = Value(sum.AsNumber() + v.AsNumber());
+                keep(sum);
+            }
+        }
+    });
+    fmt::print("value        {:<36} {:>10.3f} ns/op\n", "checked add", seconds / ops * 1e9);
+
+    seconds = best(5, [&]() {
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 1; i < count; i++) {
+                keep(Value(from[i - 1].AsNumber() < from[i].AsNumber()));
+            }
+        }
+    });
+    fmt::print("value        {:<36} {:>10.3f} ns/op\n", "less", seconds / ops * 1e9);
+
+    seconds = best(5, [&]() {
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 1; i < count; i++) {
+                keep(from[i - 1] == from[i]);
+            }
+        }
+    });
+    fmt::print("value        {:<36} {:>10.3f} ns/op\n", "equal", seconds / ops * 1e9);
+}
+
+int main(int argc, char** argv) {
+    size_t maxSize = 16 << 20;
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 11, "--max-size=") == 0 && ParseSize(argv[i] + 11) > 0) {
+            maxSize = ParseSize(argv[i] + 11);
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+            filter = arg.substr(9);
+        } else {
+            fmt::print(stderr, "Usage: micro_bench [--max-size=16M] [--filter=text]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto selected = [&](const char* name) {
+        return std::string(name).find(filter) != std::string::npos;
+    };
+    if (selected("scanner")) scanner(maxSize);
+    if (selected("parser")) parser(maxSize);
+    if (selected("environment")) environment();
+    if (selected("value")) value();
+    return 0;
+}
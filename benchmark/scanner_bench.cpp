@@ -0,0 +1,67 @@
+/* Scanner throughput benchmark.
+ *
+ *   scanner_bench [script.l] [iterations]
+ *
+ * Without a script a few tens of MB of representative Lox source are
+ * generated in memory. Tokens are pulled with Scanner::Next() the way the
+ * Parser does it. Reports the best time over the iterations.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "scanner.h"
+#include "source_file.h"
+
+
+static std::string synthesize(size_t bytes) {
+    std::string source;
+    source.reserve(bytes + 256);
+    for (int i = 0; source.size() < bytes; i++) {
+        source += fmt::format(
+            "// helper number {}\n"
+            "fun compute{}(alpha, beta) {{\n"
+            "    var total = alpha * {}.5 + beta;\n"
+            "    if (total >= 1000) {{ return \"overflow in compute{}\"; }}\n"
+            "    while (total < 10) {{ total = total + 1; }}\n"
+            "    return total;\n"
+            "}}\n\n", i, i, i % 97, i);
+    }
+    return source;
+}
+
+int main(int argc, char** argv) {
+    SourceFile file;
+    std::string generated;
+    const char* source;
+    size_t length;
+
+    if (argc > 1) {
+        if (!file.Load(argv[1])) return EXIT_FAILURE;
+        source = file.Data();
+        length = file.Length();
+    } else {
+        generated = synthesize(64 * 1024 * 1024);
+        source = generated.data();
+        length = generated.size();
+    }
+    int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    double best = 1e300;
+    size_t count = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto begin = std::chrono::steady_clock::now();
+        Scanner scanner(source, length);
+        count = 0;
+        while (scanner.Next().type != TokenType::TEOF) count++;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        best = std::min(best, elapsed.count());
+    }
+
+    fmt::print("{} bytes, {} tokens, best of {}: {:.3f} s, {:.1f} MB/s\n",
+               length, count, iterations, best, length / best / 1e6);
+    return 0;
+}
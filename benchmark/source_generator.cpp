@@ -0,0 +1,61 @@
+#include "source_generator.h"
+
+#include <cstdlib>
+
+#include <fmt/format.h>
+
+
+/* index in base 26, padded with '0' to length */
+static std::string identifier(char kind, size_t index, int length) {
+    std::string name(1, kind);
+    do {
+        name += static_cast<char>('a' + index % 26);
+        index /= 26;
+    } while (index > 0);
+    if (name.size() < static_cast<size_t>(length)) name.append(length - name.size(), '0');
+    return name;
+}
+
+std::string GenerateSource(const SourceShape& shape) {
+    std::string source;
+    source.reserve(shape.bytes + 4096);
+    for (size_t i = 0; source.size() < shape.bytes; i++) {
+        std::string function = identifier('f', i, shape.identifierLength);
+        std::string outer = identifier('v', 0, shape.identifierLength);
+        source += fmt::format("fun {}(alpha, beta) {{\n"
+                              "    var {} = alpha * {}.5 + beta;\n", function, outer, i % 97);
+        std::string indent = "    ";
+        for (int depth = 1; depth <= shape.nesting; depth++) {
+            std::string inner = identifier('v', depth, shape.identifierLength);
+            source += fmt::format("{}{{\n{}    var {} = {} + {};\n", indent, indent, inner, outer, depth);
+            indent += "    ";
+            outer = inner;
+        }
+        source += fmt::format("{}while ({} < 10) {{ {} = {} + 1; }}\n"
+                              "{}if ({} >= 1000) {{ return \"overflow in {}\"; }}\n",
+                              indent, outer, outer, outer, indent, outer, function);
+        for (int depth = shape.nesting; depth >= 1; depth--) {
+            indent.resize(indent.size() - 4);
+            source += indent + "}\n";
+        }
+        source += fmt::format("    return nil;\n}}\n{}({}, 2);\n\n", function, i % 7);
+    }
+    return source;
+}
+
+size_t ParseSize(const char* text) {
+    char* end;
+    unsigned long long size = std::strtoull(text, &end, 10);
+    if (end == text) return 0;
+    std::string unit(end);
+    if (unit == "K" || unit == "KB") return size << 10;
+    if (unit == "M" || unit == "MB") return size << 20;
+    if (unit == "G" || unit == "GB") return size << 30;
+    return unit.empty() || unit == "B" ? size : 0;
+}
+
+std::string FormatSize(size_t bytes) {
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) return fmt::format("{}MB", bytes >> 20);
+    if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) return fmt::format("{}KB", bytes >> 10);
+    return fmt::format("{}B", bytes);
+}
@@ -0,0 +1,27 @@
+#ifndef LOX_SOURCE_GENERATOR_H
+#define LOX_SOURCE_GENERATOR_H
+
+#include <cstddef>
+#include <string>
+
+
+/* Shape of a synthetic Lox program. The program is a run of functions,
+ * each called once right after its declaration; a function's body nests
+ * blocks, each declaring a variable computed from the one outside it.
+ */
+struct SourceShape {
+    size_t bytes = 1024 * 1024;   // Generated until at least this long
+    int nesting = 4;              // Blocks nested in each function body
+    int identifierLength = 8;     // Length of every declared name, at least 4
+};
+
+/* A valid program of the given shape, printing nothing when run */
+std::string GenerateSource(const SourceShape& shape);
+
+/* Parses a size such as 4096, 64K, 1M or 100MB; returns 0 if malformed */
+size_t ParseSize(const char* text);
+
+/* The size in the largest unit it is a whole number of, like 64KB */
+std::string FormatSize(size_t bytes);
+
+#endif
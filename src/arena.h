@@ -0,0 +1,173 @@
+#ifndef LOX_ARENA_H
+#define LOX_ARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+/* Contiguous, fixed-size view over elements owned by someone else: an
+ * Arena for AST children, the value stack for call arguments */
+template<typename T>
+class Span {
+public:
+    Span(): data_(nullptr), size_(0) {}
+    Span(T* data, size_t size): data_(data), size_(size) {}
+
+    T* begin() const { return data_; }
+    T* end() const { return data_ + size_; }
+    T& operator[](size_t i) const { return data_[i]; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    T* data_;
+    size_t size_;
+};
+
+
+/* Bump allocator owning every node produced by one Parser::Parse() call.
+ * Memory comes from large blocks that are released together when the arena
+ * goes away. Objects that are not trivially destructible are recorded so
+ * their destructors still run; trivially destructible ones (the common
+ * case) cost nothing to free.
+ */
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        for (Finalizer* f = finalizers; f != nullptr; f = f->next) {
+            f->destroy(f->object);
+        }
+        while (blocks != nullptr) {
+            Block* previous = blocks->previous;
+            std::free(blocks);
+            blocks = previous;
+        }
+    }
+
+    template<typename T, typename... Args>
+    T* New(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        registerFinalizer(object, std::is_trivially_destructible<T>());
+        objects++;
+        return object;
+    }
+
+    /* Copies [first, last) into arena memory */
+    template<typename T, typename Iterator>
+    Span<T> NewArray(Iterator first, Iterator last) {
+        size_t size = last - first;
+        if (size == 0) return Span<T>();
+        T* data = static_cast<T*>(allocate(sizeof(T) * size, alignof(T)));
+        for (size_t i = 0; first != last; ++first, ++i) {
+            new (data + i) T(*first);
+            registerFinalizer(data + i, std::is_trivially_destructible<T>());
+        }
+        return Span<T>(data, size);
+    }
+
+    size_t BytesAllocated() const {
+        return bytesAllocated;
+    }
+
+    /* Objects made by New(), which for a Parser are the AST nodes */
+    size_t Objects() const {
+        return objects;
+    }
+
+private:
+    struct alignas(16) Block {
+        Block* previous;
+        size_t size;
+        size_t used;
+    };
+
+    struct Finalizer {
+        void (*destroy)(void*);
+        void* object;
+        Finalizer* next;
+    };
+
+public:
+    /* How much of the arena is in use, to give back what comes after */
+    struct Position {
+        Block* block;
+        size_t used;
+        Finalizer* finalizers;
+        size_t bytesAllocated;
+        size_t objects;
+    };
+
+    Position Tell() const {
+        return Position { blocks, blocks != nullptr ? blocks->used : 0, finalizers, bytesAllocated, objects };
+    }
+
+    /* Destroys everything allocated since position was told */
+    void Rewind(const Position& position) {
+        while (finalizers != position.finalizers) {
+            finalizers->destroy(finalizers->object);
+            finalizers = finalizers->next;
+        }
+        while (blocks != position.block) {
+            Block* previous = blocks->previous;
+            std::free(blocks);
+            blocks = previous;
+        }
+        if (blocks != nullptr) blocks->used = position.used;
+        bytesAllocated = position.bytesAllocated;
+        objects = position.objects;
+    }
+
+private:
+
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    void* allocate(size_t size, size_t align) {
+        if (blocks != nullptr) {
+            size_t offset = (blocks->used + align - 1) & ~(align - 1);
+            if (offset + size <= blocks->size) {
+                blocks->used = offset + size;
+                bytesAllocated += size;
+                return reinterpret_cast<char*>(blocks + 1) + offset;
+            }
+        }
+        newBlock(size + align);
+        return allocate(size, align);
+    }
+
+    void newBlock(size_t minimum) {
+        size_t size = minimum > BLOCK_SIZE ? minimum : BLOCK_SIZE;
+        Block* block = static_cast<Block*>(std::malloc(sizeof(Block) + size));
+        if (block == nullptr) throw std::bad_alloc();
+        block->previous = blocks;
+        block->size = size;
+        block->used = 0;
+        blocks = block;
+    }
+
+    template<typename T>
+    void registerFinalizer(T*, std::true_type) {
+    }
+
+    template<typename T>
+    void registerFinalizer(T* object, std::false_type) {
+        Finalizer* f = new (allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer;
+        f->destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+        f->object = object;
+        f->next = finalizers;
+        finalizers = f;
+    }
+
+    Block* blocks = nullptr;
+    Finalizer* finalizers = nullptr;
+    size_t bytesAllocated = 0;
+    size_t objects = 0;
+};
+
+#endif
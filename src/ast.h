@@ -1,10 +1,7 @@
 #ifndef LOX_AST_H
 #define LOX_AST_H
 
-#include <memory>
-#include <list>
-#include <vector>
-
+#include "arena.h"
 #include "token.h"
 #include "value.h"
 
@@ -27,11 +24,27 @@ class AssignmentExpression;
 class CallExpression;
 
 
+/* Where Resolver found a variable: LOCAL is a slot of the running
+ * function's frame, UPVALUE an index into its captured variables, and a
+ * GLOBAL a slot of the globals table, which the Interpreter looks up by
+ * name and caches in the node the first time it runs. */
+enum class VariableKind { GLOBAL, LOCAL, UPVALUE };
+
+
+/* A variable captured by a function: a slot of the enclosing function's
+ * frame if isLocal, otherwise one of the enclosing function's upvalues */
+struct UpvalueRef {
+    int index;
+    bool isLocal;
+};
+
+
+/* Nodes are allocated in an Arena by the Parser and never deleted one by
+ * one, so the hierarchy deliberately has no virtual destructor. */
+
 // Abstract Class
 class Statement {
 public:
-    virtual ~Statement() = default;
-
     class Visitor {
     public:
         virtual void Visit(PrintStatement& stmt) = 0;
@@ -45,6 +58,8 @@ public:
     };
 
     virtual void Accept(Visitor &visitor) = 0;
+
+    int line = 0;   // Where the statement starts, set by Parser
 };
 
 #define MAKE_STMT_VISITABLE virtual void Accept(Statement::Visitor& visitor) override { visitor.Visit(*this); }
@@ -52,8 +67,6 @@ public:
 
 class Expression {
 public:
-    virtual ~Expression() = default;
-
     class Visitor {
     public:
         virtual void Visit(BinaryExpression& expr) = 0;
@@ -67,21 +80,17 @@ public:
     };
 
     virtual void Accept(Visitor& visitor) = 0;
-
-private:
-    std::unique_ptr<Expression> expr;
 };
-using ExpressionUPtr = std::unique_ptr<Expression>;
 #define MAKE_EXPR_VISITABLE virtual void Accept(Expression::Visitor& visitor) override { visitor.Visit(*this); }
 
 
 /* Statement Declaration */
 class PrintStatement: public Statement {
 public:
-    std::unique_ptr<Expression> expression;
+    Expression* expression;
 
-    PrintStatement(std::unique_ptr<Expression> expression):
-        expression(std::move(expression)) {
+    PrintStatement(Expression* expression):
+        expression(expression) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -89,10 +98,10 @@ public:
 
 class ExpressionStatement: public Statement {
 public:
-    std::unique_ptr<Expression> expression;
+    Expression* expression;
 
-    ExpressionStatement(std::unique_ptr<Expression> expression):
-        expression(std::move(expression)) {
+    ExpressionStatement(Expression* expression):
+        expression(expression) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -100,14 +109,14 @@ public:
 
 class IfStatement: public Statement {
 public:
-    std::unique_ptr<Expression> expression;
-    std::unique_ptr<Statement> thenBranch;
-    std::unique_ptr<Statement> elseBranch;
-
-    IfStatement(std::unique_ptr<Expression> expression,
-                std::unique_ptr<Statement> thenBranch,
-                std::unique_ptr<Statement> elseBranch):
-        expression(std::move(expression)), thenBranch(std::move(thenBranch)), elseBranch(std::move(elseBranch)) {
+    Expression* expression;
+    Statement* thenBranch;
+    Statement* elseBranch;
+
+    IfStatement(Expression* expression,
+                Statement* thenBranch,
+                Statement* elseBranch):
+        expression(expression), thenBranch(thenBranch), elseBranch(elseBranch) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -116,23 +125,42 @@ public:
 class ReturnStatement: public Statement {
 public:
     Token keyword;
-    std::unique_ptr<Expression> value;
-    ReturnStatement(Token keyword, std::unique_ptr<Expression> value):
-        keyword(keyword), value(std::move(value)) {}
+    Expression* value;
+    /* value itself when it is a call: the callee's frame can then replace
+     * the returning one instead of nesting inside it */
+    CallExpression* tailCall = nullptr;
+    ReturnStatement(Token keyword, Expression* value):
+        keyword(keyword), value(value) {}
     MAKE_STMT_VISITABLE
 };
 
 
+/* A function body a lazy Parser checked and dropped: its source, from
+ * just after the '{' up to and including the matching '}' */
+struct DeferredBody {
+    const char* source;
+    size_t length;
+    int line;       // Line source starts on
+    Arena* arena;   // The one the rest of the tree lives in
+};
+
+
 class FunctionStatement: public Statement {
 public:
     Token name;
-    std::vector<Token> params;
-    std::list<std::unique_ptr<Statement>> stmts;
+    Span<Token> params;
+    Span<Statement*> stmts;
+    /* Set by a lazy Parser; stmts stays empty until ParseDeferred() */
+    DeferredBody* deferred = nullptr;
+    /* Set by Resolver */
+    int slot = -1;                  // Frame slot the function is stored in, -1 if global
+    int slotCount = 0;              // Frame size: parameters plus every local of the body
+    Span<UpvalueRef> upvalues;      // Variables captured from enclosing functions
 
     FunctionStatement(Token name,
-                      std::vector<Token>& params,
-                      std::list<std::unique_ptr<Statement>>& stmts):
-        name(name), params(params), stmts(std::move(stmts)) {
+                      Span<Token> params,
+                      Span<Statement*> stmts):
+        name(name), params(params), stmts(stmts) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -141,10 +169,11 @@ public:
 class VarStatement: public Statement {
 public:
     Token token;
-    std::unique_ptr<Expression> init;
+    Expression* init;
+    int slot = -1;   // Frame slot, set by Resolver; -1 if global
 
-    VarStatement(Token token, std::unique_ptr<Expression> init):
-        token(token), init(std::move(init)) {
+    VarStatement(Token token, Expression* init):
+        token(token), init(init) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -152,13 +181,13 @@ public:
 
 class WhileStatement: public Statement {
 public:
-    std::unique_ptr<Expression> expression;
-    std::unique_ptr<Statement> statement;
+    Expression* expression;
+    Statement* statement;
 
-    WhileStatement(std::unique_ptr<Expression> expression,
-                   std::unique_ptr<Statement> statement):
-        expression(std::move(expression)),
-        statement(std::move(statement)) {
+    WhileStatement(Expression* expression,
+                   Statement* statement):
+        expression(expression),
+        statement(statement) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -166,10 +195,14 @@ public:
 
 class BlockStatement: public Statement {
 public:
-    std::list<std::unique_ptr<Statement>> statements;
-
-    BlockStatement(std::list<std::unique_ptr<Statement>>& stmts)
-        : statements(std::move(stmts)) {
+    Span<Statement*> statements;
+    /* Set by Resolver: the block's locals start at firstSlot, and
+     * closesUpvalues tells whether a closure captured any of them */
+    int firstSlot = 0;
+    bool closesUpvalues = false;
+
+    BlockStatement(Span<Statement*> stmts)
+        : statements(stmts) {
     }
     MAKE_STMT_VISITABLE
 };
@@ -177,14 +210,31 @@ public:
 
 /* Expression Declaration */
 
+/* form is type feedback kept by the Interpreter. A node that first sees
+ * two numbers is quickened to the number-only form of its operator, which
+ * skips the generic operand checks; one that sees anything else, then or
+ * later, falls back to GENERIC for good. On the first visit the Interpreter
+ * also notes which operands are locals or literals, which it then reads
+ * without evaluating them. */
 class BinaryExpression: public Expression {
 public:
+    enum class Form: uint8_t {
+        UNSEEN, GENERIC, ADD, SUBTRACT, MULTIPLY, DIVIDE,
+        GREATER, GREATER_EQUAL, LESS, LESS_EQUAL, EQUAL, NOT_EQUAL
+    };
+
+    enum class Operand: uint8_t { EXPRESSION, LOCAL, LITERAL };
+
     Token op;
-    std::unique_ptr<Expression> left, right;
+    Expression* left;
+    Expression* right;
+    Form form = Form::UNSEEN;
+    Operand leftOperand = Operand::EXPRESSION;
+    Operand rightOperand = Operand::EXPRESSION;
     BinaryExpression(Token op,
-                     std::unique_ptr<Expression> lhs,
-                     std::unique_ptr<Expression> rhs)
-        : op(op), left(std::move(lhs)), right(std::move(rhs)) {
+                     Expression* lhs,
+                     Expression* rhs)
+        : op(op), left(lhs), right(rhs) {
     }
     MAKE_EXPR_VISITABLE
 };
@@ -193,8 +243,8 @@ public:
 class UnaryExpression: public Expression {
 public:
     Token op;
-    std::unique_ptr<Expression> expression;
-    UnaryExpression(Token op, std::unique_ptr<Expression> rhs): op(op), expression(std::move(rhs)) {
+    Expression* expression;
+    UnaryExpression(Token op, Expression* rhs): op(op), expression(rhs) {
     }
     MAKE_EXPR_VISITABLE
 };
@@ -202,14 +252,14 @@ public:
 
 class CallExpression: public Expression {
 public:
-    std::unique_ptr<Expression> callee;
+    Expression* callee;
     Token paren;
-    std::list<std::unique_ptr<Expression>> arguments;
+    Span<Expression*> arguments;
 
-    CallExpression(std::unique_ptr<Expression> callee,
+    CallExpression(Expression* callee,
                    Token paren,
-                   std::list<std::unique_ptr<Expression>>& arguments)
-        : callee(std::move(callee)), paren(paren), arguments(std::move(arguments)) {
+                   Span<Expression*> arguments)
+        : callee(callee), paren(paren), arguments(arguments) {
     }
     MAKE_EXPR_VISITABLE
 };
@@ -217,8 +267,8 @@ public:
 
 class GroupingExpression: public Expression {
 public:
-    std::unique_ptr<Expression> expression;
-    GroupingExpression(std::unique_ptr<Expression> rhs): expression(std::move(rhs)) {
+    Expression* expression;
+    GroupingExpression(Expression* rhs): expression(rhs) {
     }
     MAKE_EXPR_VISITABLE
 };
@@ -236,17 +286,21 @@ public:
 class LogicalExpression: public Expression {
 public:
     Token op;
-    std::unique_ptr<Expression> left, right;
-    LogicalExpression(std::unique_ptr<Expression> left, Token op, std::unique_ptr<Expression> right)
-        : op(op), left(std::move(left)), right(std::move(right)) {
+    Expression* left;
+    Expression* right;
+    LogicalExpression(Expression* left, Token op, Expression* right)
+        : op(op), left(left), right(right) {
     }
     MAKE_EXPR_VISITABLE
 };
 
 
+/* kind and index are filled in by Resolver, see VariableKind */
 class VariableExpression: public Expression {
 public:
     Token token;
+    VariableKind kind = VariableKind::GLOBAL;
+    int index = -1;
     VariableExpression(Token token): token(token) {
     }
     MAKE_EXPR_VISITABLE
@@ -256,9 +310,11 @@ public:
 class AssignmentExpression: public Expression {
 public:
     Token name;
-    std::unique_ptr<Expression> value;
-    AssignmentExpression(Token name, std::unique_ptr<Expression> value)
-        : name(name), value(std::move(value)) {
+    Expression* value;
+    VariableKind kind = VariableKind::GLOBAL;
+    int index = -1;
+    AssignmentExpression(Token name, Expression* value)
+        : name(name), value(value) {
     }
     MAKE_EXPR_VISITABLE
 };
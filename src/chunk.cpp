@@ -0,0 +1,136 @@
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "chunk.h"
+
+
+const char* OpCode2String(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT: return "CONSTANT";
+    case OpCode::NIL: return "NIL";
+    case OpCode::TRUE: return "TRUE";
+    case OpCode::FALSE: return "FALSE";
+    case OpCode::POP: return "POP";
+    case OpCode::GET_LOCAL: return "GET_LOCAL";
+    case OpCode::SET_LOCAL: return "SET_LOCAL";
+    case OpCode::GET_GLOBAL: return "GET_GLOBAL";
+    case OpCode::DEFINE_GLOBAL: return "DEFINE_GLOBAL";
+    case OpCode::SET_GLOBAL: return "SET_GLOBAL";
+    case OpCode::GET_UPVALUE: return "GET_UPVALUE";
+    case OpCode::SET_UPVALUE: return "SET_UPVALUE";
+    case OpCode::EQUAL: return "EQUAL";
+    case OpCode::NOT_EQUAL: return "NOT_EQUAL";
+    case OpCode::GREATER: return "GREATER";
+    case OpCode::GREATER_EQUAL: return "GREATER_EQUAL";
+    case OpCode::LESS: return "LESS";
+    case OpCode::LESS_EQUAL: return "LESS_EQUAL";
+    case OpCode::ADD: return "ADD";
+    case OpCode::SUBTRACT: return "SUBTRACT";
+    case OpCode::MULTIPLY: return "MULTIPLY";
+    case OpCode::DIVIDE: return "DIVIDE";
+    case OpCode::NEGATE: return "NEGATE";
+    case OpCode::POSITIVE: return "POSITIVE";
+    case OpCode::NOT: return "NOT";
+    case OpCode::PRINT: return "PRINT";
+    case OpCode::JUMP: return "JUMP";
+    case OpCode::JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+    case OpCode::LOOP: return "LOOP";
+    case OpCode::CALL: return "CALL";
+    case OpCode::TAIL_CALL: return "TAIL_CALL";
+    case OpCode::CLOSURE: return "CLOSURE";
+    case OpCode::CLOSE_UPVALUE: return "CLOSE_UPVALUE";
+    case OpCode::RETURN: return "RETURN";
+    }
+    return "Out of range";
+}
+
+
+void Chunk::Write(uint8_t byte, const Token& token) {
+    bool sameText = !locations.empty() && locations.back().length == token.length &&
+        lexemes.compare(locations.back().start, token.length, token.start, token.length) == 0;
+    if (!sameText || locations.back().line != token.line || locations.back().type != token.type) {
+        uint32_t start = sameText ? locations.back().start : static_cast<uint32_t>(lexemes.size());
+        if (!sameText) lexemes.append(token.start, token.length);
+        locations.push_back(Location { code.size(), token.type, token.line, start, token.length });
+    }
+    code.push_back(byte);
+}
+
+
+int Chunk::AddConstant(const Value& value) {
+    constants.push_back(value);
+    return constants.size() - 1;
+}
+
+
+Token Chunk::GetToken(size_t offset) const {
+    if (locations.empty()) return Token(TokenType::TEOF, "", 0, 0);
+    /* locations is sorted by offset; find the last run starting at or before offset */
+    size_t lo = 0, hi = locations.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (locations[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const Location& location = locations[lo];
+    return Token(location.type, lexemes.data() + location.start, location.length, location.line);
+}
+
+
+void Chunk::Disassemble(const char* name) const {
+    fmt::print("== {} ==\n", name);
+    for (size_t offset = 0; offset < code.size();) {
+        offset = DisassembleInstruction(offset);
+    }
+}
+
+
+size_t Chunk::DisassembleInstruction(size_t offset) const {
+    fmt::print("{:04d} {:4d} ", offset, GetLine(offset));
+
+    OpCode op = static_cast<OpCode>(code[offset]);
+    switch (op) {
+    case OpCode::CONSTANT:
+    case OpCode::GET_GLOBAL:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::SET_GLOBAL: {
+        int constant = (code[offset + 1] << 8) | code[offset + 2];
+        fmt::print("{:<16} {:4d} '{}'\n", OpCode2String(op), constant, constants[constant]);
+        return offset + 3;
+    }
+    case OpCode::GET_LOCAL:
+    case OpCode::SET_LOCAL:
+    case OpCode::GET_UPVALUE:
+    case OpCode::SET_UPVALUE:
+    case OpCode::CALL:
+    case OpCode::TAIL_CALL:
+        fmt::print("{:<16} {:4d}\n", OpCode2String(op), code[offset + 1]);
+        return offset + 2;
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::LOOP: {
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        int target = op == OpCode::LOOP ? offset + 3 - jump : offset + 3 + jump;
+        fmt::print("{:<16} {:4d} -> {}\n", OpCode2String(op), offset, target);
+        return offset + 3;
+    }
+    case OpCode::CLOSURE: {
+        int index = (code[offset + 1] << 8) | code[offset + 2];
+        const Function& function = *functions[index];
+        fmt::print("{:<16} {:4d} <fn {}>\n", OpCode2String(op), index, function.name);
+        offset += 3;
+        for (int i = 0; i < function.upvalueCount; i++) {
+            fmt::print("{:04d}    |                     {} {}\n", offset,
+                       code[offset] ? "local" : "upvalue", code[offset + 1]);
+            offset += 2;
+        }
+        return offset;
+    }
+    default:
+        fmt::print("{}\n", OpCode2String(op));
+        return offset + 1;
+    }
+}
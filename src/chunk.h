@@ -0,0 +1,118 @@
+#ifndef LOX_CHUNK_H
+#define LOX_CHUNK_H
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <string>
+
+#include "token.h"
+#include "value.h"
+
+struct Function;
+struct MachineCode;
+
+enum class OpCode: uint8_t {
+    CONSTANT,
+    NIL,
+    TRUE,
+    FALSE,
+    POP,
+    GET_LOCAL,
+    SET_LOCAL,
+    GET_GLOBAL,
+    DEFINE_GLOBAL,
+    SET_GLOBAL,
+    GET_UPVALUE,
+    SET_UPVALUE,
+    EQUAL,
+    NOT_EQUAL,
+    GREATER,
+    GREATER_EQUAL,
+    LESS,
+    LESS_EQUAL,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    NEGATE,
+    POSITIVE,
+    NOT,
+    PRINT,
+    JUMP,
+    JUMP_IF_FALSE,
+    LOOP,
+    CALL,
+    TAIL_CALL,
+    CLOSURE,
+    CLOSE_UPVALUE,
+    RETURN,
+};
+
+const char* OpCode2String(OpCode op);
+
+
+/* A compiled unit of bytecode.
+ * Operands follow their opcode inline: two big-endian bytes for constant
+ * indices and jump offsets, one byte for local, upvalue and argument-count
+ * indices.
+ * The token each instruction was compiled from is kept for runtime errors,
+ * run-length encoded since consecutive instructions often share one. Its
+ * text is copied into the chunk: the source may be gone by the time the
+ * chunk runs, as at the prompt.
+ */
+class Chunk {
+public:
+    void Write(uint8_t byte, const Token& token);
+
+    void Write(OpCode op, const Token& token) {
+        Write(static_cast<uint8_t>(op), token);
+    }
+
+    int AddConstant(const Value& value);
+
+    /* The token the instruction at offset came from; it points into this
+     * chunk */
+    Token GetToken(size_t offset) const;
+
+    int GetLine(size_t offset) const {
+        return GetToken(offset).line;
+    }
+
+    void Disassemble(const char* name) const;
+
+    size_t DisassembleInstruction(size_t offset) const;
+
+    std::vector<uint8_t> code;
+    std::vector<Value> constants;
+    std::vector<std::shared_ptr<Function>> functions;
+
+private:
+    /* Instructions from offset on, up to the next Location, came from a
+     * token whose text is lexemes[start, start + length) */
+    struct Location {
+        size_t offset;
+        TokenType type;
+        int line;
+        uint32_t start;
+        uint32_t length;
+    };
+
+    std::vector<Location> locations;
+    std::string lexemes;
+};
+
+
+/* Function prototype produced by the Compiler; the VM wraps it in a Closure */
+struct Function {
+    std::string name;
+    int line = 0;                             // Of the declaration
+    int arity = 0;
+    int upvalueCount = 0;
+    Chunk chunk;
+    int hotness = 0;                          // Calls and loop iterations, see Jit
+    const MachineCode* machineCode = nullptr;
+};
+
+#endif
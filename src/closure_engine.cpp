@@ -0,0 +1,788 @@
+#include <algorithm>
+#include <functional>
+#include <typeinfo>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "closure_engine.h"
+#include "lox_function.h"
+
+
+/* Every node starts with the function that runs it; that function casts
+ * the node back to the type it was built with. Nodes live in the arena of
+ * the tree they were compiled from. */
+struct ClosureEngine::Expr {
+    using Run = Value (*)(const Expr&, ClosureEngine&);
+    explicit Expr(Run run): run(run) {}
+
+    Value operator()(ClosureEngine& engine) const {
+        return run(*this, engine);
+    }
+
+    const Run run;
+};
+
+struct ClosureEngine::Stmt {
+    using Run = Completion (*)(const Stmt&, ClosureEngine&);
+    explicit Stmt(Run run): run(run) {}
+
+    Completion operator()(ClosureEngine& engine) const {
+        return run(*this, engine);
+    }
+
+    const Run run;
+};
+
+struct ClosureEngine::Call: Expr {
+    Call(Run run, Expr* callee, Span<Expr*> arguments, Token paren)
+        : Expr(run), callee(callee), arguments(arguments), paren(paren) {}
+    Expr* callee;
+    Span<Expr*> arguments;
+    Token paren;
+};
+
+/* Compiled FunctionStatement */
+struct ClosureEngine::Function {
+    Token name;
+    int arity;
+    int slotCount;
+    Span<Stmt*> body;
+    Span<UpvalueRef> upvalues;
+};
+
+
+class ClosureEngine::FunctionObject: public LoxCallable {
+public:
+    FunctionObject(const Function& code): LoxCallable(ObjType::COMPILED), code(code) {
+        upvalues.reserve(code.upvalues.size());
+    }
+
+    Value Call(Interpreter&, Span<Value>) override {
+        throw TypeError("Compiled functions can only be called by the ClosureEngine");
+    }
+
+    int Arity() override {
+        return code.arity;
+    }
+
+    void Trace(Heap& heap) override {
+        for (Upvalue* upvalue: upvalues) {
+            heap.Mark(upvalue);
+        }
+    }
+
+    const Function& code;
+    std::vector<Upvalue*> upvalues;
+};
+
+
+struct ClosureEngine::Nodes {
+    /* Expressions */
+
+    struct Constant: Expr {
+        Constant(const Value& value): Expr(evaluate), value(value) {}
+        static Value evaluate(const Expr& expr, ClosureEngine&) {
+            return static_cast<const Constant&>(expr).value;
+        }
+        Value value;
+    };
+
+    struct Local: Expr {
+        Local(int slot): Expr(evaluate), slot(slot) {}
+        static Value evaluate(const Expr& expr, ClosureEngine& engine) {
+            LOX_COUNT(localLookups);
+            return engine.slots[static_cast<const Local&>(expr).slot];
+        }
+        int slot;
+    };
+
+    struct Captured: Expr {
+        Captured(int index): Expr(evaluate), index(index) {}
+        static Value evaluate(const Expr& expr, ClosureEngine& engine) {
+            LOX_COUNT(upvalueLookups);
+            return *engine.function->upvalues[static_cast<const Captured&>(expr).index]->location;
+        }
+        int index;
+    };
+
+    struct Global: Expr {
+        Global(int slot, Token name): Expr(evaluate), slot(slot), name(name) {}
+        static Value evaluate(const Expr& expr, ClosureEngine& engine) {
+            auto& node = static_cast<const Global&>(expr);
+            LOX_COUNT(globalLookups);
+            return engine.globals.Get(node.slot, node.name);
+        }
+        int slot;
+        Token name;
+    };
+
+    struct Assign: Expr {
+        Assign(Run run, int index, Token name, Expr* value)
+            : Expr(run), index(index), name(name), value(value) {}
+        int index;
+        Token name;
+        Expr* value;
+    };
+
+    static Value assignLocal(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Assign&>(expr);
+        Value value = (*node.value)(engine);
+        LOX_COUNT(localLookups);
+        engine.slots[node.index] = value;
+        return value;
+    }
+
+    static Value assignCaptured(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Assign&>(expr);
+        Value value = (*node.value)(engine);
+        LOX_COUNT(upvalueLookups);
+        *engine.function->upvalues[node.index]->location = value;
+        return value;
+    }
+
+    static Value assignGlobal(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Assign&>(expr);
+        Value value = (*node.value)(engine);
+        LOX_COUNT(globalLookups);
+        engine.globals.Assign(node.index, node.name, value);
+        return value;
+    }
+
+    struct Binary: Expr {
+        Binary(Run run, Expr* left, Expr* right, Token op)
+            : Expr(run), left(left), right(right), op(op) {}
+        Expr* left;
+        Expr* right;
+        Token op;
+    };
+
+    /* The left operand stays on the stack while the right one runs, in
+     * case that collects */
+    static void operands(const Binary& node, ClosureEngine& engine, Value& left, Value& right) {
+        left = (*node.left)(engine);
+        if (left.IsObj()) {
+            engine.push(node.op, left);
+            right = (*node.right)(engine);
+            engine.top--;
+        } else {
+            right = (*node.right)(engine);
+        }
+    }
+
+    static Value add(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Binary&>(expr);
+        Value left, right;
+        operands(node, engine, left, right);
+        if (left.IsNumber() && right.IsNumber()) {
+            return Value(left.AsNumber() + right.AsNumber());
+        }
+        if (left.IsString() && right.IsString()) {
+            engine.push(node.op, left);
+            engine.push(node.op, right);
+            Value result(engine.heap.Concatenate(left.AsString(), right.AsString()));
+            engine.top -= 2;
+            return result;
+        }
+        throw RuntimeError(node.op, "Operands must be two numbers or two strings");
+    }
+
+    template<typename Op>
+    static Value arithmetic(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Binary&>(expr);
+        Value left, right;
+        operands(node, engine, left, right);
+        if (!left.IsNumber() || !right.IsNumber()) {
+            throw RuntimeError(node.op, "Operand must be a number");
+        }
+        return Value(Op()(left.AsNumber(), right.AsNumber()));
+    }
+
+    template<typename Comparator>
+    static Value comparison(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Binary&>(expr);
+        Value left, right;
+        operands(node, engine, left, right);
+        if (!Value::Comparable(left, right)) {
+            throw RuntimeError(node.op, "Operands must be two numbers or two strings");
+        }
+        return Value(compare(left, right, Comparator()));
+    }
+
+    static Value equal(const Expr& expr, ClosureEngine& engine) {
+        Value left, right;
+        operands(static_cast<const Binary&>(expr), engine, left, right);
+        return Value(left == right);
+    }
+
+    static Value notEqual(const Expr& expr, ClosureEngine& engine) {
+        Value left, right;
+        operands(static_cast<const Binary&>(expr), engine, left, right);
+        return Value(left != right);
+    }
+
+    static Value unknownBinary(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Binary&>(expr);
+        Value left, right;
+        operands(node, engine, left, right);
+        throw RuntimeError(node.op, "Unknown Binary Operand");
+    }
+
+    /* Binary operator whose right operand is a number literal, as in
+     * n - 1 or i < 10 */
+    struct BinaryNumber: Expr {
+        BinaryNumber(Run run, Expr* left, double right, Token op)
+            : Expr(run), left(left), right(right), op(op) {}
+        Expr* left;
+        double right;
+        Token op;
+    };
+
+    static Value addNumber(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const BinaryNumber&>(expr);
+        Value left = (*node.left)(engine);
+        if (!left.IsNumber()) {
+            throw RuntimeError(node.op, "Operands must be two numbers or two strings");
+        }
+        return Value(left.AsNumber() + node.right);
+    }
+
+    template<typename Op>
+    static Value arithmeticNumber(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const BinaryNumber&>(expr);
+        Value left = (*node.left)(engine);
+        if (!left.IsNumber()) {
+            throw RuntimeError(node.op, "Operand must be a number");
+        }
+        return Value(Op()(left.AsNumber(), node.right));
+    }
+
+    template<typename Comparator>
+    static Value comparisonNumber(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const BinaryNumber&>(expr);
+        Value left = (*node.left)(engine);
+        if (!left.IsNumber()) {
+            throw RuntimeError(node.op, "Operands must be two numbers or two strings");
+        }
+        return Value(Comparator()(left.AsNumber(), node.right));
+    }
+
+    struct Unary: Expr {
+        Unary(Run run, Expr* operand, Token op): Expr(run), operand(operand), op(op) {}
+        Expr* operand;
+        Token op;
+    };
+
+    static Value numberOperand(const Unary& node, ClosureEngine& engine) {
+        Value value = (*node.operand)(engine);
+        if (!value.IsNumber()) {
+            throw RuntimeError(node.op, "Operand must be a number");
+        }
+        return value;
+    }
+
+    static Value negate(const Expr& expr, ClosureEngine& engine) {
+        return -numberOperand(static_cast<const Unary&>(expr), engine);
+    }
+
+    static Value positive(const Expr& expr, ClosureEngine& engine) {
+        return numberOperand(static_cast<const Unary&>(expr), engine);
+    }
+
+    static Value unknownUnary(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Unary&>(expr);
+        numberOperand(node, engine);
+        throw RuntimeError(node.op, "Unknown Unary Operand");
+    }
+
+    struct Logical: Expr {
+        Logical(Run run, Expr* left, Expr* right): Expr(run), left(left), right(right) {}
+        Expr* left;
+        Expr* right;
+    };
+
+    static Value logicalOr(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Logical&>(expr);
+        Value left = (*node.left)(engine);
+        return left ? left : (*node.right)(engine);
+    }
+
+    static Value logicalAnd(const Expr& expr, ClosureEngine& engine) {
+        auto& node = static_cast<const Logical&>(expr);
+        Value left = (*node.left)(engine);
+        return !left ? left : (*node.right)(engine);
+    }
+
+    static Value call(const Expr& expr, ClosureEngine& engine) {
+        Value* base = engine.pushCall(static_cast<const Call&>(expr));
+        Value result = engine.call(base);
+        engine.top = base;
+        return result;
+    }
+
+    /* Statements */
+
+    struct Evaluate: Stmt {
+        Evaluate(Run run, Expr* expression): Stmt(run), expression(expression) {}
+        Expr* expression;
+    };
+
+    static Completion discard(const Stmt& stmt, ClosureEngine& engine) {
+        (*static_cast<const Evaluate&>(stmt).expression)(engine);
+        return Completion::NORMAL;
+    }
+
+    static Completion print(const Stmt& stmt, ClosureEngine& engine) {
+        Value value = (*static_cast<const Evaluate&>(stmt).expression)(engine);
+        fmt::print("{}\n", value);
+        return Completion::NORMAL;
+    }
+
+    struct Var: Stmt {
+        Var(Run run, int slot, Expr* init): Stmt(run), slot(slot), init(init) {}
+        int slot;
+        Expr* init;
+    };
+
+    static Completion defineLocal(const Stmt& stmt, ClosureEngine& engine) {
+        auto& node = static_cast<const Var&>(stmt);
+        Value value = node.init ? (*node.init)(engine) : Value();
+        engine.slots[node.slot] = value;
+        return Completion::NORMAL;
+    }
+
+    static Completion defineGlobal(const Stmt& stmt, ClosureEngine& engine) {
+        auto& node = static_cast<const Var&>(stmt);
+        Value value = node.init ? (*node.init)(engine) : Value();
+        engine.globals.Define(node.slot, value);
+        return Completion::NORMAL;
+    }
+
+    struct If: Stmt {
+        If(Expr* condition, Stmt* thenBranch, Stmt* elseBranch)
+            : Stmt(execute), condition(condition), thenBranch(thenBranch), elseBranch(elseBranch) {}
+        static Completion execute(const Stmt& stmt, ClosureEngine& engine) {
+            auto& node = static_cast<const If&>(stmt);
+            if ((*node.condition)(engine)) {
+                return (*node.thenBranch)(engine);
+            } else if (node.elseBranch != nullptr) {
+                return (*node.elseBranch)(engine);
+            }
+            return Completion::NORMAL;
+        }
+        Expr* condition;
+        Stmt* thenBranch;
+        Stmt* elseBranch;
+    };
+
+    struct While: Stmt {
+        While(Expr* condition, Stmt* body): Stmt(execute), condition(condition), body(body) {}
+        static Completion execute(const Stmt& stmt, ClosureEngine& engine) {
+            auto& node = static_cast<const While&>(stmt);
+            while ((*node.condition)(engine)) {
+                Completion completion = (*node.body)(engine);
+                if (completion != Completion::NORMAL) return completion;
+            }
+            return Completion::NORMAL;
+        }
+        Expr* condition;
+        Stmt* body;
+    };
+
+    struct Return: Stmt {
+        Return(Expr* value): Stmt(execute), value(value) {}
+        static Completion execute(const Stmt& stmt, ClosureEngine& engine) {
+            auto& node = static_cast<const Return&>(stmt);
+            engine.returnValue = node.value ? (*node.value)(engine) : Value();
+            return Completion::RETURN;
+        }
+        Expr* value;
+    };
+
+    /* return f(...): a compiled callee takes over the returning frame,
+     * see ClosureEngine::invoke() */
+    struct TailCall: Stmt {
+        TailCall(Call* call): Stmt(execute), call(call) {}
+        static Completion execute(const Stmt& stmt, ClosureEngine& engine) {
+            Value* base = engine.pushCall(*static_cast<const TailCall&>(stmt).call);
+            if (base->AsObj()->type == ObjType::COMPILED) {
+                engine.tailCallee = base;
+                return Completion::TAIL_CALL;
+            }
+            engine.returnValue = engine.call(base);
+            engine.top = base;
+            return Completion::RETURN;
+        }
+        Call* call;
+    };
+
+    struct Block: Stmt {
+        Block(Run run, Span<Stmt*> statements, int firstSlot)
+            : Stmt(run), statements(statements), firstSlot(firstSlot) {}
+        Span<Stmt*> statements;
+        int firstSlot;
+    };
+
+    static Completion block(const Stmt& stmt, ClosureEngine& engine) {
+        return engine.execute(static_cast<const Block&>(stmt).statements);
+    }
+
+    /* A block whose variables are captured; each entry gets fresh ones */
+    static Completion closingBlock(const Stmt& stmt, ClosureEngine& engine) {
+        auto& node = static_cast<const Block&>(stmt);
+        Completion completion = engine.execute(node.statements);
+        engine.openUpvalues.Close(engine.slots + node.firstSlot);
+        return completion;
+    }
+
+    struct Declare: Stmt {
+        Declare(Run run, const Function* code, int slot): Stmt(run), code(code), slot(slot) {}
+        const Function* code;
+        int slot;
+    };
+
+    /* Bound before capturing, which may allocate and collect */
+    static void capture(ClosureEngine& engine, FunctionObject& object) {
+        for (auto& upvalue: object.code.upvalues) {
+            object.upvalues.push_back(upvalue.isLocal ?
+                engine.openUpvalues.Capture(engine.slots + upvalue.index) :
+                engine.function->upvalues[upvalue.index]);
+        }
+    }
+
+    static Completion declareLocal(const Stmt& stmt, ClosureEngine& engine) {
+        auto& node = static_cast<const Declare&>(stmt);
+        auto object = engine.heap.Allocate<FunctionObject>(*node.code);
+        engine.slots[node.slot] = Value(object);
+        capture(engine, *object);
+        return Completion::NORMAL;
+    }
+
+    static Completion declareGlobal(const Stmt& stmt, ClosureEngine& engine) {
+        auto& node = static_cast<const Declare&>(stmt);
+        auto object = engine.heap.Allocate<FunctionObject>(*node.code);
+        engine.globals.Define(node.slot, Value(object));
+        capture(engine, *object);
+        return Completion::NORMAL;
+    }
+};
+
+
+/* Turns a resolved tree into nodes, choosing each node's function */
+class ClosureEngine::Compiler: public Expression::Visitor, public Statement::Visitor {
+public:
+    Compiler(ClosureEngine& engine, Arena& arena): engine(engine), arena(arena) {}
+
+    Span<Stmt*> Compile(Span<Statement*> statements) {
+        return compile(statements);
+    }
+
+    void Visit(PrintStatement& stmt) override {
+        result = arena.New<Nodes::Evaluate>(Nodes::print, compile(*stmt.expression));
+    }
+
+    void Visit(ExpressionStatement& stmt) override {
+        result = arena.New<Nodes::Evaluate>(Nodes::discard, compile(*stmt.expression));
+    }
+
+    void Visit(VarStatement& stmt) override {
+        Expr* init = stmt.init ? compile(*stmt.init) : nullptr;
+        if (stmt.slot < 0) {
+            result = arena.New<Nodes::Var>(Nodes::defineGlobal, engine.globals.Slot(stmt.token), init);
+        } else {
+            result = arena.New<Nodes::Var>(Nodes::defineLocal, stmt.slot, init);
+        }
+    }
+
+    void Visit(IfStatement& stmt) override {
+        Expr* condition = compile(*stmt.expression);
+        Stmt* thenBranch = compile(*stmt.thenBranch);
+        Stmt* elseBranch = stmt.elseBranch ? compile(*stmt.elseBranch) : nullptr;
+        result = arena.New<Nodes::If>(condition, thenBranch, elseBranch);
+    }
+
+    void Visit(ReturnStatement& stmt) override {
+        if (stmt.tailCall != nullptr) {
+            result = arena.New<Nodes::TailCall>(static_cast<Call*>(compile(*stmt.tailCall)));
+        } else {
+            result = arena.New<Nodes::Return>(stmt.value ? compile(*stmt.value) : nullptr);
+        }
+    }
+
+    void Visit(WhileStatement& stmt) override {
+        Expr* condition = compile(*stmt.expression);
+        result = arena.New<Nodes::While>(condition, compile(*stmt.statement));
+    }
+
+    void Visit(BlockStatement& stmt) override {
+        result = arena.New<Nodes::Block>(stmt.closesUpvalues ? Nodes::closingBlock : Nodes::block,
+                                         compile(stmt.statements), stmt.firstSlot);
+    }
+
+    void Visit(FunctionStatement& stmt) override {
+        int slot = stmt.slot < 0 ? engine.globals.Slot(stmt.name) : stmt.slot;
+        Function* code = arena.New<Function>(Function {
+            stmt.name, static_cast<int>(stmt.params.size()), stmt.slotCount,
+            compile(stmt.stmts), stmt.upvalues });
+        result = arena.New<Nodes::Declare>(
+            stmt.slot < 0 ? Nodes::declareGlobal : Nodes::declareLocal, code, slot);
+    }
+
+    void Visit(BinaryExpression& expr) override {
+        Expr* left = compile(*expr.left);
+        auto literal = dynamic_cast<LiteralExpression*>(expr.right);
+        if (literal != nullptr && literal->value.IsNumber()) {
+            if (Expr::Run run = numberOperation(expr.op.type)) {
+                value = arena.New<Nodes::BinaryNumber>(run, left, literal->value.AsNumber(), expr.op);
+                return;
+            }
+        }
+        Expr* right = compile(*expr.right);
+        value = arena.New<Nodes::Binary>(operation(expr.op.type), left, right, expr.op);
+    }
+
+    void Visit(UnaryExpression& expr) override {
+        Expr::Run run = Nodes::unknownUnary;
+        switch (expr.op.type) {
+        case TokenType::MINUS: run = Nodes::negate; break;
+        case TokenType::PLUS: run = Nodes::positive; break;
+        default: break;
+        }
+        value = arena.New<Nodes::Unary>(run, compile(*expr.expression), expr.op);
+    }
+
+    void Visit(CallExpression& expr) override {
+        Expr* callee = compile(*expr.callee);
+        std::vector<Expr*> arguments;
+        for (auto& argument: expr.arguments) {
+            arguments.push_back(compile(*argument));
+        }
+        value = arena.New<Call>(Nodes::call, callee,
+                                arena.NewArray<Expr*>(arguments.begin(), arguments.end()), expr.paren);
+    }
+
+    void Visit(GroupingExpression& expr) override {
+        value = compile(*expr.expression);
+    }
+
+    void Visit(LiteralExpression& expr) override {
+        value = arena.New<Nodes::Constant>(expr.value);
+    }
+
+    void Visit(LogicalExpression& expr) override {
+        Expr* left = compile(*expr.left);
+        Expr* right = compile(*expr.right);
+        value = arena.New<Nodes::Logical>(
+            expr.op.type == TokenType::OR ? Nodes::logicalOr : Nodes::logicalAnd, left, right);
+    }
+
+    void Visit(VariableExpression& expr) override {
+        switch (expr.kind) {
+        case VariableKind::LOCAL:
+            value = arena.New<Nodes::Local>(expr.index);
+            break;
+        case VariableKind::UPVALUE:
+            value = arena.New<Nodes::Captured>(expr.index);
+            break;
+        case VariableKind::GLOBAL:
+            value = arena.New<Nodes::Global>(engine.globals.Slot(expr.token), expr.token);
+            break;
+        }
+    }
+
+    void Visit(AssignmentExpression& expr) override {
+        Expr* assigned = compile(*expr.value);
+        switch (expr.kind) {
+        case VariableKind::LOCAL:
+            value = arena.New<Nodes::Assign>(Nodes::assignLocal, expr.index, expr.name, assigned);
+            break;
+        case VariableKind::UPVALUE:
+            value = arena.New<Nodes::Assign>(Nodes::assignCaptured, expr.index, expr.name, assigned);
+            break;
+        case VariableKind::GLOBAL:
+            value = arena.New<Nodes::Assign>(Nodes::assignGlobal,
+                                             engine.globals.Slot(expr.name), expr.name, assigned);
+            break;
+        }
+    }
+
+private:
+    Expr* compile(Expression& expr) {
+        expr.Accept(*this);
+        return value;
+    }
+
+    Stmt* compile(Statement& stmt) {
+        stmt.Accept(*this);
+        return result;
+    }
+
+    /* Like Interpreter::execute(), an expression statement in a list that
+     * is not an assignment or a call prints its value */
+    Span<Stmt*> compile(Span<Statement*> statements) {
+        std::vector<Stmt*> compiled;
+        for (auto statement: statements) {
+            compiled.push_back(compile(*statement));
+            if (typeid(*statement) == typeid(ExpressionStatement)) {
+                auto pexpr = static_cast<ExpressionStatement*>(statement)->expression;
+                if ((typeid(*pexpr) != typeid(AssignmentExpression)) &&
+                    (typeid(*pexpr) != typeid(CallExpression))) {
+                    compiled.back() = arena.New<Nodes::Evaluate>(
+                        Nodes::print, static_cast<Nodes::Evaluate*>(compiled.back())->expression);
+                }
+            }
+        }
+        return arena.NewArray<Stmt*>(compiled.begin(), compiled.end());
+    }
+
+    static Expr::Run operation(TokenType op) {
+        switch (op) {
+        case TokenType::PLUS: return Nodes::add;
+        case TokenType::MINUS: return Nodes::arithmetic<std::minus<double>>;
+        case TokenType::STAR: return Nodes::arithmetic<std::multiplies<double>>;
+        case TokenType::SLASH: return Nodes::arithmetic<std::divides<double>>;
+        case TokenType::GREATER: return Nodes::comparison<std::greater<>>;
+        case TokenType::GREATER_EQUAL: return Nodes::comparison<std::greater_equal<>>;
+        case TokenType::LESS: return Nodes::comparison<std::less<>>;
+        case TokenType::LESS_EQUAL: return Nodes::comparison<std::less_equal<>>;
+        case TokenType::EQUAL_EQUAL: return Nodes::equal;
+        case TokenType::BANG_EQUAL: return Nodes::notEqual;
+        default: return Nodes::unknownBinary;
+        }
+    }
+
+    /* nullptr when the operator has no form specialised for a number
+     * literal on the right */
+    static Expr::Run numberOperation(TokenType op) {
+        switch (op) {
+        case TokenType::PLUS: return Nodes::addNumber;
+        case TokenType::MINUS: return Nodes::arithmeticNumber<std::minus<double>>;
+        case TokenType::STAR: return Nodes::arithmeticNumber<std::multiplies<double>>;
+        case TokenType::SLASH: return Nodes::arithmeticNumber<std::divides<double>>;
+        case TokenType::GREATER: return Nodes::comparisonNumber<std::greater<double>>;
+        case TokenType::GREATER_EQUAL: return Nodes::comparisonNumber<std::greater_equal<double>>;
+        case TokenType::LESS: return Nodes::comparisonNumber<std::less<double>>;
+        case TokenType::LESS_EQUAL: return Nodes::comparisonNumber<std::less_equal<double>>;
+        default: return nullptr;
+        }
+    }
+
+    ClosureEngine& engine;
+    Arena& arena;
+    Expr* value = nullptr;
+    Stmt* result = nullptr;
+};
+
+
+ClosureEngine::ClosureEngine(Heap& heap): heap(heap), globals(heap), openUpvalues(heap) {
+    heap.AddRoots(this);
+    int clock = globals.Slot("clock");
+    globals.Define(clock, Value(heap.Allocate<Clock>()));
+}
+
+ClosureEngine::~ClosureEngine() {
+    heap.RemoveRoots(this);
+}
+
+void ClosureEngine::Interpret(Span<Statement*> statements, int slotCount, Arena& arena) {
+    Compiler compiler(*this, arena);
+    Span<Stmt*> program = compiler.Compile(statements);
+
+    slots = stack.data();
+    top = slots + slotCount;
+    std::fill(slots, top, Value());
+    try {
+        execute(program);
+    } catch (RuntimeError&) {
+        /* Unwind whatever calls were active when the error was raised */
+        openUpvalues.Close(stack.data());
+        slots = top = stack.data();
+        function = nullptr;
+        throw;
+    }
+    openUpvalues.Close(stack.data());
+}
+
+ClosureEngine::Completion ClosureEngine::execute(Span<Stmt*> statements) {
+    for (Stmt* statement: statements) {
+        Completion completion = (*statement)(*this);
+        if (completion != Completion::NORMAL) return completion;
+    }
+    return Completion::NORMAL;
+}
+
+Value* ClosureEngine::pushCall(const Call& call) {
+    Value* base = top;
+    Value callee = (*call.callee)(*this);
+    push(call.paren, callee);
+    for (Expr* argument: call.arguments) {
+        push(call.paren, (*argument)(*this));
+    }
+
+    if (!callee.IsCallable()) {
+        throw RuntimeError(call.paren, "Can only call functions");
+    }
+    LoxCallable* callable = callee.AsCallable();
+    if (static_cast<int>(call.arguments.size()) != callable->Arity()) {
+        throw RuntimeError(call.paren,
+            fmt::format("Expected {} arguments but got {}",
+                        callable->Arity(), call.arguments.size()));
+    }
+    return base;
+}
+
+Value ClosureEngine::call(Value* base) {
+    Obj* callee = base->AsObj();
+    if (callee->type == ObjType::COMPILED) {
+        return invoke(*static_cast<FunctionObject*>(callee), base + 1);
+    }
+    /* Natives are the only other callables this engine's programs see */
+    return static_cast<NativeFunction*>(callee)->Invoke(Span<Value>(base + 1, top - base - 1));
+}
+
+Value ClosureEngine::invoke(FunctionObject& callee, Value* arguments) {
+    Value* previousSlots = slots;
+    FunctionObject* previousFunction = function;
+    slots = arguments;
+    function = &callee;
+    LOX_COUNT(calls);
+    LOX_COUNT(frames);
+
+    Completion completion;
+    while (true) {
+        const Function& code = function->code;
+        if (stack.data() + stack.size() - slots < code.slotCount) {
+            throw RuntimeError(code.name, "Stack overflow");
+        }
+        top = slots + code.slotCount;
+        /* Locals may hold whatever an earlier frame left there, which the
+         * collector must not see */
+        std::fill(slots + code.arity, top, Value());
+
+        completion = execute(code.body);
+        if (completion != Completion::TAIL_CALL) break;
+
+        openUpvalues.Close(slots);
+        function = static_cast<FunctionObject*>(tailCallee->AsObj());
+        std::copy(tailCallee + 1, top, slots);
+        LOX_COUNT(calls);
+    }
+    Value result = completion == Completion::RETURN ? returnValue : Value();
+
+    openUpvalues.Close(slots);
+    top = slots;
+    slots = previousSlots;
+    function = previousFunction;
+    return result;
+}
+
+void ClosureEngine::MarkRoots(Heap&) {
+    for (Value* slot = stack.data(); slot < top; slot++) {
+        heap.Mark(*slot);
+    }
+    heap.Mark(returnValue);
+    heap.Mark(function);
+    globals.Mark();
+    openUpvalues.Mark();
+}
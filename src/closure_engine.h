@@ -0,0 +1,79 @@
+#ifndef LOX_CLOSURE_ENGINE_H
+#define LOX_CLOSURE_ENGINE_H
+
+#include <vector>
+
+#include "arena.h"
+#include "ast.h"
+#include "environment.h"
+#include "heap.h"
+#include "lox_exception.hpp"
+#include "upvalue.h"
+#include "value.h"
+
+
+/* Runs a resolved tree by first turning every statement and expression
+ * into a node holding a pointer to a function specialised for it. The
+ * operator, the kind and slot of a variable and the slot of a global are
+ * decided once, when the node is built, so running a node is a single
+ * indirect call: no Accept/Visit double dispatch and no switch on the
+ * operator. Frames, upvalues and globals work as in the Interpreter,
+ * whose output this engine must match.
+ */
+class ClosureEngine: private Heap::Roots {
+public:
+    ClosureEngine(Heap& heap);
+    ~ClosureEngine();
+
+    /* Compiles statements into arena, which must outlive every function
+     * they declare, and runs them. slotCount is what Resolver::Resolve()
+     * returned. */
+    void Interpret(Span<Statement*> statements, int slotCount, Arena& arena);
+
+private:
+    enum class Completion { NORMAL, RETURN, TAIL_CALL };
+
+    struct Expr;
+    struct Stmt;
+    struct Call;
+    struct Function;
+    class FunctionObject;
+    class Compiler;
+    struct Nodes;
+
+    Completion execute(Span<Stmt*> statements);
+
+    /* Evaluates the callee and arguments of call onto the stack and checks
+     * them; returns where the callee was pushed */
+    Value* pushCall(const Call& call);
+
+    /* Calls the callee pushed at base with the arguments above it */
+    Value call(Value* base);
+
+    /* Runs callee in a frame starting at its arguments, then any function
+     * it tail calls in the same frame */
+    Value invoke(FunctionObject& callee, Value* arguments);
+
+    void push(const Token& token, const Value& value) {
+        if (top == stack.data() + stack.size()) {
+            throw RuntimeError(token, "Stack overflow");
+        }
+        *top++ = value;
+    }
+
+    void MarkRoots(Heap&) override;
+
+    static constexpr size_t STACK_MAX = 1024 * 256;
+
+    Heap& heap;
+    Environment globals;
+    std::vector<Value> stack = std::vector<Value>(STACK_MAX);
+    Value* slots = stack.data();   // Frame of the running function
+    Value* top = slots;            // First slot past that frame
+    FunctionObject* function = nullptr;
+    Value returnValue;
+    Value* tailCallee = nullptr;   // Callee of a pending TAIL_CALL, its arguments follow
+    OpenUpvalues openUpvalues;
+};
+
+#endif
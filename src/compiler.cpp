@@ -0,0 +1,399 @@
+#include <typeinfo>
+
+#include "compiler.h"
+#include "lox.hpp"
+
+
+constexpr int MAX_LOCALS = 256;
+constexpr int MAX_UPVALUES = 256;
+
+
+std::shared_ptr<Function> Compiler::Compile(Span<Statement*> statements) {
+    FunctionState script { nullptr, std::make_shared<Function>(), {}, {}, {}, 0 };
+    script.function->name = "script";
+    /* Slot zero holds the callee itself */
+    script.locals.push_back(Local { Token(TokenType::TEOF, "", 0, 0), 0, false });
+    current = &script;
+
+    for (auto& statement: statements) {
+        compile(*statement);
+    }
+    emit(OpCode::NIL);
+    emit(OpCode::RETURN);
+
+    current = nullptr;
+    return script.function;
+}
+
+// Statement::Visitor Interface methods
+void Compiler::Visit(PrintStatement& stmt) {
+    compile(*stmt.expression);
+    emit(OpCode::PRINT);
+}
+
+void Compiler::Visit(ExpressionStatement& stmt) {
+    compile(*stmt.expression);
+    /* Mirror Interpreter::Interpret, which echoes bare expression statements */
+    auto pexpr = stmt.expression;
+    if ((typeid(*pexpr) != typeid(AssignmentExpression)) &&
+        (typeid(*pexpr) != typeid(CallExpression)) ) {
+        emit(OpCode::PRINT);
+    } else {
+        emit(OpCode::POP);
+    }
+}
+
+void Compiler::Visit(VarStatement& stmt) {
+    token = stmt.token;
+    if (stmt.init) {
+        compile(*stmt.init);
+    } else {
+        emit(OpCode::NIL);
+    }
+
+    if (current->scopeDepth > 0) {
+        /* The initializer is compiled before the local exists, so it sees
+         * any outer variable of the same name, as the tree walker does */
+        declareLocal(stmt.token);
+        return;
+    }
+    emitShort(OpCode::DEFINE_GLOBAL, nameConstant(stmt.token));
+}
+
+void Compiler::Visit(IfStatement& stmt) {
+    compile(*stmt.expression);
+    size_t thenJump = emitJump(OpCode::JUMP_IF_FALSE);
+    emit(OpCode::POP);
+    compile(*stmt.thenBranch);
+
+    size_t elseJump = emitJump(OpCode::JUMP);
+    patchJump(thenJump);
+    emit(OpCode::POP);
+    if (stmt.elseBranch != nullptr) {
+        compile(*stmt.elseBranch);
+    }
+    patchJump(elseJump);
+}
+
+void Compiler::Visit(WhileStatement& stmt) {
+    size_t loopStart = chunk().code.size();
+    compile(*stmt.expression);
+    size_t exitJump = emitJump(OpCode::JUMP_IF_FALSE);
+    emit(OpCode::POP);
+    compile(*stmt.statement);
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+    emit(OpCode::POP);
+}
+
+void Compiler::Visit(ReturnStatement& stmt) {
+    token = stmt.keyword;
+    if (current->enclosing == nullptr) {
+        throw error(stmt.keyword, "Cannot return from top-level code");
+    }
+    if (stmt.tailCall != nullptr) {
+        call(*stmt.tailCall, OpCode::TAIL_CALL);
+    } else if (stmt.value != nullptr) {
+        compile(*stmt.value);
+    } else {
+        emit(OpCode::NIL);
+    }
+    emit(OpCode::RETURN);
+}
+
+void Compiler::Visit(BlockStatement& stmt) {
+    beginScope();
+    for (auto& statement: stmt.statements) {
+        compile(*statement);
+    }
+    endScope();
+}
+
+void Compiler::Visit(FunctionStatement& stmt) {
+    token = stmt.name;
+    bool global = current->scopeDepth == 0;
+    if (!global) {
+        /* Declared before the body so that it can refer to itself */
+        emit(OpCode::NIL);
+        declareLocal(stmt.name);
+    }
+
+    FunctionState state { current, std::make_shared<Function>(), {}, {}, {}, 1 };
+    state.function->name = stmt.name.Lexeme();
+    state.function->line = stmt.name.line;
+    state.function->arity = stmt.params.size();
+    state.locals.push_back(Local { Token(TokenType::TEOF, "", 0, 0), 0, false });
+    current = &state;
+
+    for (auto& param: stmt.params) {
+        declareLocal(param);
+    }
+    for (auto& statement: stmt.stmts) {
+        compile(*statement);
+    }
+    emit(OpCode::NIL);
+    emit(OpCode::RETURN);
+
+    current = state.enclosing;
+    state.function->upvalueCount = state.upvalues.size();
+
+    auto& functions = chunk().functions;
+    if (functions.size() > UINT16_MAX) {
+        throw error(stmt.name, "Too many functions in one chunk");
+    }
+    functions.push_back(state.function);
+    emitShort(OpCode::CLOSURE, functions.size() - 1);
+    for (auto& upvalue: state.upvalues) {
+        emit(upvalue.isLocal ? 1 : 0);
+        emit(upvalue.index);
+    }
+
+    if (global) {
+        emitShort(OpCode::DEFINE_GLOBAL, nameConstant(stmt.name));
+    } else {
+        emit(OpCode::SET_LOCAL, current->locals.size() - 1);
+        emit(OpCode::POP);
+    }
+}
+
+// Expression::Visitor Interface methods
+void Compiler::Visit(BinaryExpression& expr) {
+    compile(*expr.left);
+    compile(*expr.right);
+
+    token = expr.op;
+    switch(expr.op.type) {
+    case TokenType::PLUS:          emit(OpCode::ADD); break;
+    case TokenType::MINUS:         emit(OpCode::SUBTRACT); break;
+    case TokenType::STAR:          emit(OpCode::MULTIPLY); break;
+    case TokenType::SLASH:         emit(OpCode::DIVIDE); break;
+    case TokenType::GREATER:       emit(OpCode::GREATER); break;
+    case TokenType::GREATER_EQUAL: emit(OpCode::GREATER_EQUAL); break;
+    case TokenType::LESS:          emit(OpCode::LESS); break;
+    case TokenType::LESS_EQUAL:    emit(OpCode::LESS_EQUAL); break;
+    case TokenType::EQUAL_EQUAL:   emit(OpCode::EQUAL); break;
+    case TokenType::BANG_EQUAL:    emit(OpCode::NOT_EQUAL); break;
+    default:
+        throw error(expr.op, "Unknown Binary Operand");
+    }
+}
+
+void Compiler::Visit(UnaryExpression& expr) {
+    compile(*expr.expression);
+
+    token = expr.op;
+    switch(expr.op.type) {
+    case TokenType::MINUS: emit(OpCode::NEGATE); break;
+    case TokenType::PLUS:  emit(OpCode::POSITIVE); break;
+    case TokenType::BANG:  emit(OpCode::NOT); break;
+    default:
+        throw error(expr.op, "Unknown Unary Operand");
+    }
+}
+
+void Compiler::Visit(CallExpression& expr) {
+    call(expr, OpCode::CALL);
+}
+
+void Compiler::call(CallExpression& expr, OpCode op) {
+    compile(*expr.callee);
+    for (auto& arg: expr.arguments) {
+        compile(*arg);
+    }
+    token = expr.paren;
+    emit(op, expr.arguments.size());
+}
+
+void Compiler::Visit(GroupingExpression& expr) {
+    compile(*expr.expression);
+}
+
+void Compiler::Visit(LiteralExpression& expr) {
+    switch (expr.value.Type()) {
+    case Value::ValueType::NUL:
+        emit(OpCode::NIL);
+        break;
+    case Value::ValueType::BOOL:
+        emit(expr.value.AsBool() ? OpCode::TRUE : OpCode::FALSE);
+        break;
+    default:
+        emitConstant(expr.value);
+        break;
+    }
+}
+
+void Compiler::Visit(LogicalExpression& expr) {
+    compile(*expr.left);
+    token = expr.op;
+    if (expr.op.type == TokenType::OR) {
+        size_t elseJump = emitJump(OpCode::JUMP_IF_FALSE);
+        size_t endJump = emitJump(OpCode::JUMP);
+        patchJump(elseJump);
+        emit(OpCode::POP);
+        compile(*expr.right);
+        patchJump(endJump);
+    } else {
+        size_t endJump = emitJump(OpCode::JUMP_IF_FALSE);
+        emit(OpCode::POP);
+        compile(*expr.right);
+        patchJump(endJump);
+    }
+}
+
+void Compiler::Visit(VariableExpression& expr) {
+    token = expr.token;
+    emitGet(expr.token);
+}
+
+void Compiler::Visit(AssignmentExpression& expr) {
+    compile(*expr.value);
+    token = expr.name;
+    emitSet(expr.name);
+}
+
+// Helpers
+void Compiler::emitConstant(const Value& value) {
+    int constant = chunk().AddConstant(value);
+    if (constant > UINT16_MAX) {
+        throw error("Too many constants in one chunk");
+    }
+    emitShort(OpCode::CONSTANT, constant);
+}
+
+uint16_t Compiler::nameConstant(const Token& name) {
+    ObjString* string = heap.MakeString(name.start, name.length);
+    auto it = current->names.find(string);
+    if (it != current->names.end()) {
+        return it->second;
+    }
+    int constant = chunk().AddConstant(Value(string));
+    if (constant > UINT16_MAX) {
+        throw error(name, "Too many constants in one chunk");
+    }
+    current->names.emplace(string, constant);
+    return constant;
+}
+
+size_t Compiler::emitJump(OpCode op) {
+    emit(op);
+    emit(0xff);
+    emit(0xff);
+    return chunk().code.size() - 2;
+}
+
+void Compiler::patchJump(size_t offset) {
+    size_t jump = chunk().code.size() - offset - 2;
+    if (jump > UINT16_MAX) {
+        throw error("Too much code to jump over");
+    }
+    chunk().code[offset] = (jump >> 8) & 0xff;
+    chunk().code[offset + 1] = jump & 0xff;
+}
+
+void Compiler::emitLoop(size_t loopStart) {
+    emit(OpCode::LOOP);
+    size_t offset = chunk().code.size() - loopStart + 2;
+    if (offset > UINT16_MAX) {
+        throw error("Loop body too large");
+    }
+    emit((offset >> 8) & 0xff);
+    emit(offset & 0xff);
+}
+
+void Compiler::beginScope() {
+    current->scopeDepth++;
+}
+
+void Compiler::endScope() {
+    current->scopeDepth--;
+    auto& locals = current->locals;
+    while (!locals.empty() && locals.back().depth > current->scopeDepth) {
+        emit(locals.back().isCaptured ? OpCode::CLOSE_UPVALUE : OpCode::POP);
+        locals.pop_back();
+    }
+}
+
+void Compiler::declareLocal(const Token& name) {
+    auto& locals = current->locals;
+    for (auto it = locals.rbegin(); it != locals.rend() && it->depth >= current->scopeDepth; ++it) {
+        if (it->name.SameLexeme(name)) {
+            throw error(name, "Variable with this name already declared in this scope");
+        }
+    }
+    if (locals.size() >= MAX_LOCALS) {
+        throw error(name, "Too many local variables in function");
+    }
+    locals.push_back(Local { name, current->scopeDepth, false });
+}
+
+int Compiler::resolveLocal(FunctionState* state, const Token& name) {
+    for (int i = state->locals.size() - 1; i > 0; i--) {
+        if (state->locals[i].name.SameLexeme(name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Compiler::resolveUpvalue(FunctionState* state, const Token& name) {
+    if (state->enclosing == nullptr) return -1;
+
+    int local = resolveLocal(state->enclosing, name);
+    if (local != -1) {
+        state->enclosing->locals[local].isCaptured = true;
+        return addUpvalue(state, local, true);
+    }
+
+    int upvalue = resolveUpvalue(state->enclosing, name);
+    if (upvalue != -1) {
+        return addUpvalue(state, upvalue, false);
+    }
+    return -1;
+}
+
+int Compiler::addUpvalue(FunctionState* state, uint8_t index, bool isLocal) {
+    auto& upvalues = state->upvalues;
+    for (size_t i = 0; i < upvalues.size(); i++) {
+        if (upvalues[i].index == index && upvalues[i].isLocal == isLocal) {
+            return i;
+        }
+    }
+    if (upvalues.size() >= MAX_UPVALUES) {
+        throw error("Too many closure variables in function");
+    }
+    upvalues.push_back(Upvalue { index, isLocal });
+    return upvalues.size() - 1;
+}
+
+void Compiler::emitGet(const Token& name) {
+    int slot = resolveLocal(current, name);
+    if (slot != -1) {
+        emit(OpCode::GET_LOCAL, slot);
+    } else if ((slot = resolveUpvalue(current, name)) != -1) {
+        emit(OpCode::GET_UPVALUE, slot);
+    } else {
+        emitShort(OpCode::GET_GLOBAL, nameConstant(name));
+    }
+}
+
+void Compiler::emitSet(const Token& name) {
+    int slot = resolveLocal(current, name);
+    if (slot != -1) {
+        emit(OpCode::SET_LOCAL, slot);
+    } else if ((slot = resolveUpvalue(current, name)) != -1) {
+        emit(OpCode::SET_UPVALUE, slot);
+    } else {
+        emitShort(OpCode::SET_GLOBAL, nameConstant(name));
+    }
+}
+
+CompileError Compiler::error(const Token& token, const char* message) {
+    Lox::Error(token, message);
+    return CompileError(token, message);
+}
+
+CompileError Compiler::error(const char* message) {
+    Lox::Error(token.line, message);
+    return CompileError(Token(TokenType::TEOF, "", 0, token.line), message);
+}
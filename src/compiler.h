@@ -0,0 +1,149 @@
+#ifndef LOX_COMPILER_H
+#define LOX_COMPILER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "ast.h"
+#include "chunk.h"
+#include "heap.h"
+#include "lox_exception.hpp"
+
+
+/* Lowers the statements produced by Parser::Parse() into bytecode for the VM.
+ * Locals live in stack slots and are resolved at compile time; variables
+ * captured by an inner function are reached through upvalues; everything
+ * declared at the top level is a global looked up by name.
+ */
+class Compiler: public Expression::Visitor, public Statement::Visitor {
+public:
+    Compiler(Heap& heap): heap(heap) {}
+
+    std::shared_ptr<Function> Compile(Span<Statement*>);
+
+    void Visit(PrintStatement& stmt) override;
+
+    void Visit(ExpressionStatement& stmt) override;
+
+    void Visit(VarStatement& stmt) override;
+
+    void Visit(IfStatement& stmt) override;
+
+    void Visit(ReturnStatement& stmt) override;
+
+    void Visit(WhileStatement& stmt) override;
+
+    void Visit(BlockStatement& stmt) override;
+
+    void Visit(FunctionStatement& stmt) override;
+
+    void Visit(BinaryExpression& expr) override;
+
+    void Visit(UnaryExpression& expr) override;
+
+    void Visit(CallExpression& expr) override;
+
+    void Visit(GroupingExpression& expr) override;
+
+    void Visit(LiteralExpression& expr) override;
+
+    void Visit(LogicalExpression& expr) override;
+
+    void Visit(VariableExpression& expr) override;
+
+    void Visit(AssignmentExpression& expr) override;
+
+private:
+    struct Local {
+        Token name;
+        int depth;
+        bool isCaptured;
+    };
+
+    struct Upvalue {
+        uint8_t index;
+        bool isLocal;
+    };
+
+    /* Per-function compilation state, chained to the enclosing function */
+    struct FunctionState {
+        FunctionState* enclosing;
+        std::shared_ptr<Function> function;
+        std::vector<Local> locals;
+        std::vector<Upvalue> upvalues;
+        std::unordered_map<ObjString*, uint16_t> names;
+        int scopeDepth;
+    };
+
+    void compile(Expression& expr) {
+        expr.Accept(*this);
+    }
+
+    void compile(Statement& stmt) {
+        stmt.Accept(*this);
+    }
+
+    Chunk& chunk() {
+        return current->function->chunk;
+    }
+
+    void emit(uint8_t byte) {
+        chunk().Write(byte, token);
+    }
+
+    void emit(OpCode op) {
+        chunk().Write(op, token);
+    }
+
+    void emit(OpCode op, uint8_t operand) {
+        emit(op);
+        emit(operand);
+    }
+
+    void emitShort(OpCode op, uint16_t operand) {
+        emit(op);
+        emit(static_cast<uint8_t>(operand >> 8));
+        emit(static_cast<uint8_t>(operand & 0xff));
+    }
+
+    void emitConstant(const Value& value);
+
+    /* Callee, arguments, then op: CALL, or TAIL_CALL for a returned call */
+    void call(CallExpression& expr, OpCode op);
+
+    uint16_t nameConstant(const Token& name);
+
+    size_t emitJump(OpCode op);
+
+    void patchJump(size_t offset);
+
+    void emitLoop(size_t loopStart);
+
+    void beginScope();
+
+    void endScope();
+
+    void declareLocal(const Token& name);
+
+    int resolveLocal(FunctionState* state, const Token& name);
+
+    int resolveUpvalue(FunctionState* state, const Token& name);
+
+    int addUpvalue(FunctionState* state, uint8_t index, bool isLocal);
+
+    void emitGet(const Token& name);
+
+    void emitSet(const Token& name);
+
+    CompileError error(const Token& token, const char* message);
+
+    CompileError error(const char* message);
+
+    Heap& heap;
+    FunctionState* current = nullptr;
+    Token token = Token(TokenType::TEOF, "", 0, 1);   // What instructions are emitted for, for errors
+};
+
+#endif
@@ -1,38 +1,15 @@
 #include "environment.h"
 
 
-Environment::Environment(std::shared_ptr<Environment> environment) {
-    enclosing = environment;
-}
-
-std::shared_ptr<Environment> Environment::EnclosingScope() const {
-    return enclosing;
-}
-
-void Environment::Define(const std::string& name, const Value& value) {
-    env.insert(std::pair<std::string, Value>(name, value));
-}
-
-void Environment::Assign(const Token &name, const Value& value) {
-    if (env.find(name.lexeme) != env.end()) {
-        env[name.lexeme] = value;
-        return;
+int Environment::Slot(const char* name, size_t length) {
+    ObjString* key = heap.MakeString(name, length);
+    auto it = slots.find(key);
+    if (it != slots.end()) {
+        return it->second;
     }
 
-    if (enclosing != nullptr) {
-        enclosing->Assign(name, value);
-        return;
-    }
-
-    throw RuntimeError(name, "Variable undefined at Environment::Assign");
+    int slot = globals.size();
+    slots.emplace(key, slot);
+    globals.push_back(Global { key, Value(), false });
+    return slot;
 }
-
-Value Environment::Get(Token name) {
-    if (env.find(name.lexeme) != env.end()) {
-        return env[name.lexeme];
-    }
-
-    if (enclosing) return enclosing->Get(name);
-
-    throw RuntimeError(name, "Variable undefined at Environment::Get");
-}
\ No newline at end of file
@@ -1,26 +1,74 @@
 #ifndef LOX_ENVIRONMENT_HPP
 #define LOX_ENVIRONMENT_HPP
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "heap.h"
 #include "lox_exception.hpp"
 #include "value.h"
 
+
+/* Global variables in indexed slots. A name gets its slot the first time
+ * it is seen, keyed by its interned string, and keeps it for the life of
+ * the Environment; the slot stays undefined until a declaration runs.
+ * Callers cache the slot, so a global costs a hash lookup only once per
+ * place it appears in the program.
+ */
 class Environment {
 public:
-    Environment() = default;
+    Environment(Heap& heap): heap(heap) {}
+
+    /* Slot for name, which may not be defined yet */
+    int Slot(const Token& name) {
+        return Slot(name.start, name.length);
+    }
 
-    Environment(std::shared_ptr<Environment> environment);
+    int Slot(const std::string& name) {
+        return Slot(name.data(), name.size());
+    }
 
-    std::shared_ptr<Environment> EnclosingScope() const;
+    int Slot(const char* name, size_t length);
 
-    void Define(const std::string& name, const Value& value);
+    void Define(int slot, const Value& value) {
+        globals[slot].value = value;
+        globals[slot].defined = true;
+    }
 
-    void Assign(const Token &name, const Value& value);
+    void Assign(int slot, const Token& name, const Value& value) {
+        Global& global = globals[slot];
+        if (!global.defined) {
+            throw RuntimeError(name, "Variable undefined at Environment::Assign");
+        }
+        global.value = value;
+    }
 
-    Value Get(Token name);
+    Value Get(int slot, const Token& name) const {
+        const Global& global = globals[slot];
+        if (!global.defined) {
+            throw RuntimeError(name, "Variable undefined at Environment::Get");
+        }
+        return global.value;
+    }
+
+    void Mark() {
+        for (auto& global: globals) {
+            heap.Mark(global.name);
+            heap.Mark(global.value);
+        }
+    }
 
 private:
-    std::map<std::string, Value> env;
-    std::shared_ptr<Environment> enclosing = nullptr;
+    struct Global {
+        ObjString* name;
+        Value value;
+        bool defined;
+    };
+
+    Heap& heap;
+    std::vector<Global> globals;
+    std::unordered_map<ObjString*, int, ObjStringHash> slots;
 };
 
 #endif
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include "heap.h"
+
+
+/* Bound by reference in std::max(), which needs a definition before C++17 */
+constexpr size_t Heap::FIRST_COLLECTION;
+
+Heap::Heap(): strings(64, nullptr) {
+}
+
+Heap::~Heap() {
+    while (objects != nullptr) {
+        Obj* next = objects->next;
+        delete objects;
+        objects = next;
+    }
+}
+
+ObjString* Heap::MakeString(const char* chars, size_t length) {
+    uint32_t hash = ObjString::Hash(chars, length);
+    ObjString* interned = findString(hash, [=](const ObjString& string) {
+        return string.length == length && std::memcmp(string.Chars(), chars, length) == 0;
+    });
+    if (interned != nullptr) {
+        return reuse(interned);
+    }
+
+    ObjString* string = allocateString(length, hash);
+    std::memcpy(const_cast<char*>(string->Chars()), chars, length);
+    internString(string);
+    return string;
+}
+
+ObjString* Heap::Concatenate(const ObjString* lhs, const ObjString* rhs) {
+    size_t length = lhs->length + rhs->length;
+    uint32_t hash = ObjString::Hash(rhs->Chars(), rhs->length, lhs->hash);
+    ObjString* interned = findString(hash, [=](const ObjString& string) {
+        return string.length == length &&
+            std::memcmp(string.Chars(), lhs->Chars(), lhs->length) == 0 &&
+            std::memcmp(string.Chars() + lhs->length, rhs->Chars(), rhs->length) == 0;
+    });
+    if (interned != nullptr) {
+        return reuse(interned);
+    }
+
+    ObjString* string = allocateString(length, hash);
+    char* chars = const_cast<char*>(string->Chars());
+    std::memcpy(chars, lhs->Chars(), lhs->length);
+    std::memcpy(chars + lhs->length, rhs->Chars(), rhs->length);
+    internString(string);
+    return string;
+}
+
+ObjString* Heap::allocateString(size_t length, uint32_t hash) {
+    size_t size = sizeof(ObjString) + length + 1;
+    reserve(size);
+    void* memory = ::operator new(size);
+    ObjString* string = new (memory) ObjString(length, hash);
+    const_cast<char*>(string->Chars())[length] = '\0';
+    return track(string, size);
+}
+
+void Heap::internString(ObjString* string) {
+    if ((stringCount + 1) * 4 > strings.size() * 3) {
+        std::vector<ObjString*> old(strings.size() * 2, nullptr);
+        old.swap(strings);
+        stringCount = 0;
+        for (ObjString* entry: old) {
+            if (entry != nullptr) internString(entry);
+        }
+    }
+
+    size_t mask = strings.size() - 1;
+    size_t index = string->hash & mask;
+    while (strings[index] != nullptr) {
+        index = (index + 1) & mask;
+    }
+    strings[index] = string;
+    stringCount++;
+}
+
+void Heap::AddRoots(Roots* holder) {
+    roots.push_back(holder);
+}
+
+void Heap::RemoveRoots(Roots* holder) {
+    roots.erase(std::remove(roots.begin(), roots.end(), holder), roots.end());
+}
+
+void Heap::Collect() {
+    auto start = std::chrono::steady_clock::now();
+    size_t before = bytesAllocated;
+
+    for (Roots* holder: roots) {
+        holder->MarkRoots(*this);
+    }
+    while (!gray.empty()) {
+        Obj* object = gray.back();
+        gray.pop_back();
+        object->Trace(*this);
+    }
+    removeUnmarkedStrings();
+    sweep();
+
+    nextCollection = std::max(bytesAllocated * GROW_FACTOR, FIRST_COLLECTION);
+
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    stats.collections++;
+    stats.bytesFreed += before - bytesAllocated;
+    stats.pauseSeconds += pause.count();
+    stats.maxPauseSeconds = std::max(stats.maxPauseSeconds, pause.count());
+}
+
+/* Drops strings about to be swept from the intern table. Linear probing
+ * cannot leave holes in a chain, so the survivors are inserted again. */
+void Heap::removeUnmarkedStrings() {
+    std::vector<ObjString*> old(strings.size(), nullptr);
+    old.swap(strings);
+    stringCount = 0;
+    for (ObjString* entry: old) {
+        if (entry != nullptr && (entry->marked || entry->pinned)) internString(entry);
+    }
+}
+
+void Heap::sweep() {
+    Obj** link = &objects;
+    while (*link != nullptr) {
+        Obj* object = *link;
+        if (object->marked || object->pinned) {
+            object->marked = false;
+            link = &object->next;
+            continue;
+        }
+        *link = object->next;
+        bytesAllocated -= object->size;
+        stats.objectsFreed++;
+        delete object;
+    }
+}
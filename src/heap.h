@@ -0,0 +1,167 @@
+#ifndef LOX_HEAP_H
+#define LOX_HEAP_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+
+/* Owns every Obj created while running a program. Objects are kept on an
+ * intrusive list and reclaimed by a mark-sweep collector: once the bytes
+ * allocated since the last collection pass a threshold, everything
+ * reachable from the registered Roots is marked and the rest is freed.
+ * Strings are interned: the heap keeps one ObjString per distinct text.
+ * The intern table does not keep strings alive.
+ *
+ * Compile with LOX_STRESS_GC to collect before every allocation.
+ */
+class Heap {
+public:
+    /* Holder of references the collector cannot find by tracing objects,
+     * such as the stacks and globals of an engine */
+    class Roots {
+    public:
+        virtual void MarkRoots(Heap&) = 0;
+
+    protected:
+        ~Roots() = default;
+    };
+
+    /* While a Pin is alive, strings created or looked up are pinned and
+     * never collected. The front end holds one, since literals and names
+     * live in the AST and in compiled chunks, which are not traced. */
+    class Pin {
+    public:
+        Pin(Heap& heap): heap(heap) { heap.pinning++; }
+        ~Pin() { heap.pinning--; }
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+
+    private:
+        Heap& heap;
+    };
+
+    struct Stats {
+        size_t collections = 0;
+        size_t bytesAllocated = 0;   // Total over the life of the heap
+        size_t bytesFreed = 0;
+        size_t objectsFreed = 0;
+        size_t peakBytes = 0;        // Most bytes allocated at any one time
+        double pauseSeconds = 0;
+        double maxPauseSeconds = 0;
+    };
+
+    Heap();
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+    ~Heap();
+
+    template<typename T, typename... Args>
+    T* Allocate(Args&&... args) {
+        reserve(sizeof(T));
+        return track(new T(std::forward<Args>(args)...), sizeof(T));
+    }
+
+    ObjString* MakeString(const char* chars, size_t length);
+
+    ObjString* MakeString(const std::string& chars) {
+        return MakeString(chars.data(), chars.size());
+    }
+
+    ObjString* Concatenate(const ObjString* lhs, const ObjString* rhs);
+
+    void AddRoots(Roots* roots);
+
+    void RemoveRoots(Roots* roots);
+
+    void Mark(Obj* object) {
+        if (object == nullptr || object->marked) return;
+        object->marked = true;
+        gray.push_back(object);
+    }
+
+    void Mark(const Value& value) {
+        if (value.IsObj()) Mark(value.AsObj());
+    }
+
+    void Collect();
+
+    size_t BytesAllocated() const {
+        return bytesAllocated;
+    }
+
+    const Stats& GetStats() const {
+        return stats;
+    }
+
+private:
+    static constexpr size_t FIRST_COLLECTION = 1024 * 1024;
+    static constexpr size_t GROW_FACTOR = 2;
+
+    /* Collects first if allocating size more bytes passes the threshold, so
+     * the object about to be created is never at risk */
+    void reserve(size_t size) {
+#ifdef LOX_STRESS_GC
+        Collect();
+#else
+        if (bytesAllocated + size > nextCollection) {
+            Collect();
+        }
+#endif
+    }
+
+    template<typename T>
+    T* track(T* object, size_t size) {
+        object->size = static_cast<uint32_t>(size);
+        object->pinned = pinning > 0;
+        object->next = objects;
+        objects = object;
+        bytesAllocated += size;
+        stats.bytesAllocated += size;
+        if (bytesAllocated > stats.peakBytes) stats.peakBytes = bytesAllocated;
+        return object;
+    }
+
+    ObjString* allocateString(size_t length, uint32_t hash);
+
+    /* An interned string handed out again */
+    ObjString* reuse(ObjString* string) {
+        if (pinning > 0) string->pinned = true;
+        return string;
+    }
+
+    /* Open addressing lookup in the intern table; equals(str) decides a match */
+    template<typename Equals>
+    ObjString* findString(uint32_t hash, Equals equals) const {
+        size_t mask = strings.size() - 1;
+        for (size_t index = hash & mask; strings[index] != nullptr; index = (index + 1) & mask) {
+            ObjString* string = strings[index];
+            if (string->hash == hash && equals(*string)) {
+                return string;
+            }
+        }
+        return nullptr;
+    }
+
+    void internString(ObjString* string);
+
+    void removeUnmarkedStrings();
+
+    void sweep();
+
+    Obj* objects = nullptr;
+    std::vector<ObjString*> strings;
+    size_t stringCount = 0;
+
+    std::vector<Roots*> roots;
+    std::vector<Obj*> gray;
+    size_t bytesAllocated = 0;
+    size_t nextCollection = FIRST_COLLECTION;
+    int pinning = 0;
+    Stats stats;
+};
+
+#endif
@@ -2,40 +2,148 @@
 #define LOX_EVALUATOR_HPP
 
 #include <typeinfo>
-#include <list>
+#include <functional>
 
 #include <fmt/ostream.h>
 #include <fmt/format.h>
 
 #include "interpreter.h"
 #include "lox_function.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "resolver.h"
+
+Interpreter::Interpreter(Heap& heap): heap(heap), globals(heap), openUpvalues(heap) {
+    heap.AddRoots(this);
+    int clock = globals.Slot("clock");
+    globals.Define(clock, Value(heap.Allocate<Clock>()));
+}
+
+Interpreter::~Interpreter() {
+    heap.RemoveRoots(this);
+}
+
+void Interpreter::Interpret(Span<Statement*> statements, int slotCount) {
+    slots = stack.data();
+    top = slots + slotCount;
+    std::fill(slots, top, Value());
+    try {
+        execute(statements);
+    } catch (RuntimeError&) {
+        /* Unwind whatever calls were active when the error was raised */
+        openUpvalues.Close(stack.data());
+        slots = top = stack.data();
+        function = nullptr;
+        completion = Completion::NORMAL;
+        if (profiler != nullptr) profiler->Unwind();
+        throw;
+    }
+    openUpvalues.Close(stack.data());
+}
+
+Value Interpreter::Call(LoxFunction& callee, Span<Value> arguments) {
+    Value* previousSlots = slots;
+    LoxFunction* previousFunction = function;
+    if (arguments.end() == top) {
+        slots = arguments.begin();
+    } else {
+        if (stack.data() + stack.size() - top < static_cast<ptrdiff_t>(arguments.size())) {
+            throw RuntimeError(callee.Declaration().name, "Stack overflow");
+        }
+        slots = top;
+        std::copy(arguments.begin(), arguments.end(), slots);
+    }
+    function = &callee;
+    if (profiler != nullptr) profiler->Enter(callee.Declaration());
+    LOX_COUNT(calls);
+    LOX_COUNT(frames);
+
+    while (true) {
+        FunctionStatement& declaration = function->Declaration();
+        if (declaration.deferred != nullptr) parseDeferred(declaration);
+        if (stack.data() + stack.size() - slots < declaration.slotCount) {
+            throw RuntimeError(declaration.name, "Stack overflow");
+        }
+        top = slots + declaration.slotCount;
+        /* Locals may hold whatever an earlier frame left there, which the
+         * collector must not see */
+        std::fill(slots + declaration.params.size(), top, Value());
+
+        execute(declaration.stmts);
+        if (completion != Completion::TAIL_CALL) break;
+
+        /* The callee and its arguments were left on top of the stack by the
+         * return statement; they take over this frame */
+        completion = Completion::NORMAL;
+        openUpvalues.Close(slots);
+        function = static_cast<LoxFunction*>(tailCallee->AsCallable());
+        std::copy(tailCallee + 1, top, slots);
+        if (profiler != nullptr) profiler->Replace(function->Declaration());
+        LOX_COUNT(calls);
+    }
+
+    Value result;
+    if (completion == Completion::RETURN) {
+        result = returnValue;
+        completion = Completion::NORMAL;
+    }
+
+    openUpvalues.Close(slots);
+    top = slots;
+    slots = previousSlots;
+    function = previousFunction;
+    if (profiler != nullptr) profiler->Exit();
+    return result;
+}
 
-Interpreter::Interpreter() {
-    auto clock_func = std::make_shared<Clock>(Clock());
-    environment->Define("clock", Value(clock_func));
+void Interpreter::parseDeferred(FunctionStatement& declaration) {
+    Arena& arena = *declaration.deferred->arena;
+    {
+        Heap::Pin pin(heap);
+        declaration.stmts = Parser::ParseDeferred(*declaration.deferred, heap);
+        if (optimization > 0) {
+            Optimizer optimizer(heap, arena);
+            optimizer.Optimize(declaration.stmts);
+        }
+    }
+    Resolver resolver(arena);
+    resolver.ResolveDeferred(declaration);
+    declaration.deferred = nullptr;
 }
 
-void Interpreter::Interpret(const std::list<std::unique_ptr<Statement>>& statements) {
+void Interpreter::execute(Span<Statement*> statements) {
     for(auto& statement: statements) {
         evaluate(*statement);
+        if (completion != Completion::NORMAL) return;
 
         // TODO(telescreen): How to get rid of this dynamic type check and cast?
-        auto pstmt = statement.get();
+        auto pstmt = statement;
         if (typeid(*pstmt) == typeid(ExpressionStatement)) {
             auto expr = dynamic_cast<ExpressionStatement*>(pstmt);
-            auto pexpr = expr->expression.get();
+            auto pexpr = expr->expression;
             if ((typeid(*pexpr) != typeid(AssignmentExpression)) &&
                 (typeid(*pexpr) != typeid(CallExpression)) ) {
-                fmt::print(fmt::format("{}\n", value));
+                fmt::print("{}\n", value);
             }
         }
     }
 }
 
+void Interpreter::MarkRoots(Heap&) {
+    for (Value* slot = stack.data(); slot < top; slot++) {
+        heap.Mark(*slot);
+    }
+    heap.Mark(value);
+    heap.Mark(returnValue);
+    heap.Mark(function);
+    globals.Mark();
+    openUpvalues.Mark();
+}
+
 // Statement::Visitor Interface methods
 void Interpreter::Visit(PrintStatement& stmt) {
     Value value = evaluate(*stmt.expression);
-    fmt::print(fmt::format("{}\n", value));
+    fmt::print("{}\n", value);
 }
 
 void Interpreter::Visit(ExpressionStatement& stmt) {
@@ -43,11 +151,17 @@ void Interpreter::Visit(ExpressionStatement& stmt) {
 }
 
 void Interpreter::Visit(VarStatement& stmt) {
+    /* Looking up a global's slot may allocate its name, so it comes first */
+    int global = stmt.slot < 0 ? globals.Slot(stmt.token) : -1;
     Value val;
     if (stmt.init) {
         val = evaluate(*stmt.init);
     }
-    environment->Define(stmt.token.lexeme, val);
+    if (stmt.slot < 0) {
+        globals.Define(global, val);
+    } else {
+        slots[stmt.slot] = val;
+    }
 }
 
 void Interpreter::Visit(IfStatement& stmt) {
@@ -64,70 +178,161 @@ void Interpreter::Visit(IfStatement& stmt) {
 void Interpreter::Visit(WhileStatement& stmt) {
     while (evaluate(*stmt.expression)) {
         evaluate(*stmt.statement);
+        if (completion != Completion::NORMAL) return;
     }
 }
 
 void Interpreter::Visit(ReturnStatement& stmt) {
-    Value val;
-    if (stmt.value != nullptr) {
-        val = evaluate(*stmt.value);
+    returnValue = Value();
+    if (stmt.tailCall != nullptr) {
+        Value* base = pushCall(*stmt.tailCall);
+        if (base->AsObj()->type == ObjType::FUNCTION) {
+            tailCallee = base;
+            completion = Completion::TAIL_CALL;
+            return;
+        }
+        returnValue = base->AsCallable()->Call(*this, Span<Value>(base + 1, top - base - 1));
+        top = base;
+    } else if (stmt.value != nullptr) {
+        returnValue = evaluate(*stmt.value);
     }
-    throw ReturnSignal(val);
+    completion = Completion::RETURN;
 }
 
 void Interpreter::Visit(BlockStatement& stmt) {
-    environment = std::make_shared<Environment>(environment);
-    Interpret(stmt.statements);
-    environment = environment->EnclosingScope();
+    execute(stmt.statements);
+    /* Each entry into the block gets fresh variables, so closures made in a
+     * loop body do not share them */
+    if (stmt.closesUpvalues) {
+        openUpvalues.Close(slots + stmt.firstSlot);
+    }
 }
 
 void Interpreter::Visit(FunctionStatement& stmt) {
-    auto func = std::make_shared<LoxFunction>(stmt, environment);
-    environment->Define(stmt.name.lexeme, Value(func));
+    int global = stmt.slot < 0 ? globals.Slot(stmt.name) : -1;
+    auto func = heap.Allocate<LoxFunction>(stmt);
+    /* Bound before capturing, which may allocate and collect */
+    if (stmt.slot < 0) {
+        globals.Define(global, Value(func));
+    } else {
+        slots[stmt.slot] = Value(func);
+    }
+    for (auto& upvalue: stmt.upvalues) {
+        func->upvalues.push_back(upvalue.isLocal ?
+            openUpvalues.Capture(slots + upvalue.index) : function->upvalues[upvalue.index]);
+    }
 }
 
 // Expression::Visitor Interface methods
 void Interpreter::Visit(BinaryExpression& expr) {
-    Value left = evaluate(*expr.left);
-    Value right = evaluate(*expr.right);
+    using Form = BinaryExpression::Form;
 
-    switch(expr.op.type) {
+    if (expr.form == Form::UNSEEN) {
+        expr.leftOperand = operandKind(*expr.left);
+        expr.rightOperand = operandKind(*expr.right);
+    }
+
+    Value left = operand(*expr.left, expr.leftOperand);
+    if (left.IsNumber() && expr.form != Form::GENERIC) {
+        /* A number needs no rooting while the right operand runs */
+        Value right = operand(*expr.right, expr.rightOperand);
+        if (right.IsNumber()) {
+            if (expr.form == Form::UNSEEN) expr.form = numberForm(expr.op.type);
+            double a = left.AsNumber();
+            double b = right.AsNumber();
+            switch (expr.form) {
+            case Form::ADD:           value = Value(a + b); return;
+            case Form::SUBTRACT:      value = Value(a - b); return;
+            case Form::MULTIPLY:      value = Value(a * b); return;
+            case Form::DIVIDE:        value = Value(a / b); return;
+            case Form::GREATER:       value = Value(a > b); return;
+            case Form::GREATER_EQUAL: value = Value(a >= b); return;
+            case Form::LESS:          value = Value(a < b); return;
+            case Form::LESS_EQUAL:    value = Value(a <= b); return;
+            case Form::EQUAL:         value = Value(a == b); return;
+            case Form::NOT_EQUAL:     value = Value(a != b); return;
+            default:                  break;
+            }
+        }
+        expr.form = Form::GENERIC;
+        value = binary(expr.op, left, right);
+        return;
+    }
+
+    expr.form = Form::GENERIC;
+    /* The left operand stays on the stack until the result is made, in
+     * case concatenating collects */
+    push(expr.op, left);
+    Value right = operand(*expr.right, expr.rightOperand);
+    value = binary(expr.op, top[-1], right);
+    pop();
+}
+
+BinaryExpression::Operand Interpreter::operandKind(Expression& expr) {
+    using Operand = BinaryExpression::Operand;
+
+    if (typeid(expr) == typeid(VariableExpression) &&
+        static_cast<VariableExpression&>(expr).kind == VariableKind::LOCAL) {
+        return Operand::LOCAL;
+    }
+    if (typeid(expr) == typeid(LiteralExpression)) return Operand::LITERAL;
+    return Operand::EXPRESSION;
+}
+
+BinaryExpression::Form Interpreter::numberForm(TokenType op) {
+    using Form = BinaryExpression::Form;
+
+    switch (op) {
+    case TokenType::PLUS:          return Form::ADD;
+    case TokenType::MINUS:         return Form::SUBTRACT;
+    case TokenType::STAR:          return Form::MULTIPLY;
+    case TokenType::SLASH:         return Form::DIVIDE;
+    case TokenType::GREATER:       return Form::GREATER;
+    case TokenType::GREATER_EQUAL: return Form::GREATER_EQUAL;
+    case TokenType::LESS:          return Form::LESS;
+    case TokenType::LESS_EQUAL:    return Form::LESS_EQUAL;
+    case TokenType::EQUAL_EQUAL:   return Form::EQUAL;
+    case TokenType::BANG_EQUAL:    return Form::NOT_EQUAL;
+    default:                       return Form::GENERIC;
+    }
+}
+
+Value Interpreter::binary(const Token& op, const Value& left, const Value& right) {
+    switch(op.type) {
     case TokenType::PLUS:
-        value = left + right;
-        break;
+        if (left.IsNumber() && right.IsNumber()) {
+            return Value(left.AsNumber() + right.AsNumber());
+        } else if (left.IsString() && right.IsString()) {
+            return Value(heap.Concatenate(left.AsString(), right.AsString()));
+        }
+        throw RuntimeError(op, "Operands must be two numbers or two strings");
     case TokenType::MINUS:
-        assertNumber(expr.op, left, right);
-        value = left - right;
-        break;
+        assertNumber(op, left, right);
+        return left - right;
     case TokenType::STAR:
-        assertNumber(expr.op, left, right);
-        value = left * right;
-        break;
+        assertNumber(op, left, right);
+        return left * right;
     case TokenType::SLASH:
-        assertNumber(expr.op, left, right);
-        value =  left / right;
-        break;
+        assertNumber(op, left, right);
+        return left / right;
     case TokenType::GREATER:
-        value = left > right;
-        break;
+        assertComparable(op, left, right);
+        return Value(compare(left, right, std::greater<>()));
     case TokenType::GREATER_EQUAL:
-        value = left >= right;
-        break;
+        assertComparable(op, left, right);
+        return Value(compare(left, right, std::greater_equal<>()));
     case TokenType::LESS:
-        value = left < right;
-        break;
+        assertComparable(op, left, right);
+        return Value(compare(left, right, std::less<>()));
     case TokenType::LESS_EQUAL:
-        value = left <= right;
-        break;
+        assertComparable(op, left, right);
+        return Value(compare(left, right, std::less_equal<>()));
     case TokenType::EQUAL_EQUAL:
-        value = left == right;
-        break;
+        return Value(left == right);
     case TokenType::BANG_EQUAL:
-        value = left != right;
-        break;
+        return Value(left != right);
     default:
-        throw RuntimeError(expr.op, "Unknown Binary Operand");
-        break;
+        throw RuntimeError(op, "Unknown Binary Operand");
     }
 }
 
@@ -150,22 +355,29 @@ void Interpreter::Visit(UnaryExpression& expr) {
 }
 
 void Interpreter::Visit(CallExpression& expr) {
-    auto callee = evaluate(*expr.callee);
+    Value* base = pushCall(expr);
+    value = base->AsCallable()->Call(*this, Span<Value>(base + 1, top - base - 1));
+    top = base;
+}
 
-    std::vector<Value> arguments;
+Value* Interpreter::pushCall(CallExpression& expr) {
+    Value* base = top;
+    auto callee = evaluate(*expr.callee);
+    push(expr.paren, callee);
     for(auto &arg: expr.arguments) {
-        arguments.push_back(evaluate(*arg));
+        push(expr.paren, evaluate(*arg));
     }
 
-    // TODO (telescreen): Check to see whether callee is callable
-    std::shared_ptr<LoxCallable> func = static_cast<std::shared_ptr<LoxCallable>>(callee);
-    if (arguments.size() != func->Arity()) {
-        throw new RuntimeError(expr.paren,
-            fmt::format("Expected %d arguments but got %d",
-                        func->Arity(), arguments.size()).c_str());
+    if (!callee.IsCallable()) {
+        throw RuntimeError(expr.paren, "Can only call functions");
     }
-
-    value = func->Call(*this, arguments);
+    LoxCallable* func = callee.AsCallable();
+    if (expr.arguments.size() != func->Arity()) {
+        throw RuntimeError(expr.paren,
+            fmt::format("Expected {} arguments but got {}",
+                        func->Arity(), expr.arguments.size()));
+    }
+    return base;
 }
 
 
@@ -181,34 +393,48 @@ void Interpreter::Visit(LiteralExpression& expr) {
 void Interpreter::Visit(LogicalExpression& expr) {
     Value left = evaluate(*expr.left);
     if (expr.op.type == TokenType::OR) {
-        if (left) value = left;
-        return;
+        if (left) return;
     } else {
-        if (!left) value = left;
-        return;
+        if (!left) return;
     }
     value = evaluate(*expr.right);
 }
 
 void Interpreter::Visit(VariableExpression& expr) {
-    value = environment->Get(expr.token);
+    switch (expr.kind) {
+    case VariableKind::LOCAL:
+        LOX_COUNT(localLookups);
+        value = slots[expr.index];
+        break;
+    case VariableKind::UPVALUE:
+        LOX_COUNT(upvalueLookups);
+        value = *function->upvalues[expr.index]->location;
+        break;
+    case VariableKind::GLOBAL:
+        LOX_COUNT(globalLookups);
+        if (expr.index < 0) expr.index = globals.Slot(expr.token);
+        value = globals.Get(expr.index, expr.token);
+        break;
+    }
 }
 
 void Interpreter::Visit(AssignmentExpression& expr) {
     Value val = evaluate(*expr.value);
-    environment->Assign(expr.name, val);
-}
-
-std::shared_ptr<Environment> Interpreter::GlobalScope() {
-    return globals;
-}
-
-std::shared_ptr<Environment> Interpreter::CurrentScope() {
-    return environment;
-}
-
-void Interpreter::SetScope(std::shared_ptr<Environment>& new_environment) {
-    environment = new_environment;
+    switch (expr.kind) {
+    case VariableKind::LOCAL:
+        LOX_COUNT(localLookups);
+        slots[expr.index] = val;
+        break;
+    case VariableKind::UPVALUE:
+        LOX_COUNT(upvalueLookups);
+        *function->upvalues[expr.index]->location = val;
+        break;
+    case VariableKind::GLOBAL:
+        LOX_COUNT(globalLookups);
+        if (expr.index < 0) expr.index = globals.Slot(expr.name);
+        globals.Assign(expr.index, expr.name, val);
+        break;
+    }
 }
 
 #endif
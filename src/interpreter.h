@@ -1,19 +1,36 @@
 #ifndef LOX_EVALUATOR_H
 #define LOX_EVALUATOR_H
 
-#include <list>
 
 #include "lox_exception.hpp"
 #include "ast.h"
 #include "value.h"
 #include "environment.h"
+#include "heap.h"
+#include "profiler.h"
+#include "upvalue.h"
 
+class LoxFunction;
 
-class Interpreter: public Expression::Visitor, public Statement::Visitor {
+
+class Interpreter: public Expression::Visitor, public Statement::Visitor, private Heap::Roots {
 public:
-    Interpreter();
+    Interpreter(Heap& heap);
+    ~Interpreter();
+
+    /* Runs top-level code; slotCount is what Resolver::Resolve() returned */
+    void Interpret(Span<Statement*>, int slotCount = 0);
 
-    void Interpret(const std::list<std::unique_ptr<Statement>>&);
+    /* Reports calls and statements to profiler from now on */
+    void SetProfiler(Profiler* profiler) {
+        this->profiler = profiler;
+    }
+
+    /* Runs the function bodies a lazy Parser skipped through the Optimizer
+     * at level when they are parsed */
+    void SetOptimization(int level) {
+        optimization = level;
+    }
 
     void Visit(PrintStatement& stmt) override;
 
@@ -47,32 +64,105 @@ public:
 
     void Visit(AssignmentExpression& expr) override;
 
-    std::shared_ptr<Environment> GlobalScope();
-
-    std::shared_ptr<Environment> CurrentScope();
+    /* Runs the body of function in a new frame on top of the stack. The
+     * arguments a CallExpression evaluated are already there and become
+     * the frame's first slots, so parameters bind by position without
+     * copying; arguments from elsewhere are copied in. */
+    Value Call(LoxFunction& function, Span<Value> arguments);
 
-    void SetScope(std::shared_ptr<Environment>&);
+    /* How the last statement completed. A return statement stores its value
+     * and sets RETURN, which makes every enclosing statement list and loop
+     * stop until Call() consumes it. Returning a call to a Lox function sets
+     * TAIL_CALL instead, and Call() runs the callee in the same frame. */
+    enum class Completion { NORMAL, RETURN, TAIL_CALL };
 
 private:
+    void execute(Span<Statement*> statements);
+
+    /* Parses, optimizes and resolves the body of declaration, which a lazy
+     * Parser checked and dropped, when it is first called; it cannot fail */
+    void parseDeferred(FunctionStatement& declaration);
+
+    /* Evaluates the callee and arguments onto the stack and checks them;
+     * returns where the callee was pushed */
+    Value* pushCall(CallExpression& expr);
+
     Value evaluate(Expression& p) {
         p.Accept(*this);
         return value;
     }
 
     void evaluate(Statement& s) {
+        if (profiler != nullptr) profiler->Line(s.line);
         s.Accept(*this);
     }
 
+    /* Temporaries that must survive a collection are kept on the stack,
+     * above the running frame */
+    void push(const Token& token, const Value& value) {
+        if (top == stack.data() + stack.size()) {
+            throw RuntimeError(token, "Stack overflow");
+        }
+        *top++ = value;
+    }
+
+    Value pop() {
+        return *--top;
+    }
+
+    Value operand(Expression& expr, BinaryExpression::Operand kind) {
+        switch (kind) {
+        case BinaryExpression::Operand::LOCAL:
+            LOX_COUNT(localLookups);
+            return slots[static_cast<VariableExpression&>(expr).index];
+        case BinaryExpression::Operand::LITERAL:
+            return static_cast<LiteralExpression&>(expr).value;
+        default:
+            return evaluate(expr);
+        }
+    }
+
+    static BinaryExpression::Operand operandKind(Expression& expr);
+
+    /* The generic operator, checking operand types */
+    Value binary(const Token& op, const Value& left, const Value& right);
+
+    /* The quickened form of op for number operands */
+    static BinaryExpression::Form numberForm(TokenType op);
+
+    void MarkRoots(Heap&) override;
+
     void assertNumber(const Token& token, const Value& left, const Value& right) {
-        if (left.value_type != Value::ValueType::NUMBER ||
-            right.value_type != Value::ValueType::NUMBER) {
+        if (!left.IsNumber() || !right.IsNumber()) {
             throw RuntimeError(token, "Operand must be a number");
         }
     }
 
+    void assertComparable(const Token& token, const Value& left, const Value& right) {
+        if (!Value::Comparable(left, right)) {
+            throw RuntimeError(token, "Operands must be two numbers or two strings");
+        }
+    }
+
+    Heap& heap;
+
     Value value;   // This is the global variable that store value for all expression evaluation
-    std::shared_ptr<Environment> globals = std::make_shared<Environment>();
-    std::shared_ptr<Environment> environment = std::make_shared<Environment>(globals);
+    Value returnValue;
+    Completion completion = Completion::NORMAL;
+    Value* tailCallee = nullptr;   // Callee of a pending TAIL_CALL, its arguments follow
+    Environment globals;
+
+    /* Locals live in a flat stack of Values, one frame per call. Variables
+     * captured by a closure stay in the frame behind an open Upvalue until
+     * the frame or their block exits. */
+    static constexpr size_t STACK_MAX = 1024 * 256;
+    std::vector<Value> stack = std::vector<Value>(STACK_MAX);
+    Value* slots = stack.data();   // Frame of the running function
+    Value* top = slots;            // First slot past that frame
+    LoxFunction* function = nullptr;   // Running function, nullptr at the top level
+    OpenUpvalues openUpvalues;
+    Profiler* profiler = nullptr;
+    int optimization = 0;
 };
 
 #endif
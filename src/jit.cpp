@@ -0,0 +1,599 @@
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <algorithm>
+#include <map>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+
+namespace {
+
+enum Register: uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Condition codes, as in the low nibble of Jcc and SETcc */
+enum Condition: uint8_t { BELOW = 0x2, ABOVE_EQUAL = 0x3, EQUAL = 0x4, NOT_EQUAL = 0x5,
+                          BELOW_EQUAL = 0x6, ABOVE = 0x7, PARITY = 0xa, NO_PARITY = 0xb, ALWAYS = 0xff };
+
+/* Just enough of an x86-64 encoder for the code the Jit emits. Only rax,
+ * rcx and rdx and xmm0 and xmm1 are used as scratch registers. */
+class Assembler {
+public:
+    size_t Size() const { return code.size(); }
+
+    const std::vector<uint8_t>& Code() const { return code; }
+
+    void Push(Register reg) {
+        if (reg >= R8) byte(0x41);
+        byte(0x50 + (reg & 7));
+    }
+
+    void Pop(Register reg) {
+        if (reg >= R8) byte(0x41);
+        byte(0x58 + (reg & 7));
+    }
+
+    void Move(Register dst, Register src) { rex(src, dst); byte(0x89); modrm(3, src, dst); }
+
+    void Move(Register dst, uint64_t imm) {
+        byte(0x48 | (dst >> 3));
+        byte(0xb8 + (dst & 7));
+        int64(imm);
+    }
+
+    void Move32(Register dst, int32_t imm) {
+        byte(0xb8 + dst);
+        int32(imm);
+    }
+
+    /* dst = [base + disp] */
+    void Load(Register dst, Register base, int32_t disp) { rex(dst, base); byte(0x8b); memory(dst, base, disp); }
+
+    /* [base + disp] = src */
+    void Store(Register base, int32_t disp, Register src) { rex(src, base); byte(0x89); memory(src, base, disp); }
+
+    void Add(Register dst, int32_t imm) { rex(RAX, dst); byte(0x81); modrm(3, 0, dst); int32(imm); }
+
+    void And(Register dst, Register src) { rex(src, dst); byte(0x21); modrm(3, src, dst); }
+
+    void Or(Register dst, Register src) { rex(src, dst); byte(0x09); modrm(3, src, dst); }
+
+    void Compare(Register lhs, Register rhs) { rex(rhs, lhs); byte(0x39); modrm(3, rhs, lhs); }
+
+    void Compare32(Register lhs, int8_t imm) { byte(0x83); modrm(3, 7, lhs); byte(imm); }
+
+    void Test32(Register lhs, Register rhs) { byte(0x85); modrm(3, rhs, lhs); }
+
+    /* Flips bit 63, the sign of a double */
+    void FlipSign(Register reg) { rex(RAX, reg); byte(0x0f); byte(0xba); modrm(3, 7, reg); byte(63); }
+
+    /* reg = condition ? 1 : 0, using the low byte of rax, rcx or rdx */
+    void Set(Condition condition, Register reg) { byte(0x0f); byte(0x90 + condition); modrm(3, 0, reg); }
+
+    void AndByte(Register dst, Register src) { byte(0x20); modrm(3, src, dst); }
+
+    void XorByte(Register dst, int8_t imm) { byte(0x80); modrm(3, 6, dst); byte(imm); }
+
+    void ZeroExtendByte(Register reg) { byte(0x0f); byte(0xb6); modrm(3, reg, reg); }
+
+    void MoveToXmm(int xmm, Register src) { byte(0x66); rex(xmm, src); byte(0x0f); byte(0x6e); modrm(3, xmm, src); }
+
+    void MoveFromXmm(Register dst, int xmm) { byte(0x66); rex(xmm, dst); byte(0x0f); byte(0x7e); modrm(3, xmm, dst); }
+
+    /* xmm0 op= xmm1, op being the second opcode byte of addsd, subsd, ... */
+    void Arithmetic(uint8_t op) { byte(0xf2); byte(0x0f); byte(op); modrm(3, 0, 1); }
+
+    void UnorderedCompare(int lhs, int rhs) { byte(0x66); byte(0x0f); byte(0x2e); modrm(3, lhs, rhs); }
+
+    void ClearXmm(int xmm) { byte(0x66); byte(0x0f); byte(0x57); modrm(3, xmm, xmm); }
+
+    void Call(Register target) { byte(0xff); modrm(3, 2, target); }
+
+    void Jump(Register target) { byte(0xff); modrm(3, 4, target); }
+
+    void Return() { byte(0xc3); }
+
+    /* Emits a jump with its displacement left to Patch() and returns where
+     * that displacement is */
+    size_t Jump(Condition condition) {
+        if (condition == ALWAYS) {
+            byte(0xe9);
+        } else {
+            byte(0x0f);
+            byte(0x80 + condition);
+        }
+        int32(0);
+        return code.size() - 4;
+    }
+
+    void Jump(Condition condition, size_t target) {
+        Patch(Jump(condition), target);
+    }
+
+    void Patch(size_t displacement, size_t target) {
+        int32_t relative = static_cast<int32_t>(target - (displacement + 4));
+        for (int i = 0; i < 4; i++) {
+            code[displacement + i] = static_cast<uint8_t>(relative >> (8 * i));
+        }
+    }
+
+private:
+    void byte(uint8_t value) { code.push_back(value); }
+
+    void int32(int32_t value) {
+        for (int i = 0; i < 4; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void int64(uint64_t value) {
+        for (int i = 0; i < 8; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    void rex(int reg, int rm) { byte(0x48 | ((reg >> 3) << 2) | (rm >> 3)); }
+
+    void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+    void memory(int reg, Register base, int32_t disp) {
+        modrm(2, reg, base);
+        if ((base & 7) == RSP) byte(0x24);   // rsp and r12 need a SIB byte
+        int32(disp);
+    }
+
+    std::vector<uint8_t> code;
+};
+
+
+/* Registers live across the compiled code of a frame */
+constexpr Register SLOTS = RBX;   // Frame slots
+constexpr Register TOP = R12;     // First free slot of the value stack
+constexpr Register VM_POINTER = R13;     // Passed to helpers
+constexpr Register TOP_ADDRESS = R14;   // &VM::stackTop, kept in sync for helpers
+constexpr Register QNAN = R15;    // Value::QNAN, for number guards
+
+constexpr int SLOT = sizeof(Value);
+
+/* Prologue: int (Value* slots, Value** top, VM* vm, const uint8_t* entry) */
+using Entry = int (*)(Value*, Value**, VM*, const uint8_t*);
+
+size_t instructionLength(const Chunk& chunk, size_t offset) {
+    switch (static_cast<OpCode>(chunk.code[offset])) {
+    case OpCode::CONSTANT:
+    case OpCode::GET_GLOBAL:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::SET_GLOBAL:
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::LOOP:
+        return 3;
+    case OpCode::GET_LOCAL:
+    case OpCode::SET_LOCAL:
+    case OpCode::GET_UPVALUE:
+    case OpCode::SET_UPVALUE:
+    case OpCode::CALL:
+    case OpCode::TAIL_CALL:
+        return 2;
+    case OpCode::CLOSURE: {
+        int index = (chunk.code[offset + 1] << 8) | chunk.code[offset + 2];
+        return 3 + 2 * chunk.functions[index]->upvalueCount;
+    }
+    default:
+        return 1;
+    }
+}
+
+}
+
+
+bool Jit::Supported() {
+    return true;
+}
+
+Jit::Jit() {
+    perfMap = std::fopen(fmt::format("/tmp/perf-{}.map", getpid()).c_str(), "w");
+}
+
+Jit::~Jit() {
+    for (auto& machineCode: code) {
+        munmap(machineCode->start, machineCode->size);
+    }
+    if (perfMap != nullptr) std::fclose(perfMap);
+}
+
+bool Jit::Run(VM& vm, VM::CallFrame& frame) {
+    Function& function = *frame.closure->function;
+    if (function.machineCode == nullptr) {
+        if (++function.hotness < HOT) return false;
+        compile(function);
+    }
+
+    /* Compiled code pushes without checking, and no instruction pushes
+     * more than one value */
+    const std::vector<uint8_t>& bytecode = function.chunk.code;
+    if (vm.stack.data() + vm.stack.size() - vm.stackTop < static_cast<ptrdiff_t>(bytecode.size())) {
+        return false;
+    }
+
+    const MachineCode& machineCode = *function.machineCode;
+    auto entry = reinterpret_cast<Entry>(machineCode.start);
+    int resume = entry(frame.slots, &vm.stackTop, &vm,
+                       machineCode.start + machineCode.offsets[frame.ip - bytecode.data()]);
+    if (resume == RETURNED) {
+        vm.frames.pop_back();
+        return true;
+    }
+    if (resume == RAISED) {
+        std::exception_ptr raised = error;
+        error = nullptr;
+        std::rethrow_exception(raised);
+    }
+    frame.ip = bytecode.data() + resume;
+    return false;
+}
+
+void Jit::compile(Function& function) {
+    const Chunk& chunk = function.chunk;
+    const uint8_t* bytecode = chunk.code.data();
+    Assembler a;
+
+    /* Callee-saved registers, five of them so calls stay 16-byte aligned */
+    a.Push(RBX);
+    a.Push(R12);
+    a.Push(R13);
+    a.Push(R14);
+    a.Push(R15);
+    a.Move(SLOTS, RDI);
+    a.Move(TOP_ADDRESS, RSI);
+    a.Load(TOP, TOP_ADDRESS, 0);
+    a.Move(VM_POINTER, RDX);
+    a.Move(QNAN, Value::QNAN);
+    a.Jump(RCX);
+
+    /* Leaves with eax holding the bytecode offset to resume at or an Exit */
+    size_t exit = a.Size();
+    a.Store(TOP_ADDRESS, 0, TOP);
+    a.Pop(R15);
+    a.Pop(R14);
+    a.Pop(R13);
+    a.Pop(R12);
+    a.Pop(RBX);
+    a.Return();
+    size_t failed = a.Size();
+    a.Move32(RAX, RAISED);
+    a.Jump(ALWAYS, exit);
+
+    /* A frame whose locals were captured must close them when returning */
+    bool captures = false;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+        captures |= static_cast<OpCode>(chunk.code[offset]) == OpCode::CLOSURE;
+    }
+
+    std::vector<uint32_t> offsets(chunk.code.size());
+    std::vector<std::pair<size_t, size_t>> jumps;       // Displacement, bytecode target
+    std::vector<std::pair<size_t, size_t>> bailOuts;    // Displacement, bytecode offset
+    std::vector<std::pair<size_t, size_t>> helperExits; // Displacement, bytecode offset
+
+    auto bailOut = [&](Condition condition, size_t offset) {
+        bailOuts.emplace_back(a.Jump(condition), offset);
+    };
+    auto guardNumber = [&](Register value, size_t offset) {
+        a.Move(RCX, QNAN);
+        a.And(RCX, value);
+        a.Compare(RCX, QNAN);
+        bailOut(EQUAL, offset);
+    };
+    auto callHelper = [&](Helper helper, uint64_t operand, size_t offset, size_t next) {
+        a.Store(TOP_ADDRESS, 0, TOP);
+        a.Move(RDI, VM_POINTER);
+        a.Move(RSI, operand);
+        a.Move(RDX, reinterpret_cast<uint64_t>(bytecode + next));
+        a.Move(RAX, reinterpret_cast<uint64_t>(helper));
+        a.Call(RAX);
+        a.Load(TOP, TOP_ADDRESS, 0);
+        a.Test32(RAX, RAX);
+        helperExits.emplace_back(a.Jump(NOT_EQUAL), offset);
+    };
+    /* Replaces the two operands on top of the stack with the bool in al */
+    auto pushBool = [&]() {
+        a.ZeroExtendByte(RAX);
+        a.Move(RCX, Value::FALSE_VALUE);
+        a.Or(RAX, RCX);
+        a.Store(TOP, -2 * SLOT, RAX);
+        a.Add(TOP, -SLOT);
+    };
+    auto loadOperands = [&](size_t offset) {
+        a.Load(RAX, TOP, -2 * SLOT);
+        a.Load(RDX, TOP, -SLOT);
+        guardNumber(RAX, offset);
+        guardNumber(RDX, offset);
+        a.MoveToXmm(0, RAX);
+        a.MoveToXmm(1, RDX);
+    };
+
+    for (size_t offset = 0, next; offset < chunk.code.size(); offset = next) {
+        offsets[offset] = a.Size();
+        size_t length = instructionLength(chunk, offset);
+        next = offset + length;
+        uint8_t byte = length > 1 ? chunk.code[offset + 1] : 0;
+        uint16_t operand = length > 2 ?
+            static_cast<uint16_t>((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]) : 0;
+
+        switch (static_cast<OpCode>(chunk.code[offset])) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE: {
+            OpCode op = static_cast<OpCode>(chunk.code[offset]);
+            Value value = op == OpCode::CONSTANT ? chunk.constants[operand] :
+                op == OpCode::NIL ? Value() : Value(op == OpCode::TRUE);
+            a.Move(RAX, value.Bits());
+            a.Store(TOP, 0, RAX);
+            a.Add(TOP, SLOT);
+            break;
+        }
+        case OpCode::POP:
+            a.Add(TOP, -SLOT);
+            break;
+        case OpCode::GET_LOCAL:
+            a.Load(RAX, SLOTS, byte * SLOT);
+            a.Store(TOP, 0, RAX);
+            a.Add(TOP, SLOT);
+            break;
+        case OpCode::SET_LOCAL:
+            a.Load(RAX, TOP, -SLOT);
+            a.Store(SLOTS, byte * SLOT, RAX);
+            break;
+        case OpCode::GET_GLOBAL:
+            callHelper(getGlobal, reinterpret_cast<uint64_t>(chunk.constants[operand].AsString()), offset, next);
+            break;
+        case OpCode::SET_GLOBAL:
+            callHelper(setGlobal, reinterpret_cast<uint64_t>(chunk.constants[operand].AsString()), offset, next);
+            break;
+        case OpCode::GET_UPVALUE:
+            callHelper(getUpvalue, byte, offset, next);
+            break;
+        case OpCode::SET_UPVALUE:
+            callHelper(setUpvalue, byte, offset, next);
+            break;
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL: {
+            /* Numbers compare as doubles, anything else by identity */
+            a.Load(RAX, TOP, -2 * SLOT);
+            a.Load(RDX, TOP, -SLOT);
+            std::vector<size_t> identity;
+            for (Register value: { RAX, RDX }) {
+                a.Move(RCX, QNAN);
+                a.And(RCX, value);
+                a.Compare(RCX, QNAN);
+                identity.push_back(a.Jump(EQUAL));
+            }
+            a.MoveToXmm(0, RAX);
+            a.MoveToXmm(1, RDX);
+            a.UnorderedCompare(0, 1);
+            a.Set(EQUAL, RAX);
+            a.Set(NO_PARITY, RCX);
+            a.AndByte(RAX, RCX);
+            size_t done = a.Jump(ALWAYS);
+            for (size_t displacement: identity) a.Patch(displacement, a.Size());
+            a.Compare(RAX, RDX);
+            a.Set(EQUAL, RAX);
+            a.Patch(done, a.Size());
+            if (static_cast<OpCode>(chunk.code[offset]) == OpCode::NOT_EQUAL) a.XorByte(RAX, 1);
+            pushBool();
+            break;
+        }
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::LESS:
+        case OpCode::LESS_EQUAL: {
+            OpCode op = static_cast<OpCode>(chunk.code[offset]);
+            loadOperands(offset);
+            /* a < b is b > a; unordered operands leave every condition false */
+            if (op == OpCode::GREATER || op == OpCode::GREATER_EQUAL) {
+                a.UnorderedCompare(0, 1);
+            } else {
+                a.UnorderedCompare(1, 0);
+            }
+            a.Set(op == OpCode::GREATER || op == OpCode::LESS ? ABOVE : ABOVE_EQUAL, RAX);
+            pushBool();
+            break;
+        }
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE: {
+            static const uint8_t opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };
+            loadOperands(offset);
+            a.Arithmetic(opcodes[chunk.code[offset] - static_cast<uint8_t>(OpCode::ADD)]);
+            a.MoveFromXmm(RAX, 0);
+            a.Store(TOP, -2 * SLOT, RAX);
+            a.Add(TOP, -SLOT);
+            break;
+        }
+        case OpCode::NEGATE:
+            a.Load(RAX, TOP, -SLOT);
+            guardNumber(RAX, offset);
+            a.FlipSign(RAX);
+            a.Store(TOP, -SLOT, RAX);
+            break;
+        case OpCode::POSITIVE:
+            a.Load(RAX, TOP, -SLOT);
+            guardNumber(RAX, offset);
+            break;
+        case OpCode::PRINT:
+            callHelper(print, 0, offset, next);
+            break;
+        case OpCode::JUMP:
+            jumps.emplace_back(a.Jump(ALWAYS), next + operand);
+            break;
+        case OpCode::JUMP_IF_FALSE: {
+            /* Booleans, nil and numbers here; the interpreter decides the rest */
+            a.Load(RAX, TOP, -SLOT);
+            a.Move(RCX, Value::TRUE_VALUE);
+            a.Compare(RAX, RCX);
+            size_t truthy = a.Jump(EQUAL);
+            a.Move(RCX, Value::FALSE_VALUE);
+            a.Compare(RAX, RCX);
+            jumps.emplace_back(a.Jump(EQUAL), next + operand);
+            a.Move(RCX, Value().Bits());
+            a.Compare(RAX, RCX);
+            jumps.emplace_back(a.Jump(EQUAL), next + operand);
+            guardNumber(RAX, offset);
+            a.MoveToXmm(0, RAX);
+            a.ClearXmm(1);
+            a.UnorderedCompare(0, 1);
+            jumps.emplace_back(a.Jump(BELOW_EQUAL), next + operand);
+            a.Patch(truthy, a.Size());
+            break;
+        }
+        case OpCode::LOOP:
+            a.Jump(ALWAYS, offsets[next - operand]);
+            break;
+        case OpCode::CALL:
+            callHelper(call, byte, offset, next);
+            break;
+        case OpCode::RETURN:
+            if (captures) {
+                bailOut(ALWAYS, offset);
+                break;
+            }
+            /* The result replaces the callee, Run() pops the frame */
+            a.Load(RAX, TOP, -SLOT);
+            a.Store(SLOTS, 0, RAX);
+            a.Move(TOP, SLOTS);
+            a.Add(TOP, SLOT);
+            a.Move32(RAX, RETURNED);
+            a.Jump(ALWAYS, exit);
+            break;
+        default:
+            /* TAIL_CALL and everything that builds closures or defines
+             * globals is left to the interpreter */
+            bailOut(ALWAYS, offset);
+            break;
+        }
+    }
+
+    for (auto& jump: jumps) {
+        a.Patch(jump.first, offsets[jump.second]);
+    }
+
+    /* One stub per bytecode offset, returning it to Run() */
+    std::map<size_t, size_t> stubs;
+    for (auto& bail: bailOuts) {
+        auto it = stubs.find(bail.second);
+        if (it == stubs.end()) {
+            it = stubs.emplace(bail.second, a.Size()).first;
+            a.Move32(RAX, static_cast<int32_t>(bail.second));
+            a.Jump(ALWAYS, exit);
+        }
+        a.Patch(bail.first, it->second);
+    }
+    for (auto& helperExit: helperExits) {
+        a.Patch(helperExit.first, a.Size());
+        a.Compare32(RAX, FAILED);
+        a.Jump(EQUAL, failed);
+        a.Move32(RAX, static_cast<int32_t>(helperExit.second));
+        a.Jump(ALWAYS, exit);
+    }
+
+    /* Written while writable, then made executable */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (a.Size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    std::copy(a.Code().begin(), a.Code().end(), static_cast<uint8_t*>(memory));
+    mprotect(memory, size, PROT_READ | PROT_EXEC);
+
+    code.emplace_back(new MachineCode { static_cast<uint8_t*>(memory), size, std::move(offsets) });
+    function.machineCode = code.back().get();
+
+    if (perfMap != nullptr) {
+        fmt::print(perfMap, "{:x} {:x} lox:{}\n",
+                   reinterpret_cast<uintptr_t>(memory), a.Size(), function.name);
+        std::fflush(perfMap);
+    }
+}
+
+
+/* Helpers run with the VM's stackTop current. BAIL_OUT leaves the stack as
+ * it was, for the interpreter to run the instruction instead */
+
+int Jit::getGlobal(VM* vm, uint64_t name, const uint8_t*) {
+    LOX_COUNT(globalLookups);
+    auto it = vm->globals.find(reinterpret_cast<ObjString*>(name));
+    if (it == vm->globals.end()) return BAIL_OUT;
+    *vm->stackTop++ = it->second;
+    return DONE;
+}
+
+int Jit::setGlobal(VM* vm, uint64_t name, const uint8_t*) {
+    LOX_COUNT(globalLookups);
+    auto it = vm->globals.find(reinterpret_cast<ObjString*>(name));
+    if (it == vm->globals.end()) return BAIL_OUT;
+    it->second = vm->peek(0);
+    return DONE;
+}
+
+int Jit::getUpvalue(VM* vm, uint64_t index, const uint8_t*) {
+    LOX_COUNT(upvalueLookups);
+    *vm->stackTop++ = *vm->frames.back().closure->upvalues[index]->location;
+    return DONE;
+}
+
+int Jit::setUpvalue(VM* vm, uint64_t index, const uint8_t*) {
+    LOX_COUNT(upvalueLookups);
+    *vm->frames.back().closure->upvalues[index]->location = vm->peek(0);
+    return DONE;
+}
+
+int Jit::print(VM* vm, uint64_t, const uint8_t*) {
+    fmt::print("{}\n", vm->pop());
+    return DONE;
+}
+
+/* Runs the whole call, so the result is on the stack when it returns.
+ * Nothing may be thrown through compiled code: errors are kept for Run() */
+int Jit::call(VM* vm, uint64_t argCount, const uint8_t* ip) {
+    const Value& callee = vm->peek(argCount);
+    Jit& jit = *vm->jit;
+    if (!callee.IsCallable() || callee.AsCallable()->Arity() != static_cast<int>(argCount) ||
+        vm->frames.size() == VM::FRAMES_MAX || jit.nesting == NESTING_MAX) {
+        return BAIL_OUT;
+    }
+
+    vm->frames.back().ip = ip;
+    size_t depth = vm->frames.size();
+    jit.nesting++;
+    try {
+        vm->call(callee, argCount);
+        if (vm->frames.size() > depth) vm->run(depth);
+    } catch (...) {
+        jit.nesting--;
+        jit.error = std::current_exception();
+        return FAILED;
+    }
+    jit.nesting--;
+    return DONE;
+}
+
+#else
+
+bool Jit::Supported() {
+    return false;
+}
+
+Jit::Jit() {}
+
+Jit::~Jit() {}
+
+bool Jit::Run(VM&, VM::CallFrame&) {
+    return false;
+}
+
+#endif
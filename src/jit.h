@@ -0,0 +1,83 @@
+#ifndef LOX_JIT_H
+#define LOX_JIT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include "chunk.h"
+#include "vm.h"
+
+
+/* Machine code for one Function. Compiled code keeps the VM's frame and
+ * value stack layout, so control can pass between it and the interpreter
+ * at any instruction boundary: every bytecode offset has an entry.
+ */
+struct MachineCode {
+    uint8_t* start;                  // Stub that jumps to an entry, see Jit::Run
+    size_t size;
+    std::vector<uint32_t> offsets;   // Entry for each bytecode offset, from start
+};
+
+
+/* Baseline compiler from bytecode to x86-64, for Linux only. A function is
+ * compiled once calls and loop iterations make it hot; each instruction
+ * becomes a fixed sequence of machine code working on the value stack.
+ * Arithmetic and comparisons guard that their operands are numbers and
+ * bail out to the interpreter otherwise, which then runs the instruction
+ * and the rest of the call. Closures and tail calls always bail out, as
+ * do returns from functions that create closures; globals, upvalues,
+ * printing and calls go through helpers.
+ *
+ * Each compiled function is listed in /tmp/perf-<pid>.map for perf.
+ */
+class Jit {
+public:
+    /* Calls plus loop iterations before a function is compiled */
+    static constexpr int HOT = 100;
+
+    /* Calls made from compiled code run on the machine stack; deeper ones
+     * bail out to the interpreter, which keeps its frames on the heap */
+    static constexpr int NESTING_MAX = 512;
+
+    static bool Supported();
+
+    Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit();
+
+    /* Continues frame in machine code from frame.ip, once its function is
+     * hot. Returns true if the code returned, in which case the frame has
+     * been popped and its result pushed; otherwise frame.ip is left at the
+     * instruction the interpreter must run next. A runtime error raised
+     * meanwhile is rethrown. */
+    bool Run(VM& vm, VM::CallFrame& frame);
+
+private:
+    /* Result of compiled code that did not bail out */
+    enum Exit { RETURNED = -2, RAISED = -1 };
+
+    /* What a helper tells the machine code that called it */
+    enum Status { DONE, BAIL_OUT, FAILED };
+
+    using Helper = int (*)(VM* vm, uint64_t operand, const uint8_t* ip);
+
+    void compile(Function& function);
+
+    static int getGlobal(VM* vm, uint64_t name, const uint8_t* ip);
+    static int setGlobal(VM* vm, uint64_t name, const uint8_t* ip);
+    static int getUpvalue(VM* vm, uint64_t index, const uint8_t* ip);
+    static int setUpvalue(VM* vm, uint64_t index, const uint8_t* ip);
+    static int print(VM* vm, uint64_t, const uint8_t* ip);
+    static int call(VM* vm, uint64_t argCount, const uint8_t* ip);
+
+    std::vector<std::unique_ptr<MachineCode>> code;
+    std::FILE* perfMap = nullptr;
+    std::exception_ptr error;   // Raised under a helper, rethrown by Run()
+    int nesting = 0;            // Calls made by compiled code still running
+};
+
+#endif
@@ -1,7 +1,11 @@
 #ifndef LOX_LOX_HPP
 #define LOX_LOX_HPP
 
+#include <chrono>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <linenoise.h>
 #include <fmt/format.h>
@@ -10,10 +14,28 @@
 #include "token.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "resolver.h"
+#include "script_cache.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "stats.h"
+#include "compiler.h"
+#include "closure_engine.h"
+#include "vm.h"
 
 
 class Lox {
 public:
+    /* The tree-walking Interpreter is the reference engine; the bytecode VM
+     * and the ClosureEngine must produce the same output for the same
+     * program. */
+    enum class Engine { TREE_WALKER, VM, CLOSURE };
+
+    /* optimization is the -O level: 0 runs the tree as parsed, 1 runs the
+     * Optimizer over it first */
+    Lox(Engine engine = Engine::TREE_WALKER, int optimization = 0)
+        : engine(engine), optimization(optimization), interpreter(heap), vm(heap), closures(heap) {}
+
     static void Report(int line, std::string where, const std::string& message) {
         fmt::print(stderr, "[line: {}] {}: {}\n", line, where, message);
     }
@@ -26,21 +48,130 @@ public:
         if (token.type == TokenType::TEOF) {
             Report(token.line, " at end", message);
         } else {
-            Report(token.line, " at '" + token.lexeme + "'", message);
+            Report(token.line, " at '" + token.Lexeme() + "'", message);
         }
     }
 
+    /* Copies buffer, which may be released as soon as this returns */
     void Interpret(const char* buffer) {
+        /* Tokens and the AST point into the source, so the copy lives in
+         * the arena and shares the tree's lifetime */
+        std::unique_ptr<Arena> arena(new Arena());
+        size_t length = std::strlen(buffer);
+        Span<char> source = arena->NewArray<char>(buffer, buffer + length);
+        run(source.begin(), length, std::move(arena));
+    }
+
+    /* Runs source in place; it must stay valid for the life of this Lox */
+    void Interpret(const char* source, size_t length) {
+        run(source, length, std::unique_ptr<Arena>(new Arena()));
+    }
+
+    /* Takes parsed programs from the cache in directory from now on, and
+     * adds the ones it parses; see ScriptCache */
+    void EnableCache(const std::string& directory) {
+        cache.reset(new ScriptCache(directory));
+    }
+
+    /* Parses source into the cache without running it, for --compile;
+     * false if it does not parse or the entry cannot be written */
+    bool Compile(const char* source, size_t length) {
+        Heap::Pin pin(heap);
+        Arena arena;
+        Scanner scanner(source, length);
+        Parser parser(scanner, heap, arena);
+        Span<Statement*> stmts;
         try {
-            Scanner scanner(buffer);
-            auto tokens = scanner.ScanTokens();
-            Parser parser(tokens);
-            auto stmts = parser.Parse();
-            interpreter.Interpret(stmts);
+            stmts = parser.Parse();
         } catch(ParserError& e) {
-        } catch(RuntimeError& e) {
-            Lox::Error(e.GetToken(), e.what());
+            return false;
         }
+        return !scanner.HadError() && !parser.HadError() && cache != nullptr && cache->Store(source, length, stmts);
+    }
+
+    /* Lets the VM compile hot functions to machine code; false where the
+     * Jit is not supported */
+    bool EnableJit() {
+        jit = vm.EnableJit();
+        return jit;
+    }
+
+    /* Leaves the bodies of top-level functions unparsed until they are
+     * first called, see Parser; only the tree walker parses them then */
+    void EnableLazy() {
+        lazy = true;
+        interpreter.SetOptimization(optimization);
+    }
+
+    /* Profiles the tree walker from now on, see Profiler */
+    void EnableProfile() {
+        profiler.reset(new Profiler());
+        interpreter.SetProfiler(profiler.get());
+    }
+
+    /* Prints the profile to stderr and writes its collapsed stacks to
+     * stacksPath, for --profile */
+    void ReportProfile(const std::string& stacksPath) {
+        interpreter.SetProfiler(nullptr);
+        profiler->Report(stderr);
+        if (!profiler->WriteStacks(stacksPath)) {
+            fmt::print(stderr, "[profile] cannot write {}\n", stacksPath);
+        } else {
+            fmt::print(stderr, "[profile] stacks written to {}\n", stacksPath);
+        }
+    }
+
+    /* Times each phase from now on, and scans every source an extra time
+     * on its own to count and time the tokens, for --stats */
+    void EnableStats() {
+        stats = true;
+    }
+
+    /* Where the time went in every run so far and what it made, for --stats */
+    void ReportStats() {
+        auto ms = [](double seconds) { return seconds * 1e3; };
+        fmt::print(stderr, "[stats] scan: {:.3f} ms on its own, {} tokens\n", ms(phases.scan), phases.tokens);
+        fmt::print(stderr, "[stats] parse: {:.3f} ms with scanning, {} nodes in {} bytes\n",
+                   ms(phases.parse), phases.nodes, phases.nodeBytes);
+        if (cache != nullptr) fmt::print(stderr, "[stats] cache: {} hits\n", phases.cacheHits);
+        if (optimization > 0) fmt::print(stderr, "[stats] optimize: {:.3f} ms\n", ms(phases.optimize));
+        if (engine == Engine::VM) {
+            fmt::print(stderr, "[stats] compile: {:.3f} ms\n", ms(phases.compile));
+        } else {
+            fmt::print(stderr, "[stats] resolve: {:.3f} ms\n", ms(phases.resolve));
+        }
+        fmt::print(stderr, "[stats] execute: {:.3f} ms\n", ms(phases.execute));
+
+        const Heap::Stats& gc = heap.GetStats();
+        fmt::print(stderr, "[stats] heap: {} bytes allocated, {} collections\n", gc.bytesAllocated, gc.collections);
+
+        if (!Counters::Enabled()) {
+            fmt::print(stderr, "[stats] calls, lookups, Value copies and allocations need a LOX_STATS build\n");
+            return;
+        }
+        const Counters& counters = Counters::global;
+        uint64_t lookups = counters.localLookups + counters.upvalueLookups + counters.globalLookups;
+        fmt::print(stderr, "[stats] calls: {}, frames: {}\n", counters.calls, counters.frames);
+        /* Locals are read from the frame, upvalues and globals through one
+         * indirection; nothing walks a chain of scopes */
+        fmt::print(stderr, "[stats] lookups: {} local, {} upvalue, {} global, {:.2f} indirections on average\n",
+                   counters.localLookups, counters.upvalueLookups, counters.globalLookups,
+                   lookups == 0 ? 0.0 : double(counters.upvalueLookups + counters.globalLookups) / lookups);
+        if (jit) fmt::print(stderr, "[stats] locals read or written by compiled code are not counted\n");
+        fmt::print(stderr, "[stats] Value copies: {}\n", counters.valueCopies);
+        fmt::print(stderr, "[stats] operator new: {} allocations, {} bytes\n",
+                   counters.allocations, counters.allocatedBytes);
+    }
+
+    /* Summary of the garbage collector's work so far, for --gc-stats */
+    void ReportGcStats() {
+        const Heap::Stats& stats = heap.GetStats();
+        fmt::print(stderr, "[gc] collections: {}, pause: {:.3f} ms total, {:.3f} ms max\n",
+                   stats.collections, stats.pauseSeconds * 1e3, stats.maxPauseSeconds * 1e3);
+        fmt::print(stderr, "[gc] allocated: {} bytes, freed: {} bytes in {} objects\n",
+                   stats.bytesAllocated, stats.bytesFreed, stats.objectsFreed);
+        fmt::print(stderr, "[gc] live: {} bytes, peak: {} bytes\n",
+                   heap.BytesAllocated(), stats.peakBytes);
     }
 
     void Prompt() {
@@ -61,7 +192,129 @@ public:
     }
 
 private:
+    void run(const char* source, size_t length, std::unique_ptr<Arena> arena) {
+        if (stats) scan(source, length);
+        try {
+            Stopwatch stopwatch(phases.parse);
+            Span<Statement*> stmts;
+            std::shared_ptr<Function> script;
+            {
+                /* Literals and names end up in the tree or in chunk
+                 * constants, neither of which the collector traces */
+                Heap::Pin pin(heap);
+                stmts = parse(source, length, *arena);
+                phases.nodes += arena->Objects();
+                phases.nodeBytes += arena->BytesAllocated();
+                if (optimization > 0) {
+                    stopwatch.Switch(phases.optimize);
+                    Optimizer optimizer(heap, *arena);
+                    optimizer.Optimize(stmts);
+                }
+                if (engine == Engine::VM) {
+                    stopwatch.Switch(phases.compile);
+                    Compiler compiler(heap);
+                    script = compiler.Compile(stmts);
+                }
+            }
+            if (engine == Engine::VM) {
+                stopwatch.Switch(phases.execute);
+                vm.Interpret(script);
+            } else {
+                stopwatch.Switch(phases.resolve);
+                Resolver resolver(*arena);
+                int slotCount = resolver.Resolve(stmts);
+                stopwatch.Switch(phases.execute);
+                /* Functions declared here keep pointing into this tree, so it
+                 * lives as long as the session */
+                arenas.push_back(std::move(arena));
+                if (engine == Engine::CLOSURE) {
+                    closures.Interpret(stmts, slotCount, *arenas.back());
+                } else {
+                    interpreter.Interpret(stmts, slotCount);
+                }
+            }
+        } catch(ParserError& e) {
+        } catch(CompileError& e) {
+        } catch(RuntimeError& e) {
+            Lox::Error(e.GetToken(), e.what());
+        }
+    }
+
+    /* The program in source, from the cache if it has it */
+    Span<Statement*> parse(const char* source, size_t length, Arena& arena) {
+        Span<Statement*> stmts;
+        if (cache != nullptr && cache->Load(source, length, heap, arena, stmts)) {
+            phases.cacheHits++;
+            return stmts;
+        }
+        Scanner scanner(source, length);
+        Parser parser(scanner, heap, arena, lazy);
+        stmts = parser.Parse();
+        /* The tree of a source cut short would skip the error next time, and
+         * a lazy one is missing its function bodies */
+        if (cache != nullptr && !lazy && !scanner.HadError() && !parser.HadError()) {
+            cache->Store(source, length, stmts);
+        }
+        return stmts;
+    }
+
+    /* Scans source once more on its own, which the Parser's pulling
+     * tokens as it goes does not let us time */
+    void scan(const char* source, size_t length) {
+        Stopwatch stopwatch(phases.scan);
+        Scanner scanner(source, length);
+        while (scanner.Next().type != TokenType::TEOF) phases.tokens++;
+    }
+
+    /* Charges the wall time it runs to one phase at a time; the last one
+     * is charged when it goes out of scope, even if an error ended it */
+    class Stopwatch {
+    public:
+        Stopwatch(double& phase): phase(&phase), mark(std::chrono::steady_clock::now()) {}
+
+        ~Stopwatch() {
+            Switch(*phase);
+        }
+
+        void Switch(double& next) {
+            auto now = std::chrono::steady_clock::now();
+            *phase += std::chrono::duration<double>(now - mark).count();
+            phase = &next;
+            mark = now;
+        }
+
+    private:
+        double* phase;
+        std::chrono::steady_clock::time_point mark;
+    };
+
+    /* Totals over every run(), for --stats */
+    struct Phases {
+        double scan = 0;
+        double parse = 0;
+        double optimize = 0;
+        double compile = 0;
+        double resolve = 0;
+        double execute = 0;
+        size_t tokens = 0;
+        size_t nodes = 0;
+        size_t nodeBytes = 0;
+        size_t cacheHits = 0;   // Runs that skipped parsing
+    };
+
+    Engine engine;
+    int optimization;
+    bool stats = false;
+    bool lazy = false;
+    bool jit = false;
+    Phases phases;
+    Heap heap;
     Interpreter interpreter;
+    VM vm;
+    ClosureEngine closures;
+    std::vector<std::unique_ptr<Arena>> arenas;
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<ScriptCache> cache;
 };
 
 
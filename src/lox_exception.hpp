@@ -2,6 +2,7 @@
 #define LOX_EXCEPTION_HPP
 
 #include <exception>
+#include <string>
 #include "token.h"
 #include "value.h"
 
@@ -24,14 +25,33 @@ private:
 };
 
 
+class CompileError: public std::exception {
+public:
+    CompileError(const Token &token, const std::string& message)
+        : token(token), message(message) {
+    }
+
+    virtual const char* what() const throw() {
+        return message.c_str();
+    }
+
+    const Token& GetToken() const throw() {
+        return token;
+    }
+private:
+    const Token token;
+    const std::string message;
+};
+
+
 class RuntimeError: public std::exception {
 public:
-    RuntimeError(const Token &token, const char* message)
+    RuntimeError(const Token &token, const std::string& message)
         : token(token), message(message) {
     }
 
     virtual const char* what() const throw() {
-        return message;
+        return message.c_str();
     }
 
     const Token& GetToken() const throw() {
@@ -39,7 +59,7 @@ public:
     }
 private:
     const Token token;
-    const char *message;
+    const std::string message;
 };
 
 class TypeError: public std::exception {
@@ -55,13 +75,4 @@ private:
     const char *message;
 };
 
-class ReturnSignal: public std::exception {
-public:
-    Value value;
-    ReturnSignal(Value value): value(value) {}
-    virtual const char* what() const throw() {
-        return nullptr;
-    }
-};
-
 #endif
@@ -4,35 +4,51 @@
 #include <vector>
 
 #include "ast.h"
+#include "object.h"
 #include "interpreter.h"
-
-
-class LoxCallable {
-public:
-    virtual int Arity() = 0;
-    virtual Value Call(Interpreter&, std::vector<Value>&) = 0;
-    virtual ~LoxCallable() = default;
-};
+#include "upvalue.h"
 
 
 class LoxFunction: public LoxCallable {
 public:
-    LoxFunction(FunctionStatement&, std::shared_ptr<Environment>&);
-    Value Call(Interpreter&, std::vector<Value>&) override;
+    LoxFunction(FunctionStatement&);
+    Value Call(Interpreter&, Span<Value> arguments) override;
     int Arity() override;
+    void Trace(Heap&) override;
+
+    FunctionStatement& Declaration() {
+        return declaration;
+    }
+
+    /* Only the variables the body uses from enclosing functions, filled in
+     * by Interpreter following declaration.upvalues */
+    std::vector<Upvalue*> upvalues;
 
 private:
     FunctionStatement& declaration;
-    std::shared_ptr<Environment> closure;
 };
 
 
-/* Builtin Functions */
+/* Builtin Functions
+ * Natives do not depend on the engine running them, so both the Interpreter
+ * and the VM invoke them through Invoke().
+ */
+
+class NativeFunction: public LoxCallable {
+public:
+    NativeFunction(): LoxCallable(ObjType::NATIVE) {}
+
+    Value Call(Interpreter& interpreter, Span<Value> arguments) override {
+        return Invoke(arguments);
+    }
+    virtual Value Invoke(Span<Value> arguments) = 0;
+};
+
 
-class Clock: public LoxCallable {
+class Clock: public NativeFunction {
 public:
     Clock() = default;
-    Value Call(Interpreter& interpreter, std::vector<Value>& arguments) override;
+    Value Invoke(Span<Value> arguments) override;
     int Arity() override;
 };
 
@@ -1,39 +1,120 @@
 #include <fmt/format.h>
 #include "lox.hpp"
-#include <cstdio>
+#include "source_file.h"
 
-void runFile(const char* path) {
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        std::perror("Failed to open file");
-        return;
+bool runFile(const char* path, Lox& lox) {
+    SourceFile source;
+    if (!source.Load(path)) {
+        return false;
     }
 
-    constexpr int BUFSIZE = 8192;
-    char buffer[BUFSIZE];
-    int result = fread(buffer, 1, BUFSIZE, f);
-    if (result == 0) {
-        std::perror("Failed to read data from file");
-        fclose(f);
-        return;
-    }
+    lox.Interpret(source.Data(), source.Length());
+    return true;
+}
 
-    Lox lox;
-    lox.Interpret(buffer);
+bool compileFile(const char* path, Lox& lox) {
+    SourceFile source;
+    if (!source.Load(path)) {
+        return false;
+    }
 
-    fclose(f);
+    if (!lox.Compile(source.Data(), source.Length())) {
+        fmt::print(stderr, "Cannot cache {}\n", path);
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char **argv) {
-    if (argc > 2) {
-        fmt::print("Usage: lox [script.l]\n");
+    Lox::Engine engine = Lox::Engine::TREE_WALKER;
+    int optimization = 0;
+    bool gcStats = false;
+    bool stats = false;
+    bool cache = true;
+    bool compile = false;
+    bool jit = false;
+    bool lazy = false;
+    const char* profile = nullptr;   // Where the collapsed stacks go
+    const char* script = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--engine=vm") {
+            engine = Lox::Engine::VM;
+        } else if (arg == "--engine=closure") {
+            engine = Lox::Engine::CLOSURE;
+        } else if (arg == "--engine=tree") {
+            engine = Lox::Engine::TREE_WALKER;
+        } else if (arg == "-O" || arg == "-O1") {
+            optimization = 1;
+        } else if (arg == "-O0") {
+            optimization = 0;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if (arg == "--lazy") {
+            lazy = true;
+        } else if (arg == "--profile") {
+            profile = "lox.folded";
+        } else if (arg.compare(0, 10, "--profile=") == 0) {
+            profile = argv[i] + 10;
+        } else if (arg == "--compile") {
+            compile = true;
+        } else if (arg == "--no-cache") {
+            cache = false;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--gc-stats") {
+            gcStats = true;
+        } else if (script == nullptr && (arg == "-" || arg.compare(0, 1, "-") != 0)) {
+            script = argv[i];
+        } else {
+            fmt::print("Usage: lox [--compile | --no-cache] [--engine=tree|vm|closure] [-O0|-O1] [--jit] [--lazy] [--profile[=stacks]] [--stats] [--gc-stats] [script.l | -]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Compiled code is produced from the VM's bytecode */
+    if (jit) engine = Lox::Engine::VM;
+
+    if (compile && (!cache || script == nullptr || std::string(script) == "-")) {
+        fmt::print(stderr, "--compile needs a script file and the cache\n");
+        return EXIT_FAILURE;
+    }
+
+    if (profile != nullptr && engine != Lox::Engine::TREE_WALKER) {
+        fmt::print(stderr, "--profile only profiles the tree engine\n");
         return EXIT_FAILURE;
-    } else if(argc == 2) {
-        runFile(argv[1]);
+    }
+
+    if (lazy && engine != Lox::Engine::TREE_WALKER) {
+        fmt::print(stderr, "--lazy only applies to the tree engine\n");
+        return EXIT_FAILURE;
+    }
+
+    Lox lox(engine, optimization);
+    if (jit && !lox.EnableJit()) {
+        fmt::print(stderr, "--jit is only supported on x86-64 Linux, running the VM alone\n");
+    }
+    if (lazy) lox.EnableLazy();
+    if (profile != nullptr) lox.EnableProfile();
+    if (stats) lox.EnableStats();
+    /* Only scripts read from a file are worth caching */
+    if (cache && script != nullptr && std::string(script) != "-") {
+        lox.EnableCache(ScriptCache::DefaultDirectory());
+    }
+    if (compile) {
+        return compileFile(script, lox) ? 0 : EXIT_FAILURE;
+    }
+
+    bool ok = true;
+    if (script != nullptr) {
+        ok = runFile(script, lox);
     } else {
-        Lox lox;
         lox.Prompt();
     }
 
-    return 0;
+    if (profile != nullptr) lox.ReportProfile(profile);
+    if (stats) lox.ReportStats();
+    if (gcStats) lox.ReportGcStats();
+    return ok ? 0 : EXIT_FAILURE;
 }
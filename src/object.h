@@ -0,0 +1,97 @@
+#ifndef LOX_OBJECT_H
+#define LOX_OBJECT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+
+class Value;
+class Interpreter;
+class Heap;
+
+
+/* Heap-allocated runtime objects. A Value refers to them by raw pointer;
+ * they are owned by the Heap that allocated them, which frees them once
+ * a collection finds them unreachable.
+ */
+enum class ObjType: uint8_t { STRING, FUNCTION, NATIVE, CLOSURE, COMPILED, UPVALUE };
+
+
+class Obj {
+public:
+    Obj(ObjType type): type(type) {}
+    virtual ~Obj() = default;
+
+    /* Marks every object this one refers to, see Heap::Mark */
+    virtual void Trace(Heap&) {}
+
+    const ObjType type;
+    bool marked = false;   // Reached by the collection in progress
+    bool pinned = false;   // Never collected, see Heap::Pin
+    uint32_t size = 0;     // Bytes charged to the Heap
+    Obj* next = nullptr;
+};
+
+
+/* Immutable, interned string. The characters are stored inline right after
+ * the object, so a string costs a single allocation. Strings are only
+ * created through Heap::MakeString, which guarantees that equal strings
+ * share one object and can be compared by pointer.
+ */
+class ObjString: public Obj {
+public:
+    const char* Chars() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    std::string String() const {
+        return std::string(Chars(), length);
+    }
+
+    /* <0, 0 or >0 like strcmp */
+    int Compare(const ObjString& other) const;
+
+    static uint32_t Hash(const char* chars, size_t length, uint32_t hash = 2166136261u) {
+        /* FNV-1a; the seed lets a hash be continued over several pieces */
+        for (size_t i = 0; i < length; i++) {
+            hash ^= static_cast<uint8_t>(chars[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    static void operator delete(void* p) {
+        ::operator delete(p);
+    }
+
+    const size_t length;
+    const uint32_t hash;
+
+private:
+    friend class Heap;
+
+    ObjString(size_t length, uint32_t hash): Obj(ObjType::STRING), length(length), hash(hash) {}
+};
+
+
+/* Hash for maps keyed by interned strings: the map hashes the cached
+ * string hash and compares pointers */
+struct ObjStringHash {
+    size_t operator()(const ObjString* string) const { return string->hash; }
+};
+
+
+/* Everything a Lox program can call: LoxFunction, natives, VM closures
+ * and ClosureEngine functions */
+class LoxCallable: public Obj {
+public:
+    LoxCallable(ObjType type): Obj(type) {}
+    virtual int Arity() = 0;
+    /* arguments usually live on the caller's value stack */
+    virtual Value Call(Interpreter&, Span<Value> arguments) = 0;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "optimizer.h"
+
+#include <functional>
+
+
+static LiteralExpression* asLiteral(Expression* expr) {
+    return dynamic_cast<LiteralExpression*>(expr);
+}
+
+static bool isLiteralNumber(Expression* expr, double number) {
+    LiteralExpression* literal = asLiteral(expr);
+    return literal != nullptr && literal->value.IsNumber() && literal->value.AsNumber() == number;
+}
+
+
+Optimizer::Optimizer(Heap& heap, Arena& arena): heap(heap), arena(arena) {
+}
+
+void Optimizer::Optimize(Span<Statement*> statements) {
+    for (auto& statement: statements) {
+        optimize(*statement);
+    }
+}
+
+// Statement::Visitor Interface methods
+void Optimizer::Visit(PrintStatement& stmt) {
+    optimize(stmt.expression);
+}
+
+void Optimizer::Visit(ExpressionStatement& stmt) {
+    /* Whether the statement's value is echoed depends on the kind of its
+     * outermost expression: a grouping at the top is kept, and one is put
+     * around a call or assignment that folding brought to the top, as in
+     * `false or f();` */
+    bool echoed = !isCallOrAssignment(stmt.expression);
+    if (GroupingExpression* group = dynamic_cast<GroupingExpression*>(stmt.expression)) {
+        optimize(group->expression);
+    } else {
+        optimize(stmt.expression);
+    }
+    if (echoed && isCallOrAssignment(stmt.expression)) {
+        stmt.expression = arena.New<GroupingExpression>(stmt.expression);
+    }
+}
+
+void Optimizer::Visit(VarStatement& stmt) {
+    if (stmt.init) {
+        optimize(stmt.init);
+    }
+}
+
+void Optimizer::Visit(IfStatement& stmt) {
+    optimize(stmt.expression);
+    optimize(*stmt.thenBranch);
+    if (stmt.elseBranch != nullptr) {
+        optimize(*stmt.elseBranch);
+    }
+}
+
+void Optimizer::Visit(ReturnStatement& stmt) {
+    if (stmt.value != nullptr) {
+        optimize(stmt.value);
+        /* Removing a grouping can expose a call */
+        stmt.tailCall = dynamic_cast<CallExpression*>(stmt.value);
+    }
+}
+
+void Optimizer::Visit(WhileStatement& stmt) {
+    optimize(stmt.expression);
+    optimize(*stmt.statement);
+}
+
+void Optimizer::Visit(BlockStatement& stmt) {
+    Optimize(stmt.statements);
+}
+
+void Optimizer::Visit(FunctionStatement& stmt) {
+    Optimize(stmt.stmts);
+}
+
+// Expression::Visitor Interface methods
+void Optimizer::Visit(BinaryExpression& expr) {
+    optimize(expr.left);
+    optimize(expr.right);
+
+    LiteralExpression* left = asLiteral(expr.left);
+    LiteralExpression* right = asLiteral(expr.right);
+    Value folded;
+    if (left != nullptr && right != nullptr && fold(expr.op, left->value, right->value, folded)) {
+        result = literal(folded);
+        return;
+    }
+
+    /* Exact for every number, including -0, NaN and infinities. x + 0 is
+     * not: -0 + 0 is 0. */
+    switch (expr.op.type) {
+    case TokenType::STAR:
+        if (isLiteralNumber(expr.right, 1) && isNumber(expr.left)) result = expr.left;
+        else if (isLiteralNumber(expr.left, 1) && isNumber(expr.right)) result = expr.right;
+        break;
+    case TokenType::SLASH:
+        if (isLiteralNumber(expr.right, 1) && isNumber(expr.left)) result = expr.left;
+        break;
+    case TokenType::MINUS:
+        if (isLiteralNumber(expr.right, 0) && isNumber(expr.left)) result = expr.left;
+        break;
+    default:
+        break;
+    }
+}
+
+void Optimizer::Visit(UnaryExpression& expr) {
+    optimize(expr.expression);
+
+    /* ! is rejected by the Interpreter whatever its operand, so it is left alone */
+    LiteralExpression* operand = asLiteral(expr.expression);
+    if (operand != nullptr && operand->value.IsNumber()) {
+        if (expr.op.type == TokenType::MINUS) {
+            result = literal(-operand->value);
+        } else if (expr.op.type == TokenType::PLUS) {
+            result = operand;
+        }
+    } else if (expr.op.type == TokenType::PLUS && isNumber(expr.expression)) {
+        result = expr.expression;
+    }
+}
+
+void Optimizer::Visit(CallExpression& expr) {
+    optimize(expr.callee);
+    for (auto& arg: expr.arguments) {
+        optimize(arg);
+    }
+}
+
+void Optimizer::Visit(GroupingExpression& expr) {
+    optimize(expr.expression);
+    result = expr.expression;
+}
+
+void Optimizer::Visit(LiteralExpression& expr) {
+}
+
+void Optimizer::Visit(LogicalExpression& expr) {
+    optimize(expr.left);
+    optimize(expr.right);
+
+    /* Same rule as Interpreter: the result is whichever operand decided it */
+    LiteralExpression* left = asLiteral(expr.left);
+    if (left != nullptr) {
+        bool truthy = static_cast<bool>(left->value);
+        bool shortCircuit = expr.op.type == TokenType::OR ? truthy : !truthy;
+        result = shortCircuit ? expr.left : expr.right;
+    }
+}
+
+void Optimizer::Visit(VariableExpression& expr) {
+}
+
+void Optimizer::Visit(AssignmentExpression& expr) {
+    optimize(expr.value);
+}
+
+void Optimizer::optimize(Expression*& slot) {
+    result = nullptr;
+    slot->Accept(*this);
+    if (result != nullptr) {
+        slot = result;
+        result = nullptr;
+    }
+}
+
+Expression* Optimizer::literal(Value value) {
+    return arena.New<LiteralExpression>(value);
+}
+
+/* Evaluates op the way Interpreter::Visit(BinaryExpression&) does. Returns
+ * false, leaving the operator to runtime, whenever that would throw. */
+bool Optimizer::fold(const Token& op, Value left, Value right, Value& folded) {
+    switch (op.type) {
+    case TokenType::PLUS:
+        if (left.IsNumber() && right.IsNumber()) {
+            folded = Value(left.AsNumber() + right.AsNumber());
+        } else if (left.IsString() && right.IsString()) {
+            folded = Value(heap.Concatenate(left.AsString(), right.AsString()));
+        } else {
+            return false;
+        }
+        return true;
+    case TokenType::MINUS:
+    case TokenType::STAR:
+    case TokenType::SLASH:
+        if (!left.IsNumber() || !right.IsNumber()) return false;
+        folded = op.type == TokenType::MINUS ? left - right :
+                 op.type == TokenType::STAR ? left * right : left / right;
+        return true;
+    case TokenType::GREATER:
+    case TokenType::GREATER_EQUAL:
+    case TokenType::LESS:
+    case TokenType::LESS_EQUAL:
+        if (!Value::Comparable(left, right)) return false;
+        switch (op.type) {
+        case TokenType::GREATER: folded = Value(compare(left, right, std::greater<>())); break;
+        case TokenType::GREATER_EQUAL: folded = Value(compare(left, right, std::greater_equal<>())); break;
+        case TokenType::LESS: folded = Value(compare(left, right, std::less<>())); break;
+        default: folded = Value(compare(left, right, std::less_equal<>())); break;
+        }
+        return true;
+    case TokenType::EQUAL_EQUAL:
+        folded = Value(left == right);
+        return true;
+    case TokenType::BANG_EQUAL:
+        folded = Value(left != right);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Whether expr can only ever evaluate to a number (or raise its own error) */
+bool Optimizer::isNumber(Expression* expr) {
+    if (LiteralExpression* literal = asLiteral(expr)) {
+        return literal->value.IsNumber();
+    }
+    if (UnaryExpression* unary = dynamic_cast<UnaryExpression*>(expr)) {
+        return unary->op.type == TokenType::MINUS || unary->op.type == TokenType::PLUS;
+    }
+    if (BinaryExpression* binary = dynamic_cast<BinaryExpression*>(expr)) {
+        return binary->op.type == TokenType::MINUS || binary->op.type == TokenType::STAR ||
+               binary->op.type == TokenType::SLASH;
+    }
+    return false;
+}
+
+bool Optimizer::isCallOrAssignment(Expression* expr) {
+    return dynamic_cast<CallExpression*>(expr) != nullptr || dynamic_cast<AssignmentExpression*>(expr) != nullptr;
+}
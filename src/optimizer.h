@@ -0,0 +1,77 @@
+#ifndef LOX_OPTIMIZER_H
+#define LOX_OPTIMIZER_H
+
+#include "ast.h"
+#include "arena.h"
+#include "heap.h"
+
+
+/* Optional pass run after Parser::Parse(), before the Resolver or Compiler.
+ * Operators whose operands are all literals are folded into one literal,
+ * groupings are dropped and a few identities (x * 1, x / 1, x - 0, +x) are
+ * applied when x is known to produce a number. Nothing that could raise a
+ * runtime error is folded, so such errors still happen at runtime and are
+ * reported on the same operator and line.
+ */
+class Optimizer: public Expression::Visitor, public Statement::Visitor {
+public:
+    /* Replacement nodes are allocated in arena, the one the tree lives in */
+    Optimizer(Heap& heap, Arena& arena);
+
+    void Optimize(Span<Statement*> statements);
+
+    void Visit(PrintStatement& stmt) override;
+
+    void Visit(ExpressionStatement& stmt) override;
+
+    void Visit(VarStatement& stmt) override;
+
+    void Visit(IfStatement& stmt) override;
+
+    void Visit(ReturnStatement& stmt) override;
+
+    void Visit(WhileStatement& stmt) override;
+
+    void Visit(BlockStatement& stmt) override;
+
+    void Visit(FunctionStatement& stmt) override;
+
+    void Visit(BinaryExpression& expr) override;
+
+    void Visit(UnaryExpression& expr) override;
+
+    void Visit(CallExpression& expr) override;
+
+    void Visit(GroupingExpression& expr) override;
+
+    void Visit(LiteralExpression& expr) override;
+
+    void Visit(LogicalExpression& expr) override;
+
+    void Visit(VariableExpression& expr) override;
+
+    void Visit(AssignmentExpression& expr) override;
+
+private:
+    /* Optimizes the expression held in slot and stores its replacement back */
+    void optimize(Expression*& slot);
+
+    void optimize(Statement& stmt) {
+        stmt.Accept(*this);
+    }
+
+    Expression* literal(Value value);
+
+    bool fold(const Token& op, Value left, Value right, Value& folded);
+
+    static bool isNumber(Expression* expr);
+
+    /* The kinds of expression statement that are not echoed */
+    static bool isCallOrAssignment(Expression* expr);
+
+    Heap& heap;
+    Arena& arena;
+    Expression* result = nullptr;   // What the expression being visited is replaced with
+};
+
+#endif
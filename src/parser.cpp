@@ -1,8 +1,26 @@
 #include "parser.h"
 #include "lox.hpp"
 
+#include <cstdlib>
+#include <cstring>
 
-Parser::Parser(const std::vector<Token> &tokenList): current(0), tokenList(tokenList) {
+
+/* Token text is not NUL-terminated, and strtod would happily read on past
+ * the lexeme (e.g. "1e5" is the number 1 followed by the identifier e5) */
+static double parseNumber(const Token& token) {
+    char buffer[64];
+    if (token.length < sizeof(buffer)) {
+        std::memcpy(buffer, token.start, token.length);
+        buffer[token.length] = '\0';
+        return std::strtod(buffer, nullptr);
+    }
+    return std::stod(token.Lexeme());
+}
+
+
+Parser::Parser(Scanner& scanner, Heap& heap, Arena& arena, bool lazy)
+    : scanner(scanner), currentToken(scanner.Next()), previousToken(currentToken),
+      heap(heap), arena(arena), lazy(lazy) {
 }
 
 
@@ -10,12 +28,20 @@ Parser::~Parser() {
 }
 
 
-std::list<std::unique_ptr<Statement>> Parser::Parse() {
-    std::list<std::unique_ptr<Statement>> statements;
+Span<Statement*> Parser::Parse() {
+    size_t base = statementStack.size();
     while(!isAtEnd()) {
-        statements.push_back(declaration());
+        statementStack.push_back(declaration());
     }
-    return statements;
+    return takeStatements(base);
+}
+
+
+Span<Statement*> Parser::ParseDeferred(const DeferredBody& body, Heap& heap) {
+    Scanner scanner(body.source, body.length, body.line);
+    Parser parser(scanner, heap, *body.arena);
+    /* The source starts just inside the body, so this ends at its '}' */
+    return parser.block();
 }
 
 
@@ -28,191 +54,221 @@ bool Parser::match(TokenType type) {
 }
 
 
-std::unique_ptr<Statement> Parser::declaration() {
+Statement* Parser::declaration() {
+    int line = peek().line;
     if (match(TokenType::VAR)) {
-        return var_declaration();
+        return at(line, var_declaration());
     }
     if (match(TokenType::FUN)) {
-        return fun_declaration("function");
+        return at(line, fun_declaration("function"));
     }
     return statement();
 }
 
 
-std::unique_ptr<Statement> Parser::fun_declaration(const char* kind) {
+Statement* Parser::fun_declaration(const char* kind) {
     Token name = consume(TokenType::IDENTIFIER, fmt::format("Expect {} name", kind).c_str());
     consume(TokenType::LEFT_PAREN, "Expect '(' after function declaration");
-    std::vector<Token> parameters;
+    parameterStack.clear();
     if (!check(TokenType::RIGHT_PAREN)) {
         do {
-            if (parameters.size() >= 255) {
+            if (parameterStack.size() >= 255) {
                 error(peek(), "Cannot have more than 255 parameters");
             }
-            parameters.push_back(consume(TokenType::IDENTIFIER, "Expect parameter name."));
+            parameterStack.push_back(consume(TokenType::IDENTIFIER, "Expect parameter name."));
         } while(match(TokenType::COMMA));
     }
     consume(TokenType::RIGHT_PAREN, "Expect ')' after statements.");
+    /* Copied out before the body, which may declare functions of its own */
+    auto parameters = arena.NewArray<Token>(parameterStack.begin(), parameterStack.end());
     consume(TokenType::LEFT_BRACE, fmt::format("Expect '(' before {} body", kind).c_str());
+    /* A top-level function can only see globals besides its own variables,
+     * so its body means the same whenever it is parsed */
+    if (lazy && depth == 0) {
+        auto function = arena.New<FunctionStatement>(name, parameters, Span<Statement*>());
+        function->deferred = check_block(*function);
+        return function;
+    }
     auto body = block();
-    return std::make_unique<FunctionStatement>(name, parameters, body);
+    return arena.New<FunctionStatement>(name, parameters, body);
 }
 
 
-std::unique_ptr<Statement> Parser::var_declaration() {
+Statement* Parser::var_declaration() {
     Token name = consume(TokenType::IDENTIFIER, "Expect variable name");
-    std::unique_ptr<Expression> init = nullptr;
+    Expression* init = nullptr;
     if (match(TokenType::EQUAL)) {
         init = expression();
     }
     consume(TokenType::SEMICOLON, "Expect ';' after variable declaration");
-    return std::make_unique<VarStatement>(name, std::move(init));
+    return arena.New<VarStatement>(name, init);
 }
 
 
 
-std::unique_ptr<Statement> Parser::statement() {
+Statement* Parser::statement() {
+    int line = peek().line;
     if (match(TokenType::IF)) {
-        return if_statement();
+        return at(line, if_statement());
     }
     if (match(TokenType::PRINT)) {
-        return print_statement();
+        return at(line, print_statement());
     }
     if (match(TokenType::WHILE)) {
-        return while_statement();
+        return at(line, while_statement());
     }
     if (match(TokenType::FOR)) {
-        return for_statement();
+        return at(line, for_statement());
     }
     if (match(TokenType::RETURN)) {
-        return return_statement();
+        return at(line, return_statement());
     }
     if (match(TokenType::LEFT_BRACE)) {
         auto block_statement = block();
-        return std::make_unique<BlockStatement>(block_statement);
+        return at(line, arena.New<BlockStatement>(block_statement));
     }
-    return expression_statement();
+    return at(line, expression_statement());
 }
 
 
-std::unique_ptr<Statement> Parser::if_statement() {
+Statement* Parser::if_statement() {
     consume(TokenType::LEFT_PAREN, "Expect '(' after if");
     auto condition = expression();
     consume(TokenType::RIGHT_PAREN, "Expect ')' after if condition");
 
     auto thenBranch = statement();
-    std::unique_ptr<Statement> elseBranch = nullptr;
+    Statement* elseBranch = nullptr;
     if (match(TokenType::ELSE)) {
         elseBranch = statement();
     }
-    return std::make_unique<IfStatement>(std::move(condition),
-        std::move(thenBranch), std::move(elseBranch));
+    return arena.New<IfStatement>(condition,
+        thenBranch, elseBranch);
 }
 
 
-std::unique_ptr<Statement> Parser::print_statement() {
+Statement* Parser::print_statement() {
     auto expr = expression();
     consume(TokenType::SEMICOLON, "Expect ';' after a statement");
-    return std::make_unique<PrintStatement>(std::move(expr));
+    return arena.New<PrintStatement>(expr);
 }
 
-std::unique_ptr<Statement> Parser::return_statement() {
+Statement* Parser::return_statement() {
     Token keyword = previous();
-    std::unique_ptr<Expression> value = nullptr;
+    Expression* value = nullptr;
     if (!check(TokenType::SEMICOLON)) {
         value = expression();
     }
     consume(TokenType::SEMICOLON, "Expect ';' after return value");
-    return std::make_unique<ReturnStatement>(keyword, std::move(value));
+    auto stmt = arena.New<ReturnStatement>(keyword, value);
+    stmt->tailCall = dynamic_cast<CallExpression*>(value);
+    return stmt;
 }
 
 
-std::unique_ptr<Statement> Parser::while_statement() {
+Statement* Parser::while_statement() {
     consume(TokenType::LEFT_PAREN, "Expect '(' after the while keyword");
     auto expr = expression();
     consume(TokenType::RIGHT_PAREN, "Expect ')' after the while expression");
     auto stmt = statement();
-    return std::make_unique<WhileStatement>(std::move(expr), std::move(stmt));
+    return arena.New<WhileStatement>(expr, stmt);
 }
 
 
-std::unique_ptr<Statement> Parser::for_statement() {
+Statement* Parser::for_statement() {
     consume(TokenType::LEFT_PAREN, "Expect '(' after the for keyword");
-    std::unique_ptr<Statement> initializer = nullptr;
+    int line = previous().line;
+    Statement* initializer = nullptr;
     if (match(TokenType::SEMICOLON)) {
         initializer = nullptr;
     } else if (match(TokenType::VAR)) {
-        initializer = var_declaration();
+        initializer = at(line, var_declaration());
     } else {
-        initializer = expression_statement();
+        initializer = at(line, expression_statement());
     }
 
-    std::unique_ptr<Expression> cond = nullptr;
+    Expression* cond = nullptr;
     if (!check(TokenType::SEMICOLON)) {
         cond = expression();
     } else {
-        cond = std::make_unique<LiteralExpression>(true);
+        cond = arena.New<LiteralExpression>(true);
     }
     consume(TokenType::SEMICOLON, "Expect ';' after loop condition");
 
-    std::unique_ptr<Expression> increment = nullptr;
+    Expression* increment = nullptr;
     if (!check(TokenType::RIGHT_PAREN)) {
         increment = expression();
     }
     consume(TokenType::RIGHT_PAREN, "Expect ')' after a for clause");
 
-    std::unique_ptr<Statement> body = statement();
+    Statement* body = statement();
 
     if (increment != nullptr) {
-        std::list<std::unique_ptr<Statement>> stmts;
-        stmts.push_back(std::move(body));
-        stmts.push_back(std::make_unique<ExpressionStatement>(std::move(increment)));
-        body = std::make_unique<BlockStatement>(stmts);
+        Statement* stmts[] = { body, at(line, arena.New<ExpressionStatement>(increment)) };
+        body = at(line, arena.New<BlockStatement>(arena.NewArray<Statement*>(stmts, stmts + 2)));
     }
-    body = std::make_unique<WhileStatement>(std::move(cond), std::move(body));
+    body = at(line, arena.New<WhileStatement>(cond, body));
 
     if (initializer != nullptr) {
-        std::list<std::unique_ptr<Statement>> stmts;
-        stmts.push_back(std::move(initializer));
-        stmts.push_back(std::move(body));
-        body = std::make_unique<BlockStatement>(stmts);
+        Statement* stmts[] = { initializer, body };
+        body = arena.New<BlockStatement>(arena.NewArray<Statement*>(stmts, stmts + 2));
     }
 
     return body;
 }
 
 
-std::list<std::unique_ptr<Statement>> Parser::block() {
-    std::list<std::unique_ptr<Statement>> statements;
+Span<Statement*> Parser::block() {
+    size_t base = statementStack.size();
+    depth++;
 
     while (!check(TokenType::RIGHT_BRACE) && !isAtEnd()) {
-        statements.push_back(declaration());
+        statementStack.push_back(declaration());
     }
 
     consume(TokenType::RIGHT_BRACE, "Expect '}' after a block");
-    return statements;
+    depth--;
+    return takeStatements(base);
+}
+
+
+DeferredBody* Parser::check_block(FunctionStatement& function) {
+    const char* begin = previous().start + previous().length;
+    int line = previous().line;
+    Arena::Position position = arena.Tell();
+    function.stmts = block();
+    Resolver resolver(arena);
+    resolver.ResolveDeferred(function);
+    arena.Rewind(position);
+    function.stmts = Span<Statement*>();
+    function.upvalues = Span<UpvalueRef>();
+    function.slotCount = 0;
+
+    const Token& brace = previous();
+    size_t length = brace.start + brace.length - begin;
+    return arena.New<DeferredBody>(DeferredBody { begin, length, line, &arena });
 }
 
 
-std::unique_ptr<Statement> Parser::expression_statement() {
+Statement* Parser::expression_statement() {
     auto expr = expression();
     consume(TokenType::SEMICOLON, "Expect ';' after a statement");
-    return std::make_unique<ExpressionStatement>(std::move(expr));
+    return arena.New<ExpressionStatement>(expr);
 }
 
 
-std::unique_ptr<Expression> Parser::expression() {
+Expression* Parser::expression() {
     return assignment();
 }
 
 
-std::unique_ptr<Expression> Parser::assignment() {
+Expression* Parser::assignment() {
     auto expr = logic_or();
     if (match(TokenType::EQUAL)) {
         Token equals = previous();
         auto value = assignment();
-        if (VariableExpression* v = dynamic_cast<VariableExpression*>(expr.get())) {
+        if (VariableExpression* v = dynamic_cast<VariableExpression*>(expr)) {
             Token name = v->token;
-            return std::make_unique<AssignmentExpression>(name, std::move(value));
+            return arena.New<AssignmentExpression>(name, value);
         }
         throw error(equals, "Invalid assignment targets");
     }
@@ -220,112 +276,115 @@ std::unique_ptr<Expression> Parser::assignment() {
 }
 
 
-std::unique_ptr<Expression> Parser::equality() {
+Expression* Parser::equality() {
     auto expr = comparison();
 
     while(match(TokenType::BANG_EQUAL) || match(TokenType::EQUAL_EQUAL)) {
         Token op = previous();
         auto right = comparison();
-        expr = std::make_unique<BinaryExpression>(op, std::move(expr), std::move(right));
+        expr = arena.New<BinaryExpression>(op, expr, right);
     }
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::logic_or() {
+Expression* Parser::logic_or() {
     auto expr = logic_and();
     while (match(TokenType::OR)) {
         Token op = previous();
         auto right = logic_and();
-        expr = std::make_unique<LogicalExpression>(std::move(expr), op, std::move(right));
+        expr = arena.New<LogicalExpression>(expr, op, right);
     }
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::logic_and() {
+Expression* Parser::logic_and() {
     auto expr = equality();
     while (match(TokenType::AND)) {
         Token op = previous();
         auto right = equality();
-        expr = std::make_unique<LogicalExpression>(std::move(expr), op, std::move(right));
+        expr = arena.New<LogicalExpression>(expr, op, right);
     }
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::comparison() {
+Expression* Parser::comparison() {
     auto expr = addition();
 
     while(match(TokenType::GREATER) || match(TokenType::GREATER_EQUAL) ||
           match(TokenType::LESS) || match(TokenType::LESS_EQUAL)) {
         Token op = previous();
         auto right = addition();
-        expr = std::make_unique<BinaryExpression>(op, std::move(expr), std::move(right));
+        expr = arena.New<BinaryExpression>(op, expr, right);
     }
 
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::addition() {
+Expression* Parser::addition() {
     auto expr = multiplication();
 
     while(match(TokenType::PLUS) || match(TokenType::MINUS)) {
         Token op = previous();
         auto right = multiplication();
-        expr = std::make_unique<BinaryExpression>(op, std::move(expr), std::move(right));
+        expr = arena.New<BinaryExpression>(op, expr, right);
     }
 
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::multiplication() {
+Expression* Parser::multiplication() {
     auto expr = unary();
 
     while(match(TokenType::STAR) || match(TokenType::SLASH)) {
         Token op = previous();
         auto right = unary();
-        expr = std::make_unique<BinaryExpression>(op, std::move(expr), std::move(right));
+        expr = arena.New<BinaryExpression>(op, expr, right);
     }
 
     return expr;
 }
 
 
-std::unique_ptr<Expression> Parser::unary() {
+Expression* Parser::unary() {
     if (match(TokenType::BANG) || match(TokenType::MINUS) || match(TokenType::PLUS))  {
         Token op = previous();
         auto right = unary();
-        return std::make_unique<UnaryExpression>(op, std::move(right));
+        return arena.New<UnaryExpression>(op, right);
     }
     return call();
 }
 
 
-std::unique_ptr<Expression> Parser::finish_call(std::unique_ptr<Expression> callee) {
-    std::list<std::unique_ptr<Expression>> arguments;
+Expression* Parser::finish_call(Expression* callee) {
+    size_t base = expressionStack.size();
     if (!check(TokenType::RIGHT_PAREN)) {
         do {
-            if (arguments.size() >= 255) {
+            if (expressionStack.size() - base >= 255) {
                 error(peek(), "Function cannot have more than 255 arguments");
             }
-            arguments.push_back(expression());
+            expressionStack.push_back(expression());
         } while(match(TokenType::COMMA));
     }
 
     Token token =  consume(TokenType::RIGHT_PAREN, "Expect ')' after arguments in func call");
-    return std::make_unique<CallExpression>(std::move(callee), token, arguments);
+    auto first = expressionStack.begin() + base;
+    auto arguments = arena.NewArray<Expression*>(first, expressionStack.end());
+    expressionStack.erase(first, expressionStack.end());
+    return arena.New<CallExpression>(callee, token, arguments);
 }
 
 
-std::unique_ptr<Expression> Parser::call() {
+Expression* Parser::call() {
     auto expr = primary();
 
     while(true) {
         if (match(TokenType::LEFT_PAREN)) {
-            expr = finish_call(std::move(expr));
+            expr = finish_call(expr);
         } else break;
     }
 
@@ -334,48 +393,59 @@ std::unique_ptr<Expression> Parser::call() {
 
 
 
-std::unique_ptr<Expression> Parser::primary() {
+Expression* Parser::primary() {
     if (match(TokenType::NIL)) {
-        return std::make_unique<LiteralExpression>(Value());
+        return arena.New<LiteralExpression>(Value());
     }
 
     if (match(TokenType::FALSE)) {
-        return std::make_unique<LiteralExpression>(false);
+        return arena.New<LiteralExpression>(false);
     }
 
     if (match(TokenType::TRUE)) {
-        return std::make_unique<LiteralExpression>(true);
+        return arena.New<LiteralExpression>(true);
     }
 
     if (match(TokenType::NUMBER)) {
-        return std::make_unique<LiteralExpression>(std::stod(previous().literal, nullptr));
+        return arena.New<LiteralExpression>(parseNumber(previous()));
     }
 
     if (match(TokenType::STRING)) {
-        return std::make_unique<LiteralExpression>(previous().literal);
+        /* The lexeme still has its surrounding quotes */
+        const Token& token = previous();
+        return arena.New<LiteralExpression>(heap.MakeString(token.start + 1, token.length - 2));
     }
 
     if (match(TokenType::IDENTIFIER)) {
-        return std::make_unique<VariableExpression>(previous());
+        return arena.New<VariableExpression>(previous());
     }
 
     if (match(TokenType::LEFT_PAREN)) {
         auto expr = expression();
         consume(TokenType::RIGHT_PAREN, "Expect ')' right after expression");
-        return std::make_unique<GroupingExpression>(std::move(expr));
+        return arena.New<GroupingExpression>(expr);
     }
 
     throw error(peek(), "Error parsing primary. Primary must be BOOL, NUBMER, or STRING");
 }
 
 
-Token Parser::consume(TokenType type, const char* message) {
+Span<Statement*> Parser::takeStatements(size_t base) {
+    auto first = statementStack.begin() + base;
+    auto statements = arena.NewArray<Statement*>(first, statementStack.end());
+    statementStack.erase(first, statementStack.end());
+    return statements;
+}
+
+
+const Token& Parser::consume(TokenType type, const char* message) {
     if (check(type)) return advance();
     throw error(peek(), message);
 }
 
 
-ParserError Parser::error(Token token, const char* message) {
+ParserError Parser::error(const Token& token, const char* message) {
+    hadError = true;
     Lox::Error(token, message);
     return ParserError(peek(), message);
 }
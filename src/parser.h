@@ -7,8 +7,12 @@
 
 #include "ast.h"
 #include "token.h"
+#include "scanner.h"
 #include "token_type.h"
+#include "heap.h"
+#include "arena.h"
 #include "lox_exception.hpp"
+#include "resolver.h"
 
 
 /* Recursive Decent Parser
@@ -54,91 +58,130 @@
 class Parser {
 
 public:
-    Parser(const std::vector<Token> &tokenList);
+    /* Nodes are allocated in arena, which must outlive the returned tree.
+     * Tokens are pulled from scanner as needed and point into its source.
+     * A lazy Parser checks the body of a top-level function in full, parsing
+     * and resolving it so that its errors are reported as they would be
+     * otherwise, but then gives its nodes back and leaves the function to
+     * ParseDeferred(). */
+    Parser(Scanner& scanner, Heap& heap, Arena& arena, bool lazy = false);
     virtual ~Parser();
 
-    std::list<std::unique_ptr<Statement>> Parse();
+    Span<Statement*> Parse();
+
+    /* Parses a body a lazy Parser checked and dropped, into the arena of its
+     * tree; heap must be pinned */
+    static Span<Statement*> ParseDeferred(const DeferredBody& body, Heap& heap);
+
+    /* Whether an error was reported, including those parsing went on after */
+    bool HadError() const { return hadError; }
 
 private:
     bool match(TokenType type);
 
-    Token consume(TokenType type, const char* message);
+    const Token& consume(TokenType type, const char* message);
+
+    Statement* statement();
 
-    std::unique_ptr<Statement> statement();
+    Statement* declaration();
 
-    std::unique_ptr<Statement> declaration();
+    Span<Statement*> block();
 
-    std::list<std::unique_ptr<Statement>> block();
+    DeferredBody* check_block(FunctionStatement& function);
 
-    std::unique_ptr<Statement> print_statement();
+    Statement* print_statement();
 
-    std::unique_ptr<Statement> if_statement();
+    Statement* if_statement();
 
-    std::unique_ptr<Statement> return_statement();
+    Statement* return_statement();
 
-    std::unique_ptr<Statement> while_statement();
+    Statement* while_statement();
 
-    std::unique_ptr<Statement> for_statement();
+    Statement* for_statement();
 
-    std::unique_ptr<Statement> expression_statement();
+    Statement* expression_statement();
 
-    std::unique_ptr<Statement> var_declaration();
+    Statement* var_declaration();
 
-    std::unique_ptr<Statement> fun_declaration(const char*);
+    Statement* fun_declaration(const char*);
 
-    std::unique_ptr<Expression> expression();
+    Expression* expression();
 
-    std::unique_ptr<Expression> assignment();
+    Expression* assignment();
 
-    std::unique_ptr<Expression> equality();
+    Expression* equality();
 
-    std::unique_ptr<Expression> logic_or();
+    Expression* logic_or();
 
-    std::unique_ptr<Expression> logic_and();
+    Expression* logic_and();
 
-    std::unique_ptr<Expression> comparison();
+    Expression* comparison();
 
-    std::unique_ptr<Expression> addition();
+    Expression* addition();
 
-    std::unique_ptr<Expression> multiplication();
+    Expression* multiplication();
 
-    std::unique_ptr<Expression> unary();
+    Expression* unary();
 
-    std::unique_ptr<Expression> call();
+    Expression* call();
 
-    std::unique_ptr<Expression> finish_call(std::unique_ptr<Expression>);
+    Expression* finish_call(Expression*);
 
-    std::unique_ptr<Expression> primary();
+    Expression* primary();
+
+    Span<Statement*> takeStatements(size_t base);
+
+    /* Records the line stmt starts on */
+    Statement* at(int line, Statement* stmt) {
+        stmt->line = line;
+        return stmt;
+    }
 
-    ParserError error(Token token, const char* message);
+    ParserError error(const Token& token, const char* message);
 
     inline bool check(TokenType type) const {
         if (isAtEnd()) return false;
         return peek().type == type;
     }
 
-    inline Token advance() {
-        if (!isAtEnd()) current++;
+    inline const Token& advance() {
+        if (!isAtEnd()) {
+            previousToken = currentToken;
+            currentToken = scanner.Next();
+        }
         return previous();
     }
 
-    inline Token previous() const {
-        return tokenList[current-1];
+    inline const Token& previous() const {
+        return previousToken;
     }
 
     inline bool isAtEnd() const {
         return peek().type == TokenType::TEOF;
     }
 
-    inline Token peek() const {
-        return tokenList[current];
+    inline const Token& peek() const {
+        return currentToken;
     }
 
 
 private:
-    /* current points to the currently in process token */
-    int current;
-    std::vector<Token> tokenList;
+    Scanner& scanner;
+    /* The token being looked at and the one consumed last */
+    Token currentToken;
+    Token previousToken;
+    Heap& heap;
+    Arena& arena;
+
+    /* Children are collected on these stacks while a list is being parsed
+     * and copied into the arena once its length is known */
+    std::vector<Statement*> statementStack;
+    std::vector<Expression*> expressionStack;
+    std::vector<Token> parameterStack;
+
+    bool lazy;
+    int depth = 0;   // Blocks, function bodies included, around the current token
+    bool hadError = false;
 };
 
 #endif
@@ -0,0 +1,192 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <fmt/format.h>
+
+
+std::atomic<Profiler*> Profiler::running{nullptr};
+
+Profiler::Profiler() {
+    running.store(this);
+
+    struct sigaction action = {};
+    action.sa_handler = sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    itimerval timer = {};
+    timer.it_interval.tv_usec = SAMPLE_MICROSECONDS;
+    timer.it_value.tv_usec = SAMPLE_MICROSECONDS;
+    cpuMilliseconds = cpuTime();
+    sampling = setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+    if (!sampling) cpuMilliseconds = 0;
+}
+
+Profiler::~Profiler() {
+    stop();
+    running.store(nullptr);
+}
+
+void Profiler::Enter(const FunctionStatement& function) {
+    Node* node = current.load(std::memory_order_relaxed);
+    for (Node* child: node->children) {
+        if (child->function == &function) {
+            child->calls++;
+            current.store(child, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    if (names.count(&function) == 0) {
+        names.emplace(&function, fmt::format("{}:{}", function.name.Lexeme(), function.name.line));
+    }
+    nodes.emplace_back(new Node(&function, node));
+    Node* child = nodes.back().get();
+    child->calls = 1;
+    node->children.push_back(child);
+    current.store(child, std::memory_order_relaxed);
+}
+
+void Profiler::sample(int) {
+    /* Only lock-free atomics here: this runs inside a signal handler */
+    Profiler* profiler = running.load(std::memory_order_relaxed);
+    if (profiler != nullptr) {
+        profiler->current.load(std::memory_order_relaxed)->samples.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Profiler::stop() {
+    if (!sampling) return;
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sampling = false;
+    cpuMilliseconds = cpuTime() - cpuMilliseconds;
+}
+
+double Profiler::cpuTime() {
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+const std::string& Profiler::name(const FunctionStatement* function) const {
+    return names.at(function);
+}
+
+void Profiler::Report(std::FILE* out) {
+    stop();
+
+    struct Totals {
+        const FunctionStatement* function;
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;
+        uint64_t exclusive = 0;
+    };
+    std::unordered_map<const FunctionStatement*, Totals> totals;
+
+    /* Depth first, with each node's subtree summed on the way back up. A
+     * recursive function's time counts once, at its outermost call. */
+    std::unordered_map<const FunctionStatement*, int> active;
+    std::vector<std::pair<Node*, size_t>> path { { &root, 0 } };
+    std::vector<uint64_t> subtree { 0 };
+    active[nullptr]++;
+    while (!path.empty()) {
+        Node* node = path.back().first;
+        size_t& next = path.back().second;
+        if (next < node->children.size()) {
+            Node* child = node->children[next++];
+            active[child->function]++;
+            path.emplace_back(child, 0);
+            subtree.push_back(0);
+            continue;
+        }
+
+        uint64_t samples = node->samples.load(std::memory_order_relaxed);
+        uint64_t inclusive = subtree.back() + samples;
+        Totals& function = totals.emplace(node->function, Totals { node->function }).first->second;
+        function.calls += node->calls;
+        function.exclusive += samples;
+        if (--active[node->function] == 0) function.inclusive += inclusive;
+
+        path.pop_back();
+        subtree.pop_back();
+        if (!subtree.empty()) subtree.back() += inclusive;
+    }
+
+    std::vector<Totals> functions;
+    uint64_t samples = 0;
+    for (auto& function: totals) {
+        functions.push_back(function.second);
+        samples += function.second.exclusive;
+    }
+    std::sort(functions.begin(), functions.end(), [](const Totals& a, const Totals& b) {
+        return a.exclusive != b.exclusive ? a.exclusive > b.exclusive : a.inclusive > b.inclusive;
+    });
+
+    double perSample = samples > 0 ? cpuMilliseconds / samples : 0;
+    auto milliseconds = [perSample](uint64_t samples) {
+        return samples * perSample;
+    };
+    fmt::print(out, "[profile] {} samples over {:.2f} ms of CPU time\n", samples, cpuMilliseconds);
+    fmt::print(out, "[profile] {:>10} {:>14} {:>14}  {}\n", "calls", "inclusive ms", "exclusive ms", "function");
+    for (auto& function: functions) {
+        fmt::print(out, "[profile] {:>10} {:>14.2f} {:>14.2f}  {}\n",
+                   function.function == nullptr ? std::string("-") : std::to_string(function.calls),
+                   milliseconds(function.inclusive), milliseconds(function.exclusive),
+                   name(function.function));
+    }
+
+    /* The busiest lines only */
+    std::vector<std::pair<uint64_t, int>> hits;
+    for (size_t line = 1; line < lines.size(); line++) {
+        if (lines[line] > 0) hits.emplace_back(lines[line], static_cast<int>(line));
+    }
+    std::sort(hits.begin(), hits.end(), [](const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    if (hits.size() > 20) hits.resize(20);
+    fmt::print(out, "[profile] {:>10}  {}\n", "hits", "line");
+    for (auto& hit: hits) {
+        fmt::print(out, "[profile] {:>10}  {}\n", hit.first, hit.second);
+    }
+}
+
+bool Profiler::WriteStacks(const std::string& path) {
+    stop();
+
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) return false;
+
+    /* Depth first, keeping the names along the trail */
+    std::vector<std::pair<Node*, size_t>> trail { { &root, 0 } };
+    std::vector<size_t> lengths { 0 };
+    std::string stack = name(nullptr);
+    while (!trail.empty()) {
+        Node* node = trail.back().first;
+        size_t& next = trail.back().second;
+        if (next == 0) {
+            uint64_t samples = node->samples.load(std::memory_order_relaxed);
+            if (samples > 0) fmt::print(file, "{} {}\n", stack, samples);
+        }
+        if (next < node->children.size()) {
+            Node* child = node->children[next++];
+            lengths.push_back(stack.size());
+            stack += ";" + name(child->function);
+            trail.emplace_back(child, 0);
+            continue;
+        }
+        trail.pop_back();
+        stack.resize(lengths.back());
+        lengths.pop_back();
+    }
+
+    bool ok = std::ferror(file) == 0;
+    return std::fclose(file) == 0 && ok;
+}
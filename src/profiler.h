@@ -0,0 +1,95 @@
+#ifndef LOX_PROFILER_H
+#define LOX_PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+
+
+/* Profile of a program run by the Interpreter, for --profile.
+ *
+ * Calls are counted exactly in a calling context tree: one node per
+ * distinct chain of functions from the top level, kept current as the
+ * Interpreter enters and leaves functions. Time is sampled instead of
+ * measured, so a call costs no clock reads: a SIGPROF timer charges the
+ * node current when it fires, and each sample stands for an equal share
+ * of the CPU time the run took. The kernel may fire less often than every
+ * SAMPLE_MICROSECONDS. Statements count hits against the line they start on.
+ */
+class Profiler {
+public:
+    static constexpr int SAMPLE_MICROSECONDS = 250;
+
+    /* Starts the sampling timer; only one Profiler may run at a time */
+    Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+    ~Profiler();
+
+    void Enter(const FunctionStatement& function);
+
+    void Exit() {
+        current.store(current.load(std::memory_order_relaxed)->parent, std::memory_order_relaxed);
+    }
+
+    /* A tail call: function takes over the running function's frame */
+    void Replace(const FunctionStatement& function) {
+        Exit();
+        Enter(function);
+    }
+
+    /* Leaves every function, once a runtime error unwound them */
+    void Unwind() {
+        current.store(&root, std::memory_order_relaxed);
+    }
+
+    void Line(int line) {
+        if (static_cast<size_t>(line) >= lines.size()) lines.resize(line + 1);
+        lines[line]++;
+    }
+
+    /* Stops sampling and writes the per-function and per-line tables */
+    void Report(std::FILE* out);
+
+    /* Stops sampling and writes one "script;f;g samples" line per calling
+     * context, the collapsed stack format flame graph tools read */
+    bool WriteStacks(const std::string& path);
+
+private:
+    struct Node {
+        const FunctionStatement* function;   // nullptr for the top level
+        Node* parent;
+        uint64_t calls = 0;
+        std::atomic<uint64_t> samples{0};    // Taken while this context was running
+        std::vector<Node*> children;
+
+        Node(const FunctionStatement* function, Node* parent): function(function), parent(parent) {}
+    };
+
+    static void sample(int);
+
+    void stop();
+
+    static double cpuTime();
+
+    /* Names are taken at the first call, the source may be gone by the report */
+    const std::string& name(const FunctionStatement* function) const;
+
+    Node root{nullptr, nullptr};
+    std::vector<std::unique_ptr<Node>> nodes;   // Every node but root; deep trees free without recursing
+    std::atomic<Node*> current{&root};
+    std::vector<uint64_t> lines;
+    std::unordered_map<const FunctionStatement*, std::string> names { { nullptr, "script" } };
+    bool sampling = false;
+    double cpuMilliseconds = 0;   // Between the start of sampling and stop()
+
+    static std::atomic<Profiler*> running;
+};
+
+#endif
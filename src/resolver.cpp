@@ -0,0 +1,212 @@
+#include "resolver.h"
+#include "lox.hpp"
+
+#include <algorithm>
+
+
+Resolver::Resolver(Arena& arena): arena(arena) {
+}
+
+int Resolver::Resolve(Span<Statement*> statements) {
+    FunctionScope script { nullptr, {}, {}, 0, 0 };
+    current = &script;
+    resolve(statements);
+    current = nullptr;
+    return script.slotCount;
+}
+
+void Resolver::ResolveDeferred(FunctionStatement& function) {
+    /* Nothing but globals is in scope around a top-level function */
+    FunctionScope script { nullptr, {}, {}, 0, 0 };
+    current = &script;
+    resolveFunction(function);
+    current = nullptr;
+}
+
+void Resolver::resolve(Span<Statement*> statements) {
+    for (auto& statement: statements) {
+        resolve(*statement);
+    }
+}
+
+// Statement::Visitor Interface methods
+void Resolver::Visit(PrintStatement& stmt) {
+    resolve(*stmt.expression);
+}
+
+void Resolver::Visit(ExpressionStatement& stmt) {
+    resolve(*stmt.expression);
+}
+
+void Resolver::Visit(VarStatement& stmt) {
+    /* The initializer is resolved first, so it sees an outer variable of the same name */
+    if (stmt.init) {
+        resolve(*stmt.init);
+    }
+    stmt.slot = declare(stmt.token);
+}
+
+void Resolver::Visit(IfStatement& stmt) {
+    resolve(*stmt.expression);
+    resolve(*stmt.thenBranch);
+    if (stmt.elseBranch != nullptr) {
+        resolve(*stmt.elseBranch);
+    }
+}
+
+void Resolver::Visit(ReturnStatement& stmt) {
+    if (current->enclosing == nullptr) {
+        Lox::Error(stmt.keyword, "Cannot return from top-level code");
+        throw CompileError(stmt.keyword, "Cannot return from top-level code");
+    }
+    if (stmt.value != nullptr) {
+        resolve(*stmt.value);
+    }
+}
+
+void Resolver::Visit(WhileStatement& stmt) {
+    resolve(*stmt.expression);
+    resolve(*stmt.statement);
+}
+
+void Resolver::Visit(BlockStatement& stmt) {
+    stmt.firstSlot = current->locals.size();
+    beginScope();
+    resolve(stmt.statements);
+    stmt.closesUpvalues = endScope();
+}
+
+void Resolver::Visit(FunctionStatement& stmt) {
+    /* Declared before the body so that it can refer to itself */
+    stmt.slot = declare(stmt.name);
+    resolveFunction(stmt);
+}
+
+void Resolver::resolveFunction(FunctionStatement& stmt) {
+    /* Parameters and the body's locals share one flat frame */
+    FunctionScope function { current, {}, {}, 1, 0 };
+    current = &function;
+    for (auto& param: stmt.params) {
+        declare(param);
+    }
+    resolve(stmt.stmts);
+    current = function.enclosing;
+
+    stmt.slotCount = function.slotCount;
+    stmt.upvalues = arena.NewArray<UpvalueRef>(function.upvalues.begin(), function.upvalues.end());
+}
+
+// Expression::Visitor Interface methods
+void Resolver::Visit(BinaryExpression& expr) {
+    resolve(*expr.left);
+    resolve(*expr.right);
+}
+
+void Resolver::Visit(UnaryExpression& expr) {
+    resolve(*expr.expression);
+}
+
+void Resolver::Visit(CallExpression& expr) {
+    resolve(*expr.callee);
+    for (auto& arg: expr.arguments) {
+        resolve(*arg);
+    }
+}
+
+void Resolver::Visit(GroupingExpression& expr) {
+    resolve(*expr.expression);
+}
+
+void Resolver::Visit(LiteralExpression& expr) {
+}
+
+void Resolver::Visit(LogicalExpression& expr) {
+    resolve(*expr.left);
+    resolve(*expr.right);
+}
+
+void Resolver::Visit(VariableExpression& expr) {
+    resolveVariable(expr.token, expr.kind, expr.index);
+}
+
+void Resolver::Visit(AssignmentExpression& expr) {
+    resolve(*expr.value);
+    resolveVariable(expr.name, expr.kind, expr.index);
+}
+
+int Resolver::declare(const Token& name) {
+    if (current->scopeDepth == 0) return -1;
+
+    auto& locals = current->locals;
+    for (auto it = locals.rbegin(); it != locals.rend() && it->depth == current->scopeDepth; ++it) {
+        if (it->name.SameLexeme(name)) {
+            Lox::Error(name, "Variable with this name already declared in this scope");
+            throw CompileError(name, "Variable with this name already declared in this scope");
+        }
+    }
+    /* Slots are handed out in declaration order and reused once a block ends */
+    locals.push_back(Local { name, current->scopeDepth, false });
+    current->slotCount = std::max<int>(current->slotCount, locals.size());
+    return locals.size() - 1;
+}
+
+void Resolver::beginScope() {
+    current->scopeDepth++;
+}
+
+bool Resolver::endScope() {
+    current->scopeDepth--;
+    bool captured = false;
+    auto& locals = current->locals;
+    while (!locals.empty() && locals.back().depth > current->scopeDepth) {
+        captured = captured || locals.back().captured;
+        locals.pop_back();
+    }
+    return captured;
+}
+
+void Resolver::resolveVariable(const Token& name, VariableKind& kind, int& index) {
+    if ((index = resolveLocal(current, name)) >= 0) {
+        kind = VariableKind::LOCAL;
+    } else if ((index = resolveUpvalue(current, name)) >= 0) {
+        kind = VariableKind::UPVALUE;
+    } else {
+        kind = VariableKind::GLOBAL;
+    }
+}
+
+int Resolver::resolveLocal(FunctionScope* function, const Token& name) {
+    for (int i = function->locals.size() - 1; i >= 0; i--) {
+        if (function->locals[i].name.SameLexeme(name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Resolver::resolveUpvalue(FunctionScope* function, const Token& name) {
+    if (function->enclosing == nullptr) return -1;
+
+    int local = resolveLocal(function->enclosing, name);
+    if (local >= 0) {
+        function->enclosing->locals[local].captured = true;
+        return addUpvalue(function, local, true);
+    }
+
+    int upvalue = resolveUpvalue(function->enclosing, name);
+    if (upvalue >= 0) {
+        return addUpvalue(function, upvalue, false);
+    }
+    return -1;
+}
+
+int Resolver::addUpvalue(FunctionScope* function, int index, bool isLocal) {
+    auto& upvalues = function->upvalues;
+    for (size_t i = 0; i < upvalues.size(); i++) {
+        if (upvalues[i].index == index && upvalues[i].isLocal == isLocal) {
+            return i;
+        }
+    }
+    upvalues.push_back(UpvalueRef { index, isLocal });
+    return upvalues.size() - 1;
+}
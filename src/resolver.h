@@ -0,0 +1,113 @@
+#ifndef LOX_RESOLVER_H
+#define LOX_RESOLVER_H
+
+#include <vector>
+
+#include "ast.h"
+#include "arena.h"
+#include "lox_exception.hpp"
+
+
+/* Static pass run between Parser::Parse() and Interpreter::Interpret().
+ * Every local variable gets a slot in the flat frame of the function that
+ * declares it, and every reference is annotated with where to find the
+ * variable: a slot of the running frame, an upvalue, or a global looked up
+ * by name. A variable used by a nested function is marked captured, and
+ * only those are moved into upvalues by the Interpreter. Top-level
+ * declarations stay global; locals of top-level blocks live in the frame
+ * of the script itself.
+ */
+class Resolver: public Expression::Visitor, public Statement::Visitor {
+public:
+    /* Upvalue tables are allocated in arena, the one the tree lives in */
+    Resolver(Arena& arena);
+
+    /* Returns the number of slots the script's own frame needs */
+    int Resolve(Span<Statement*> statements);
+
+    /* Resolves the body of a top-level function once Parser::ParseDeferred()
+     * has filled it in; Resolve() saw only its parameters */
+    void ResolveDeferred(FunctionStatement& function);
+
+    void Visit(PrintStatement& stmt) override;
+
+    void Visit(ExpressionStatement& stmt) override;
+
+    void Visit(VarStatement& stmt) override;
+
+    void Visit(IfStatement& stmt) override;
+
+    void Visit(ReturnStatement& stmt) override;
+
+    void Visit(WhileStatement& stmt) override;
+
+    void Visit(BlockStatement& stmt) override;
+
+    void Visit(FunctionStatement& stmt) override;
+
+    void Visit(BinaryExpression& expr) override;
+
+    void Visit(UnaryExpression& expr) override;
+
+    void Visit(CallExpression& expr) override;
+
+    void Visit(GroupingExpression& expr) override;
+
+    void Visit(LiteralExpression& expr) override;
+
+    void Visit(LogicalExpression& expr) override;
+
+    void Visit(VariableExpression& expr) override;
+
+    void Visit(AssignmentExpression& expr) override;
+
+private:
+    struct Local {
+        Token name;
+        int depth;
+        bool captured;
+    };
+
+    /* The function being resolved; the script is the outermost one */
+    struct FunctionScope {
+        FunctionScope* enclosing;
+        std::vector<Local> locals;
+        std::vector<UpvalueRef> upvalues;
+        int scopeDepth;
+        int slotCount;
+    };
+
+    void resolve(Expression& expr) {
+        expr.Accept(*this);
+    }
+
+    void resolve(Statement& stmt) {
+        stmt.Accept(*this);
+    }
+
+    void resolve(Span<Statement*> statements);
+
+    /* Parameters and body of function, in a frame of its own */
+    void resolveFunction(FunctionStatement& function);
+
+    /* Slot of the new local, or -1 for a global */
+    int declare(const Token& name);
+
+    void beginScope();
+
+    /* Returns whether a closure captured one of the scope's locals */
+    bool endScope();
+
+    void resolveVariable(const Token& name, VariableKind& kind, int& index);
+
+    int resolveLocal(FunctionScope* function, const Token& name);
+
+    int resolveUpvalue(FunctionScope* function, const Token& name);
+
+    int addUpvalue(FunctionScope* function, int index, bool isLocal);
+
+    Arena& arena;
+    FunctionScope* current = nullptr;
+};
+
+#endif
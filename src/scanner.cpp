@@ -1,29 +1,229 @@
 #include "scanner.h"
-#include <cctype>
-#include <cstdlib>
-
-
-const std::map<std::string, TokenType> Scanner::keywords = {
-    { "and", TokenType::AND },
-    { "or", TokenType::OR },
-    { "class", TokenType::CLASS },
-    { "else", TokenType::ELSE },
-    { "false", TokenType::FALSE },
-    { "for", TokenType::FOR },
-    { "fun", TokenType::FUN },
-    { "if", TokenType::IF },
-    { "nil", TokenType::NIL },
-    { "print", TokenType::PRINT },
-    { "return", TokenType::RETURN },
-    { "super", TokenType::SUPER },
-    { "this", TokenType::THIS },
-    { "true", TokenType::TRUE },
-    { "var", TokenType::VAR },
-    { "while", TokenType::WHILE },
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+/* Character classes used by the scanner. Runs of whitespace, identifier
+ * characters and digits, and the rest of a comment or string, are
+ * classified a vector at a time (32 bytes with AVX2, 16 with SSE2) and the
+ * run length is read off the first clear bit of the mask. Fewer than a
+ * vector's worth of bytes before the end of the source are handled by the
+ * scalar loop, which is also the whole implementation elsewhere.
+ */
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool isIdentifier(char c) {
+    return isAlpha(c) || isDigit(c);
+}
+
+static inline bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+#if defined(__AVX2__)
+using Chars = __m256i;
+static constexpr size_t SCAN_WIDTH = 32;
+static constexpr uint32_t FULL_MASK = 0xffffffffu;
+
+static inline Chars load(const char* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+static inline uint32_t equal(Chars c, char x) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(x)));
+}
+
+/* Signed compares are fine: bytes >= 0x80 are negative and below every bound */
+static inline uint32_t inRange(Chars c, char lo, char hi) {
+    return _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c)));
+}
+
+static inline Chars foldCase(Chars c) {
+    return _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+}
+#elif defined(__SSE2__)
+using Chars = __m128i;
+static constexpr size_t SCAN_WIDTH = 16;
+static constexpr uint32_t FULL_MASK = 0xffffu;
+
+static inline Chars load(const char* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+static inline uint32_t equal(Chars c, char x) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(x)));
+}
+
+/* Signed compares are fine: bytes >= 0x80 are negative and below every bound */
+static inline uint32_t inRange(Chars c, char lo, char hi) {
+    return _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c)));
+}
+
+static inline Chars foldCase(Chars c) {
+    return _mm_or_si128(c, _mm_set1_epi8(0x20));
+}
+#endif
+
+#ifdef FULL_MASK
+#define SCAN_SIMD 1
+
+static inline uint32_t identifierMask(Chars c) {
+    return inRange(c, '0', '9') | inRange(foldCase(c), 'a', 'z');
+}
+
+static inline uint32_t whitespaceMask(Chars c) {
+    return equal(c, ' ') | equal(c, '\t') | equal(c, '\r') | equal(c, '\n');
+}
+#endif
+
+/* Length of the run of identifier characters starting at p */
+static inline size_t identifierRun(const char* p, const char* end) {
+    const char* q = p;
+#ifdef SCAN_SIMD
+    for (; static_cast<size_t>(end - q) >= SCAN_WIDTH; q += SCAN_WIDTH) {
+        uint32_t miss = ~identifierMask(load(q)) & FULL_MASK;
+        if (miss != 0) return (q - p) + __builtin_ctz(miss);
+    }
+#endif
+    while (q < end && isIdentifier(*q)) q++;
+    return q - p;
+}
+
+/* Length of the run of digits starting at p */
+static inline size_t digitRun(const char* p, const char* end) {
+    const char* q = p;
+#ifdef SCAN_SIMD
+    for (; static_cast<size_t>(end - q) >= SCAN_WIDTH; q += SCAN_WIDTH) {
+        uint32_t miss = ~inRange(load(q), '0', '9') & FULL_MASK;
+        if (miss != 0) return (q - p) + __builtin_ctz(miss);
+    }
+#endif
+    while (q < end && isDigit(*q)) q++;
+    return q - p;
+}
+
+/* Length of the whitespace run starting at p; adds the newlines in it to line */
+static inline size_t whitespaceRun(const char* p, const char* end, int& line) {
+    const char* q = p;
+    /* Most gaps between tokens are empty or a single space */
+    if (q == end || !isWhitespace(*q)) return 0;
+    if (*q == ' ' && q + 1 < end && !isWhitespace(q[1])) return 1;
+#ifdef SCAN_SIMD
+    for (; static_cast<size_t>(end - q) >= SCAN_WIDTH; q += SCAN_WIDTH) {
+        Chars c = load(q);
+        uint32_t miss = ~whitespaceMask(c) & FULL_MASK;
+        uint32_t newlines = equal(c, '\n');
+        if (miss != 0) {
+            line += __builtin_popcount(newlines & (miss ^ (miss - 1)));
+            return (q - p) + __builtin_ctz(miss);
+        }
+        line += __builtin_popcount(newlines);
+    }
+#endif
+    for (; q < end && isWhitespace(*q); q++) {
+        if (*q == '\n') line++;
+    }
+    return q - p;
+}
+
+/* Offset of the first c at or after p (end - p if there is none); adds the
+ * newlines skipped over to line */
+static inline size_t findChar(const char* p, const char* end, char c, int& line) {
+    const char* q = p;
+#ifdef SCAN_SIMD
+    for (; static_cast<size_t>(end - q) >= SCAN_WIDTH; q += SCAN_WIDTH) {
+        Chars chars = load(q);
+        uint32_t hit = equal(chars, c);
+        uint32_t newlines = c == '\n' ? 0 : equal(chars, '\n');
+        if (hit != 0) {
+            line += __builtin_popcount(newlines & (hit - 1));
+            return (q - p) + __builtin_ctz(hit);
+        }
+        line += __builtin_popcount(newlines);
+    }
+#endif
+    for (; q < end && *q != c; q++) {
+        if (*q == '\n') line++;
+    }
+    return q - p;
+}
+
+
+/* Keywords are looked up with a perfect hash: (first + 5 * last + length)
+ * mod 32 sends every keyword to its own slot, so a lookup costs one hash,
+ * one length check and one memcmp. */
+struct Keyword {
+    const char* text;
+    size_t length;
+    TokenType type;
+};
+
+#define NO_KEYWORD { nullptr, 0, TokenType::IDENTIFIER }
+
+static const Keyword keywords[32] = {
+    NO_KEYWORD, NO_KEYWORD,
+    { "else", 4, TokenType::ELSE },
+    { "for", 3, TokenType::FOR },
+    { "false", 5, TokenType::FALSE },
+    NO_KEYWORD, NO_KEYWORD,
+    { "class", 5, TokenType::CLASS },
+    NO_KEYWORD,
+    { "if", 2, TokenType::IF },
+    NO_KEYWORD,
+    { "or", 2, TokenType::OR },
+    NO_KEYWORD,
+    { "nil", 3, TokenType::NIL },
+    NO_KEYWORD,
+    { "fun", 3, TokenType::FUN },
+    NO_KEYWORD,
+    { "true", 4, TokenType::TRUE },
+    { "super", 5, TokenType::SUPER },
+    { "var", 3, TokenType::VAR },
+    NO_KEYWORD,
+    { "while", 5, TokenType::WHILE },
+    NO_KEYWORD,
+    { "this", 4, TokenType::THIS },
+    { "and", 3, TokenType::AND },
+    { "print", 5, TokenType::PRINT },
+    NO_KEYWORD, NO_KEYWORD, NO_KEYWORD, NO_KEYWORD,
+    { "return", 6, TokenType::RETURN },
+    NO_KEYWORD,
 };
 
+#undef NO_KEYWORD
+
+static TokenType keywordType(const char* text, size_t length) {
+    if (length < 2 || length > 6) return TokenType::IDENTIFIER;
+    uint8_t first = text[0], last = text[length - 1];
+    const Keyword& keyword = keywords[(first + 5 * last + length) & 31];
+    if (keyword.length == length && std::memcmp(keyword.text, text, length) == 0) {
+        return keyword.type;
+    }
+    return TokenType::IDENTIFIER;
+}
+
+
+Scanner::Scanner(const char *source): Scanner(source, std::strlen(source)) {
+}
+
 
-Scanner::Scanner(const char *source): source(source) {
+Scanner::Scanner(const char *source, size_t length, int line)
+    : start(0), current(0), line(line), source(source), length(length) {
 }
 
 
@@ -31,110 +231,110 @@ Scanner::~Scanner() {
 }
 
 
-std::vector<Token> Scanner::ScanTokens() {
-    start = 0;
-    current = 0;
-    line = 1;
-    while (!isAtEnd()) {
+Token Scanner::Next() {
+    while (true) {
+        skipWhitespace();
+        if (isAtEnd()) {
+            return Token(TokenType::TEOF, source + length, 0, line);
+        }
         start = current;
-        scanToken();
+        TokenType type = scanToken();
+        if (type != TokenType::TEOF) {
+            return Token(type, source + start, current - start, line);
+        }
     }
-    tokens.push_back(Token(TokenType::TEOF, "", "", line));
+}
+
+
+std::vector<Token> Scanner::ScanTokens() {
+    std::vector<Token> tokens;
+    do {
+        tokens.push_back(Next());
+    } while (tokens.back().type != TokenType::TEOF);
     return tokens;
 }
 
-void Scanner::scanToken() {
+/* Type of the token starting at start, or TEOF if the characters were
+ * rejected and there is no token */
+TokenType Scanner::scanToken() {
     char c = advance();
     switch (c) {
-    case '(': addToken(TokenType::LEFT_PAREN); break;
-    case ')': addToken(TokenType::RIGHT_PAREN); break;
-    case '{': addToken(TokenType::LEFT_BRACE); break;
-    case '}': addToken(TokenType::RIGHT_BRACE); break;
-    case ',': addToken(TokenType::COMMA); break;
-    case '.': addToken(TokenType::DOT); break;
-    case '-': addToken(TokenType::MINUS); break;
-    case '+': addToken(TokenType::PLUS); break;
-    case ';': addToken(TokenType::SEMICOLON); break;
-    case '*': addToken(TokenType::STAR); break;
-    case '!': addToken(match('=') ? TokenType::BANG_EQUAL : TokenType::BANG); break;
-    case '=': addToken(match('=') ? TokenType::EQUAL_EQUAL : TokenType::EQUAL); break;
-    case '<': addToken(match('=') ? TokenType::LESS_EQUAL : TokenType::LESS); break;
-    case '>': addToken(match('=') ? TokenType::GREATER_EQUAL : TokenType::GREATER); break;
-    case '/':
-        if (match('/')) {
-            // A comment goes until the end of the line.
-            while (peek() != '\n' && !isAtEnd()) advance();
-        } else {
-            addToken(TokenType::SLASH);
-        }
-        break;
-    case '\r':
-    case ' ':
-    case '\t':
-        // Ignore whitespace.
-        break;
-
-    case '\n':
-        line++;
-        break;
-
-    case '"': string(); break;
+    case '(': return TokenType::LEFT_PAREN;
+    case ')': return TokenType::RIGHT_PAREN;
+    case '{': return TokenType::LEFT_BRACE;
+    case '}': return TokenType::RIGHT_BRACE;
+    case ',': return TokenType::COMMA;
+    case '.': return TokenType::DOT;
+    case '-': return TokenType::MINUS;
+    case '+': return TokenType::PLUS;
+    case ';': return TokenType::SEMICOLON;
+    case '*': return TokenType::STAR;
+    case '!': return match('=') ? TokenType::BANG_EQUAL : TokenType::BANG;
+    case '=': return match('=') ? TokenType::EQUAL_EQUAL : TokenType::EQUAL;
+    case '<': return match('=') ? TokenType::LESS_EQUAL : TokenType::LESS;
+    case '>': return match('=') ? TokenType::GREATER_EQUAL : TokenType::GREATER;
+    case '/': return TokenType::SLASH;
+
+    case '"': return string();
 
     default:
-        if (isdigit(c)) {
-            number();
-        } else if (isalpha(c)) {
-            identifier();
-        }else {
-            std::cerr << line << " unexpected character." << std::endl;
+        if (isDigit(c)) {
+            return number();
+        } else if (isAlpha(c)) {
+            return identifier();
         }
-        break;
+        std::cerr << line << " unexpected character." << std::endl;
+        hadError = true;
+        return TokenType::TEOF;
     }
 }
 
-void Scanner::identifier() {
-    while (isalnum(peek())) advance();
-    std::string text = source.substr(start, current-start);
-    TokenType type = TokenType::IDENTIFIER;
-    auto it = keywords.find(text);
-    if (it != keywords.end()) {
-        type = it->second;
+/* Whitespace and comments between tokens */
+void Scanner::skipWhitespace() {
+    while (true) {
+        current += whitespaceRun(source + current, source + length, line);
+        if (current + 1 < length && source[current] == '/' && source[current + 1] == '/') {
+            // A comment goes until the end of the line.
+            current += findChar(source + current, source + length, '\n', line);
+        } else {
+            return;
+        }
     }
-    addToken(type);
 }
 
-void Scanner::string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') line++;
-        advance();
-    }
+TokenType Scanner::identifier() {
+    current += identifierRun(source + current, source + length);
+    return keywordType(source + start, current - start);
+}
+
+TokenType Scanner::string() {
+    current += findChar(source + current, source + length, '"', line);
 
     /* Do not accept multiple line string */
     if (isAtEnd()) {
         std::cerr << "Unterminated string" << std::endl;
-        return;
+        hadError = true;
+        return TokenType::TEOF;
     }
 
     advance(); // skip the last '"'
-    std::string value = source.substr(start+1, current-start-2);
-    addToken(TokenType::STRING, value);
+    return TokenType::STRING;
 }
 
 
-void Scanner::number() {
-    while(isdigit(peek()))  advance();
+TokenType Scanner::number() {
+    current += digitRun(source + current, source + length);
 
-    if (peek() == '.' && isdigit(peekNext())) {
+    if (peek() == '.' && isDigit(peekNext())) {
         advance();
-        while(isdigit(peek())) advance();
+        current += digitRun(source + current, source + length);
     }
-    std::string number = source.substr(start, current-start);
-    addToken(TokenType::NUMBER, number);
+    return TokenType::NUMBER;
 }
 
 
 bool Scanner::isAtEnd() const {
-    return current >= source.length();
+    return current >= length;
 }
 
 
@@ -159,18 +359,6 @@ inline char Scanner::peek() {
 
 
 inline char Scanner::peekNext() {
-    if (isAtEnd() || current + 1 >= source.length()) return '\0';
+    if (isAtEnd() || current + 1 >= length) return '\0';
     return source[current+1];
 }
-
-
-void Scanner::addToken(TokenType tokenType) {
-    std::string text = source.substr(start, current-start);
-    tokens.push_back(Token(tokenType, text, "", line));
-}
-
-
-void Scanner::addToken(TokenType tokenType, std::string literal) {
-    std::string text = source.substr(start, current-start);
-    tokens.push_back(Token(tokenType, text, literal, line));
-}
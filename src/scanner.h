@@ -3,16 +3,29 @@
 
 #include "token.h"
 
+#include <cstddef>
 #include <vector>
-#include <string>
-#include <map>
 
+/* Produces tokens that point into source rather than copying it, so source
+ * must stay alive as long as the tokens (and the AST built from them) do.
+ * The Parser pulls tokens one at a time with Next(), so no token array is
+ * ever materialised; ScanTokens() is there for tools that want them all.
+ */
 class Scanner {
 public:
     Scanner(const char *source);
+    /* line is the one source starts on, for scanning part of a file */
+    Scanner(const char *source, size_t length, int line = 1);
     ~Scanner();
+    /* Returns TEOF once the source is exhausted, and keeps returning it */
+    Token Next();
     std::vector<Token> ScanTokens();
 
+    /* Whether an unexpected character cut the source short */
+    bool HadError() const {
+        return hadError;
+    }
+
 private:
     inline char advance();
     inline bool match(char expected);
@@ -20,20 +33,19 @@ private:
     inline char peekNext();
 
     bool isAtEnd() const;
-    void addToken(TokenType tokenType);
-    void addToken(TokenType tokenType, std::string literal);
-    void scanToken();
-    void string();
-    void number();
-    void identifier();
+    void skipWhitespace();
+    TokenType scanToken();
+    TokenType string();
+    TokenType number();
+    TokenType identifier();
 
 private:
-    int start;
-    int current;
+    size_t start;
+    size_t current;
     int line;
-    std::string source;
-    std::vector<Token> tokens;
-    static std::map<std::string, TokenType> const keywords;
+    const char* source;
+    size_t length;
+    bool hadError = false;
 };
 
 #endif  // LOX_SCANNER_H
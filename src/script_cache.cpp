@@ -0,0 +1,589 @@
+#include "script_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#ifndef LOX_VERSION
+#define LOX_VERSION "unknown"
+#endif
+
+
+namespace {
+
+enum Tag: uint32_t {
+    NONE,
+    PRINT, EXPRESSION_STATEMENT, VAR, IF, RETURN, WHILE, BLOCK, FUNCTION,
+    BINARY, UNARY, GROUPING, NIL, FALSE, TRUE, NUMBER, STRING, VARIABLE, ASSIGNMENT, LOGICAL, CALL,
+};
+
+
+/* Flattens a tree into words, interning every piece of text once */
+class Writer: public Statement::Visitor, public Expression::Visitor {
+public:
+    std::vector<uint32_t> words;
+    std::vector<uint32_t> offsets { 0 };   // Of each string, plus the end of the last
+    std::string strings;
+
+    void Write(Span<Statement*> statements) {
+        for (Statement* stmt: statements) write(stmt);
+    }
+
+    void Visit(PrintStatement& stmt) override {
+        statement(PRINT, stmt);
+        write(stmt.expression);
+    }
+
+    void Visit(ExpressionStatement& stmt) override {
+        statement(EXPRESSION_STATEMENT, stmt);
+        write(stmt.expression);
+    }
+
+    void Visit(VarStatement& stmt) override {
+        statement(VAR, stmt);
+        write(stmt.token);
+        write(stmt.init);
+    }
+
+    void Visit(IfStatement& stmt) override {
+        statement(IF, stmt);
+        write(stmt.expression);
+        write(stmt.thenBranch);
+        write(stmt.elseBranch);
+    }
+
+    void Visit(ReturnStatement& stmt) override {
+        statement(RETURN, stmt);
+        write(stmt.keyword);
+        write(stmt.value);
+    }
+
+    void Visit(WhileStatement& stmt) override {
+        statement(WHILE, stmt);
+        write(stmt.expression);
+        write(stmt.statement);
+    }
+
+    void Visit(BlockStatement& stmt) override {
+        statement(BLOCK, stmt);
+        words.push_back(stmt.statements.size());
+        Write(stmt.statements);
+    }
+
+    void Visit(FunctionStatement& stmt) override {
+        statement(FUNCTION, stmt);
+        write(stmt.name);
+        words.push_back(stmt.params.size());
+        for (const Token& param: stmt.params) write(param);
+        words.push_back(stmt.stmts.size());
+        Write(stmt.stmts);
+    }
+
+    void Visit(BinaryExpression& expr) override {
+        words.push_back(BINARY);
+        write(expr.op);
+        write(expr.left);
+        write(expr.right);
+    }
+
+    void Visit(UnaryExpression& expr) override {
+        words.push_back(UNARY);
+        write(expr.op);
+        write(expr.expression);
+    }
+
+    void Visit(GroupingExpression& expr) override {
+        words.push_back(GROUPING);
+        write(expr.expression);
+    }
+
+    void Visit(LiteralExpression& expr) override {
+        const Value& value = expr.value;
+        if (value.IsNil()) {
+            words.push_back(NIL);
+        } else if (value.IsBool()) {
+            words.push_back(value.AsBool() ? TRUE : FALSE);
+        } else if (value.IsNumber()) {
+            double number = value.AsNumber();
+            uint32_t halves[2];
+            std::memcpy(halves, &number, sizeof(number));
+            words.insert(words.end(), { NUMBER, halves[0], halves[1] });
+        } else {
+            const ObjString* string = value.AsString();
+            words.push_back(STRING);
+            words.push_back(intern(string->Chars(), string->length));
+        }
+    }
+
+    void Visit(VariableExpression& expr) override {
+        words.push_back(VARIABLE);
+        write(expr.token);
+    }
+
+    void Visit(AssignmentExpression& expr) override {
+        words.push_back(ASSIGNMENT);
+        write(expr.name);
+        write(expr.value);
+    }
+
+    void Visit(LogicalExpression& expr) override {
+        words.push_back(LOGICAL);
+        write(expr.op);
+        write(expr.left);
+        write(expr.right);
+    }
+
+    void Visit(CallExpression& expr) override {
+        words.push_back(CALL);
+        write(expr.callee);
+        write(expr.paren);
+        words.push_back(expr.arguments.size());
+        for (Expression* argument: expr.arguments) write(argument);
+    }
+
+private:
+    void statement(Tag tag, const Statement& stmt) {
+        words.push_back(tag);
+        words.push_back(stmt.line);
+    }
+
+    void write(Statement* stmt) {
+        if (stmt == nullptr) {
+            words.push_back(NONE);
+        } else {
+            stmt->Accept(*this);
+        }
+    }
+
+    void write(Expression* expr) {
+        if (expr == nullptr) {
+            words.push_back(NONE);
+        } else {
+            expr->Accept(*this);
+        }
+    }
+
+    void write(const Token& token) {
+        words.push_back(static_cast<uint32_t>(token.type));
+        words.push_back(token.line);
+        words.push_back(intern(token.start, token.length));
+    }
+
+    uint32_t intern(const char* chars, size_t length) {
+        auto found = indices.emplace(std::string(chars, length), offsets.size() - 1);
+        if (found.second) {
+            strings.append(chars, length);
+            offsets.push_back(strings.size());
+        }
+        return found.first->second;
+    }
+
+    std::unordered_map<std::string, uint32_t> indices;
+};
+
+
+/* Rebuilds a tree from words. Every read is checked, so a damaged entry
+ * makes failed true rather than reading out of bounds. */
+class Reader {
+public:
+    Reader(const uint32_t* words, size_t wordCount, const uint32_t* offsets, uint32_t stringCount,
+           const char* strings, Heap& heap, Arena& arena)
+        : word(words), end(words + wordCount), offsets(offsets), stringCount(stringCount),
+          strings(strings), heap(heap), arena(arena), literals(stringCount) {}
+
+    bool failed = false;
+
+    Span<Statement*> Statements(uint32_t count) {
+        size_t base = statementStack.size();
+        for (uint32_t i = 0; i < count && !failed; i++) statementStack.push_back(statement());
+        auto first = statementStack.begin() + base;
+        auto stmts = arena.NewArray<Statement*>(first, statementStack.end());
+        statementStack.erase(first, statementStack.end());
+        return stmts;
+    }
+
+    bool AtEnd() const {
+        return word == end;
+    }
+
+private:
+    uint32_t next() {
+        if (word == end) {
+            failed = true;
+            return NONE;
+        }
+        return *word++;
+    }
+
+    /* Count of a span, which needs at least one word per element */
+    uint32_t count() {
+        uint32_t n = next();
+        if (n > static_cast<size_t>(end - word)) {
+            failed = true;
+            return 0;
+        }
+        return n;
+    }
+
+    uint32_t string() {
+        uint32_t index = next();
+        if (index >= stringCount) {
+            failed = true;
+            return 0;
+        }
+        return index;
+    }
+
+    Token token() {
+        TokenType type = static_cast<TokenType>(next());
+        int line = next();
+        uint32_t index = string();
+        if (failed) return Token(type, strings, 0, line);
+        return Token(type, strings + offsets[index], offsets[index + 1] - offsets[index], line);
+    }
+
+    Statement* statement() {
+        uint32_t tag = next();
+        if (tag == NONE) return nullptr;
+        int line = next();
+        Statement* stmt = nullptr;
+        switch (tag) {
+        case PRINT:
+            stmt = arena.New<PrintStatement>(expression());
+            break;
+        case EXPRESSION_STATEMENT:
+            stmt = arena.New<ExpressionStatement>(expression());
+            break;
+        case VAR: {
+            Token name = token();
+            stmt = arena.New<VarStatement>(name, expression());
+            break;
+        }
+        case IF: {
+            Expression* condition = expression();
+            Statement* thenBranch = statement();
+            stmt = arena.New<IfStatement>(condition, thenBranch, statement());
+            break;
+        }
+        case RETURN: {
+            Token keyword = token();
+            ReturnStatement* ret = arena.New<ReturnStatement>(keyword, expression());
+            ret->tailCall = dynamic_cast<CallExpression*>(ret->value);
+            stmt = ret;
+            break;
+        }
+        case WHILE: {
+            Expression* condition = expression();
+            stmt = arena.New<WhileStatement>(condition, statement());
+            break;
+        }
+        case BLOCK:
+            stmt = arena.New<BlockStatement>(Statements(count()));
+            break;
+        case FUNCTION: {
+            Token name = token();
+            size_t base = parameterStack.size();
+            for (uint32_t i = count(); i > 0 && !failed; i--) parameterStack.push_back(token());
+            auto first = parameterStack.begin() + base;
+            Span<Token> parameters = arena.NewArray<Token>(first, parameterStack.end());
+            parameterStack.erase(first, parameterStack.end());
+            stmt = arena.New<FunctionStatement>(name, parameters, Statements(count()));
+            break;
+        }
+        default:
+            failed = true;
+            return nullptr;
+        }
+        stmt->line = line;
+        return stmt;
+    }
+
+    Expression* expression() {
+        switch (next()) {
+        case NONE:
+            return nullptr;
+        case BINARY: {
+            Token op = token();
+            Expression* left = expression();
+            return arena.New<BinaryExpression>(op, left, expression());
+        }
+        case UNARY: {
+            Token op = token();
+            return arena.New<UnaryExpression>(op, expression());
+        }
+        case GROUPING:
+            return arena.New<GroupingExpression>(expression());
+        case NIL:
+            return arena.New<LiteralExpression>(Value());
+        case FALSE:
+            return arena.New<LiteralExpression>(false);
+        case TRUE:
+            return arena.New<LiteralExpression>(true);
+        case NUMBER: {
+            uint32_t halves[2] = { next(), next() };
+            double number;
+            std::memcpy(&number, halves, sizeof(number));
+            return arena.New<LiteralExpression>(number);
+        }
+        case STRING: {
+            uint32_t index = string();
+            if (failed) return nullptr;
+            ObjString*& string = literals[index];
+            if (string == nullptr) {
+                string = heap.MakeString(strings + offsets[index], offsets[index + 1] - offsets[index]);
+            }
+            return arena.New<LiteralExpression>(Value(string));
+        }
+        case VARIABLE:
+            return arena.New<VariableExpression>(token());
+        case ASSIGNMENT: {
+            Token name = token();
+            return arena.New<AssignmentExpression>(name, expression());
+        }
+        case LOGICAL: {
+            Token op = token();
+            Expression* left = expression();
+            return arena.New<LogicalExpression>(left, op, expression());
+        }
+        case CALL: {
+            Expression* callee = expression();
+            Token paren = token();
+            size_t base = expressionStack.size();
+            for (uint32_t i = count(); i > 0 && !failed; i--) expressionStack.push_back(expression());
+            auto first = expressionStack.begin() + base;
+            auto arguments = arena.NewArray<Expression*>(first, expressionStack.end());
+            expressionStack.erase(first, expressionStack.end());
+            return arena.New<CallExpression>(callee, paren, arguments);
+        }
+        default:
+            failed = true;
+            return nullptr;
+        }
+    }
+
+    const uint32_t* word;
+    const uint32_t* end;
+    const uint32_t* offsets;
+    uint32_t stringCount;
+    const char* strings;
+    Heap& heap;
+    Arena& arena;
+    std::vector<ObjString*> literals;   // Made for each string index so far, the heap is pinned
+    std::vector<Statement*> statementStack;
+    std::vector<Expression*> expressionStack;
+    std::vector<Token> parameterStack;
+};
+
+
+/* A whole file mapped read-only */
+class Mapping {
+public:
+    explicit Mapping(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* address = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                data = static_cast<const char*>(address);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    ~Mapping() {
+        if (data != nullptr) munmap(const_cast<char*>(data), size);
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+size_t align4(size_t size) {
+    return (size + 3) & ~size_t(3);
+}
+
+}
+
+
+constexpr uint64_t ScriptCache::DEFAULT_MAX_BYTES;
+
+ScriptCache::ScriptCache(const std::string& directory, uint64_t maxBytes)
+    : directory(directory), maxBytes(maxBytes) {
+}
+
+std::string ScriptCache::DefaultDirectory() {
+    if (const char* dir = std::getenv("LOX_CACHE_DIR")) return dir;
+    if (const char* dir = std::getenv("XDG_CACHE_HOME")) return std::string(dir) + "/lox";
+    if (const char* home = std::getenv("HOME")) return std::string(home) + "/.cache/lox";
+    return ".lox-cache";
+}
+
+uint64_t ScriptCache::hash(const char* data, size_t length, uint64_t hash) {
+    /* FNV-1a over 8 bytes at a time, with the high bits folded back in so
+     * they reach every bit of the next step; a byte at a time would take
+     * longer than loading the entry */
+    auto mix = [&hash](uint64_t word) {
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 29;
+    };
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, length - i);
+    mix(tail ^ (uint64_t(length) << 56));
+    return hash;
+}
+
+uint64_t ScriptCache::checksum(const Header& header, const char* payload, size_t length) {
+    uint64_t sum = hash(reinterpret_cast<const char*>(&header), offsetof(Header, checksum));
+    return hash(payload, length, sum);
+}
+
+uint64_t ScriptCache::interpreter() {
+    uint64_t id = hash(LOX_VERSION, std::strlen(LOX_VERSION));
+    struct stat st;
+    if (stat("/proc/self/exe", &st) == 0) {
+        int64_t identity[] = { static_cast<int64_t>(st.st_size), static_cast<int64_t>(st.st_mtime) };
+        id = hash(reinterpret_cast<const char*>(identity), sizeof(identity), id);
+    }
+    return id;
+}
+
+std::string ScriptCache::PathFor(const char* source, size_t length) const {
+    return fmt::format("{}/{:016x}.loxc", directory, hash(source, length));
+}
+
+bool ScriptCache::Load(const char* source, size_t length, Heap& heap, Arena& arena, Span<Statement*>& statements) {
+    Mapping file(PathFor(source, length));
+    if (file.size < sizeof(Header)) return false;
+
+    Header header;
+    std::memcpy(&header, file.data, sizeof(header));
+    if (std::memcmp(header.magic, "LOXC", 4) != 0 || header.format != FORMAT_VERSION ||
+        header.interpreter != interpreter() || header.sourceLength != length ||
+        header.sourceHash != hash(source, length)) {
+        return false;
+    }
+
+    size_t offsetsAt = sizeof(Header);
+    size_t stringsAt = offsetsAt + (size_t(header.stringCount) + 1) * sizeof(uint32_t);
+    size_t wordsAt = stringsAt + align4(header.stringBytes);
+    if (wordsAt + size_t(header.wordCount) * sizeof(uint32_t) != file.size) return false;
+    /* A damaged tree can still be well formed, and run differently or not
+     * finish at all */
+    if (header.checksum != checksum(header, file.data + sizeof(Header), file.size - sizeof(Header))) return false;
+
+    const uint32_t* offsets = reinterpret_cast<const uint32_t*>(file.data + offsetsAt);
+    for (uint32_t i = 0; i < header.stringCount; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.stringBytes) return false;
+    }
+
+    /* Tokens point into the text, which must outlive the mapping */
+    Span<char> strings = arena.NewArray<char>(file.data + stringsAt, file.data + stringsAt + header.stringBytes);
+    Reader reader(reinterpret_cast<const uint32_t*>(file.data + wordsAt), header.wordCount,
+                  offsets, header.stringCount, strings.begin(), heap, arena);
+    Span<Statement*> stmts = reader.Statements(header.statementCount);
+    if (reader.failed || !reader.AtEnd()) return false;
+    statements = stmts;
+    /* The time of the last use, which evict() goes by */
+    utimensat(AT_FDCWD, PathFor(source, length).c_str(), nullptr, 0);
+    return true;
+}
+
+bool ScriptCache::Store(const char* source, size_t length, Span<Statement*> statements) {
+    Writer writer;
+    writer.Write(statements);
+
+    Header header;
+    std::memcpy(header.magic, "LOXC", 4);
+    header.format = FORMAT_VERSION;
+    header.interpreter = interpreter();
+    header.sourceHash = hash(source, length);
+    header.sourceLength = length;
+    header.stringCount = writer.offsets.size() - 1;
+    header.stringBytes = writer.strings.size();
+    header.wordCount = writer.words.size();
+    header.statementCount = statements.size();
+    header.checksum = 0;
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(writer.offsets.data()), writer.offsets.size() * sizeof(uint32_t));
+    data.append(writer.strings);
+    data.resize(align4(data.size()), '\0');
+    data.append(reinterpret_cast<const char*>(writer.words.data()), writer.words.size() * sizeof(uint32_t));
+    header.checksum = checksum(header, data.data() + sizeof(header), data.size() - sizeof(header));
+    std::memcpy(&data[0], &header, sizeof(header));
+
+    /* Every missing directory on the way, then a complete file renamed into
+     * place, so a concurrent Load() never sees half an entry */
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1)) {
+        std::string prefix = directory.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        if (slash == std::string::npos) break;
+    }
+    std::string path = PathFor(source, length);
+    std::string temporary = fmt::format("{}.{}.tmp", path, getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    evict(path);
+    return true;
+}
+
+void ScriptCache::evict(const std::string& keep) {
+    struct Entry {
+        std::string path;
+        struct timespec used;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) return;
+    while (struct dirent* entry = readdir(dir)) {
+        size_t length = std::strlen(entry->d_name);
+        if (length < 5 || std::strcmp(entry->d_name + length - 5, ".loxc") != 0) continue;
+        std::string path = directory + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        entries.push_back(Entry { path, st.st_mtim, static_cast<uint64_t>(st.st_size) });
+        total += st.st_size;
+    }
+    closedir(dir);
+    if (total <= maxBytes) return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for (auto& entry: entries) {
+        if (total <= maxBytes) break;
+        if (entry.path != keep && unlink(entry.path.c_str()) == 0) total -= entry.size;
+    }
+}
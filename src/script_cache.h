@@ -0,0 +1,83 @@
+#ifndef LOX_SCRIPT_CACHE_H
+#define LOX_SCRIPT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "arena.h"
+#include "ast.h"
+#include "heap.h"
+
+
+/* Parsed programs saved on disk, so a script that has not changed since it
+ * last ran skips the Scanner and Parser. Entries are named after a hash of
+ * the source, and hold the tree as the Parser made it, before the Optimizer
+ * or Resolver saw it:
+ *
+ *   header        magic, format, interpreter identity, source hash and length
+ *   string table  offsets, then the text of every lexeme and string literal
+ *   nodes         the tree in pre-order as 32-bit words; tokens and
+ *                 statements carry their lines
+ *
+ * An entry is only used if the format, the interpreter that wrote it (its
+ * version, and the size and time of its executable where known), the
+ * source and the checksum of the entry all match; anything else is a miss
+ * and is overwritten. Entries are written in the machine's byte order and
+ * mapped in place when read.
+ *
+ * Each Store() evicts the least recently used entries once the directory
+ * holds more than its limit; a Load() that hits counts as a use.
+ */
+class ScriptCache {
+public:
+    static constexpr uint32_t FORMAT_VERSION = 2;
+    static constexpr uint64_t DEFAULT_MAX_BYTES = 64 << 20;
+
+    /* Entries live in directory, which is created on the first Store(), and
+     * take up to about maxBytes there */
+    explicit ScriptCache(const std::string& directory, uint64_t maxBytes = DEFAULT_MAX_BYTES);
+
+    /* $LOX_CACHE_DIR, else $XDG_CACHE_HOME/lox, else $HOME/.cache/lox */
+    static std::string DefaultDirectory();
+
+    /* Rebuilds the program cached for source in arena, with its string
+     * literals in heap, which must be pinned; false on a miss */
+    bool Load(const char* source, size_t length, Heap& heap, Arena& arena, Span<Statement*>& statements);
+
+    /* Saves statements, just parsed from source; false if it could not be
+     * written */
+    bool Store(const char* source, size_t length, Span<Statement*> statements);
+
+    /* Entry for source, whether or not it exists */
+    std::string PathFor(const char* source, size_t length) const;
+
+private:
+    struct Header {
+        char magic[4];
+        uint32_t format;
+        uint64_t interpreter;
+        uint64_t sourceHash;
+        uint64_t sourceLength;
+        uint32_t stringCount;
+        uint32_t stringBytes;
+        uint32_t wordCount;
+        uint32_t statementCount;
+        uint64_t checksum;   // Of the fields above and everything after the header
+    };
+
+    static uint64_t checksum(const Header& header, const char* payload, size_t length);
+
+    static uint64_t hash(const char* data, size_t length, uint64_t hash = 14695981039346656037ull);
+
+    /* Identifies the running interpreter, see above */
+    static uint64_t interpreter();
+
+    /* Removes the least recently used entries but keep until the rest fit */
+    void evict(const std::string& keep);
+
+    std::string directory;
+    uint64_t maxBytes;
+};
+
+#endif
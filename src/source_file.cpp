@@ -0,0 +1,73 @@
+#include "source_file.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+SourceFile::~SourceFile() {
+    if (mapping != nullptr) {
+        munmap(mapping, length);
+    }
+}
+
+bool SourceFile::Load(const char* path) {
+    if (std::strcmp(path, "-") == 0) {
+        return read(STDIN_FILENO);
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        std::perror("Failed to open file");
+        return false;
+    }
+
+    struct stat st;
+    bool ok;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ok = map(fd, st.st_size) || read(fd);
+    } else {
+        ok = read(fd);
+    }
+    close(fd);
+    return ok;
+}
+
+bool SourceFile::map(int fd, size_t size) {
+    /* mmap refuses empty mappings; an empty script is simply empty */
+    if (size == 0) return true;
+
+    void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) return false;
+    madvise(address, size, MADV_SEQUENTIAL);
+
+    mapping = address;
+    data = static_cast<const char*>(address);
+    length = size;
+    return true;
+}
+
+bool SourceFile::read(int fd) {
+    constexpr size_t CHUNK = 64 * 1024;
+    size_t used = 0;
+    while (true) {
+        buffer.resize(used + CHUNK);
+        ssize_t n = ::read(fd, buffer.data() + used, CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::perror("Failed to read data from file");
+            return false;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    buffer.resize(used);
+    data = buffer.data();
+    length = used;
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef LOX_SOURCE_FILE_H
+#define LOX_SOURCE_FILE_H
+
+#include <cstddef>
+#include <vector>
+
+
+/* Text of a script file. Regular files are memory-mapped, so pages are
+ * only read in as the scanner reaches them; pipes, character devices and
+ * stdin ("-") are read in chunks instead. The text is not NUL-terminated:
+ * use Length(). It stays valid until the SourceFile is destroyed.
+ */
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile();
+
+    /* Returns false and reports the reason on stderr on failure */
+    bool Load(const char* path);
+
+    const char* Data() const {
+        return data;
+    }
+
+    size_t Length() const {
+        return length;
+    }
+
+private:
+    bool map(int fd, size_t size);
+
+    bool read(int fd);
+
+    const char* data = nullptr;
+    size_t length = 0;
+    void* mapping = nullptr;
+    std::vector<char> buffer;
+};
+
+#endif
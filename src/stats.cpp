@@ -0,0 +1,38 @@
+#include "stats.h"
+
+#include <cstdlib>
+#include <new>
+
+
+Counters Counters::global;
+
+#ifdef LOX_STATS
+
+bool Counters::Enabled() {
+    return true;
+}
+
+/* Every allocation made with new, whichever library makes it */
+void* operator new(std::size_t size) {
+    Counters::global.allocations++;
+    Counters::global.allocatedBytes += size;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+#else
+
+bool Counters::Enabled() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LOX_STATS_H
+#define LOX_STATS_H
+
+#include <cstdint>
+
+
+/* Counters on the engines' hot paths, for --stats. They are only kept
+ * in builds with LOX_STATS defined (cmake -DLOX_STATS=ON); elsewhere
+ * LOX_COUNT compiles to nothing, and --stats reports phase times, token
+ * and node counts and the heaps' own figures.
+ */
+class Counters {
+public:
+    uint64_t calls = 0;            // Including tail calls
+    uint64_t frames = 0;           // Call frames pushed; a tail call reuses its caller's
+    uint64_t localLookups = 0;     // Straight from the frame
+    uint64_t upvalueLookups = 0;   // Through one Upvalue
+    uint64_t globalLookups = 0;    // Through one Environment slot
+    uint64_t valueCopies = 0;      // Copies the compiler did not elide
+    uint64_t allocations = 0;      // By operator new
+    uint64_t allocatedBytes = 0;
+
+    static bool Enabled();
+
+    static Counters global;
+};
+
+#ifdef LOX_STATS
+#define LOX_COUNT(counter) (Counters::global.counter++)
+#else
+#define LOX_COUNT(counter) ((void)0)
+#endif
+
+#endif
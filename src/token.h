@@ -1,19 +1,40 @@
 #ifndef LOX_TOKEN_H
 #define LOX_TOKEN_H
 
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
 #include "token_type.h"
 
+/* Tokens do not own their text: start points into the source buffer the
+ * Scanner was given, which must outlive every token and AST node that
+ * refers to it. A Token is a plain value and copies are free.
+ */
 class Token {
 public:
-    Token(TokenType type, std::string lexeme, std::string literal, int line);
-    ~Token();
+    Token() = default;
+    Token(TokenType type, const char* start, uint32_t length, int line)
+        : type(type), line(line), length(length), start(start) {
+    }
+
+    std::string Lexeme() const {
+        return std::string(start, length);
+    }
+
+    bool SameLexeme(const Token& other) const {
+        return length == other.length && std::char_traits<char>::compare(start, other.start, length) == 0;
+    }
+
     friend std::ostream &operator<<(std::ostream &os, const Token &token);
 
     TokenType type;
-    std::string lexeme;
-    std::string literal;
     int line;
+    uint32_t length;
+    const char* start;
 };
 
+static_assert(std::is_trivially_copyable<Token>::value &&
+              std::is_trivially_destructible<Token>::value, "Token must stay a plain value");
 
 #endif // LOX_TOKEN_H
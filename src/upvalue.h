@@ -0,0 +1,72 @@
+#ifndef LOX_UPVALUE_H
+#define LOX_UPVALUE_H
+
+#include <vector>
+
+#include "heap.h"
+#include "object.h"
+#include "value.h"
+
+
+/* A variable captured by a closure. While the declaring frame is live the
+ * upvalue points into the stack it lives on; once the frame exits it is
+ * closed and the value moves into the upvalue itself.
+ */
+class Upvalue: public Obj {
+public:
+    Upvalue(Value* slot): Obj(ObjType::UPVALUE), location(slot) {}
+
+    void Trace(Heap& heap) override {
+        heap.Mark(closed);
+    }
+
+    Value* location;
+    Value closed;
+};
+
+
+/* Upvalues that still point into a stack, ordered by slot, innermost last.
+ * Shared by the Interpreter and the VM, which both keep locals in a flat
+ * stack of Values.
+ */
+class OpenUpvalues {
+public:
+    OpenUpvalues(Heap& heap): heap(heap) {}
+
+    /* The open upvalue for local, created if no closure captured it yet */
+    Upvalue* Capture(Value* local) {
+        for (auto it = upvalues.rbegin(); it != upvalues.rend(); ++it) {
+            if ((*it)->location == local) return *it;
+            if ((*it)->location < local) break;
+        }
+
+        auto upvalue = heap.Allocate<Upvalue>(local);
+        auto it = upvalues.end();
+        while (it != upvalues.begin() && (*(it - 1))->location > local) --it;
+        upvalues.insert(it, upvalue);
+        return upvalue;
+    }
+
+    /* Closes every upvalue pointing at last or above */
+    void Close(Value* last) {
+        while (!upvalues.empty() && upvalues.back()->location >= last) {
+            Upvalue* upvalue = upvalues.back();
+            upvalue->closed = *upvalue->location;
+            upvalue->location = &upvalue->closed;
+            upvalues.pop_back();
+        }
+    }
+
+    /* A frame may still write through an upvalue nothing else refers to */
+    void Mark() {
+        for (Upvalue* upvalue: upvalues) {
+            heap.Mark(upvalue);
+        }
+    }
+
+private:
+    Heap& heap;
+    std::vector<Upvalue*> upvalues;
+};
+
+#endif
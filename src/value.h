@@ -1,72 +1,139 @@
 #ifndef LOX_VALUE_H
 #define LOX_VALUE_H
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
-#include <memory>
-#include <map>
 
-class LoxCallable;
+#include "object.h"
+#include "stats.h"
 
+
+/* NaN-boxed value: 8 bytes, trivially copyable except in LOX_STATS builds,
+ * which count copies.
+ * Any double that is not one of our quiet NaNs is stored as is. nil and the
+ * booleans are quiet NaNs with a small tag in the low bits, and heap objects
+ * are quiet NaNs with the sign bit set and the Obj* in the low 48 bits.
+ */
 class Value {
 public:
-    enum class ValueType { FUNCTION, NUMBER, BOOL, STRING, NUL } value_type;
-    const char* value_type_string() const {
-        const std::map<ValueType, const char*> value_type_enum {
-            { ValueType::FUNCTION, "Function" },
-            { ValueType::NUMBER, "Number" },
-            { ValueType::BOOL, "Boolean" },
-            { ValueType::STRING, "String" },
-            { ValueType::NUL, "Null" },
-        };
-        auto it  = value_type_enum.find(value_type);
-        return it == value_type_enum.end() ? "Unknown type" : it->second;
-    };
-
-    Value();
-    Value(double number);
-    Value(bool logic_value);
-    Value(std::string text);
-    Value(std::shared_ptr<LoxCallable> func);
-
-    // TODO(telescreen): Add Type Checking
-    operator double() const;
-    operator bool() const;
-    operator std::string() const;
-    operator std::shared_ptr<LoxCallable>() const;
-
-    friend Value operator+(const Value& lhs, const Value& rhs);
-
-    friend Value operator-(const Value& lhs, const Value& rhs);
-
-    friend Value operator-(const Value& rhs);
-
-    friend Value operator*(const Value& lhs, const Value& rhs);
-
-    friend Value operator/(const Value& lhs, const Value& rhs);
-
-    friend Value operator>(const Value& lhs, const Value& rhs);
-
-    friend Value operator>=(const Value& lhs, const Value& rhs);
-
-    friend Value operator<(const Value& lhs, const Value& rhs);
-
-    friend Value operator<=(const Value& lhs, const Value& rhs);
-
-    friend Value operator==(const Value& lhs, const Value& rhs);
+    enum class ValueType { FUNCTION, NUMBER, BOOL, STRING, NUL };
+
+    Value(): bits(QNAN | TAG_NIL) {}
+    Value(double number) { std::memcpy(&bits, &number, sizeof(double)); }
+    Value(bool logic_value): bits(logic_value ? TRUE_VALUE : FALSE_VALUE) {}
+    Value(Obj* object): bits(SIGN_BIT | QNAN | reinterpret_cast<uint64_t>(object)) {}
+
+#ifdef LOX_STATS
+    Value(const Value& other): bits(other.bits) {
+        LOX_COUNT(valueCopies);
+    }
+
+    Value& operator=(const Value& other) {
+        bits = other.bits;
+        LOX_COUNT(valueCopies);
+        return *this;
+    }
+#endif
 
-    friend Value operator!=(const Value& lhs, const Value& rhs);
+    ValueType Type() const {
+        if (IsNumber()) return ValueType::NUMBER;
+        if (IsNil()) return ValueType::NUL;
+        if (IsBool()) return ValueType::BOOL;
+        return AsObj()->type == ObjType::STRING ? ValueType::STRING : ValueType::FUNCTION;
+    }
+
+    const char* TypeName() const {
+        switch (Type()) {
+        case ValueType::FUNCTION: return "Function";
+        case ValueType::NUMBER: return "Number";
+        case ValueType::BOOL: return "Boolean";
+        case ValueType::STRING: return "String";
+        case ValueType::NUL: return "Null";
+        }
+        return "Unknown type";
+    }
+
+    bool IsNumber() const { return (bits & QNAN) != QNAN; }
+    bool IsNil() const { return bits == (QNAN | TAG_NIL); }
+    bool IsBool() const { return (bits | 1) == TRUE_VALUE; }
+    bool IsObj() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+    bool IsString() const { return IsObj() && AsObj()->type == ObjType::STRING; }
+    bool IsCallable() const { return IsObj() && AsObj()->type != ObjType::STRING; }
+
+    double AsNumber() const {
+        double number;
+        std::memcpy(&number, &bits, sizeof(double));
+        return number;
+    }
+    bool AsBool() const { return bits == TRUE_VALUE; }
+    Obj* AsObj() const { return reinterpret_cast<Obj*>(bits & ~(SIGN_BIT | QNAN)); }
+    ObjString* AsString() const { return static_cast<ObjString*>(AsObj()); }
+    LoxCallable* AsCallable() const { return static_cast<LoxCallable*>(AsObj()); }
+
+    uint64_t Bits() const { return bits; }
+
+    /* Truthiness: nil, false, empty strings and numbers <= 0 are falsy */
+    explicit operator bool() const {
+        if (IsBool()) return AsBool();
+        if (IsNumber()) return AsNumber() > 0;
+        if (IsNil()) return false;
+        if (IsString()) return AsString()->length > 0;
+        return true;
+    }
+
+    /* Arithmetic is only defined on numbers; callers check operand types */
+    friend Value operator-(const Value& lhs, const Value& rhs) {
+        return Value(lhs.AsNumber() - rhs.AsNumber());
+    }
+
+    friend Value operator-(const Value& rhs) {
+        return Value(-rhs.AsNumber());
+    }
+
+    friend Value operator*(const Value& lhs, const Value& rhs) {
+        return Value(lhs.AsNumber() * rhs.AsNumber());
+    }
+
+    friend Value operator/(const Value& lhs, const Value& rhs) {
+        return Value(lhs.AsNumber() / rhs.AsNumber());
+    }
+
+    friend bool operator==(const Value& lhs, const Value& rhs);
+
+    friend bool operator!=(const Value& lhs, const Value& rhs) {
+        return !(lhs == rhs);
+    }
 
     friend std::ostream& operator<<(std::ostream &os, const Value& value);
 
+    /* Ordering of two numbers, two strings or two booleans */
+    static bool Comparable(const Value& lhs, const Value& rhs) {
+        ValueType type = lhs.Type();
+        return type == rhs.Type() &&
+            (type == ValueType::NUMBER || type == ValueType::STRING || type == ValueType::BOOL);
+    }
+
     template<typename Comparator>
-    friend bool compare(const Value& lhs, const Value& rhs, Comparator comparator);
+    friend bool compare(const Value& lhs, const Value& rhs, Comparator comparator) {
+        if (lhs.IsNumber()) return comparator(lhs.AsNumber(), rhs.AsNumber());
+        if (lhs.IsBool()) return comparator(lhs.AsBool(), rhs.AsBool());
+        return comparator(lhs.AsString()->Compare(*rhs.AsString()), 0);
+    }
 
 private:
-    std::shared_ptr<LoxCallable> func;
-    double number;
-    bool logic_value;
-    std::string text;
+    friend class Jit;   // Emits the same tests on bits
+
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000;
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t FALSE_VALUE = QNAN | 2;
+    static constexpr uint64_t TRUE_VALUE = QNAN | 3;
+
+    uint64_t bits;
 };
 
+static_assert(sizeof(Value) == sizeof(uint64_t), "Value must stay a single machine word");
+
 #endif
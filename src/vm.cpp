@@ -0,0 +1,375 @@
+#include <algorithm>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "lox.hpp"
+
+
+Value Closure::Call(Interpreter&, Span<Value>) {
+    throw TypeError("Bytecode closures can only be called by the VM");
+}
+
+int Closure::Arity() {
+    return function->arity;
+}
+
+/* Constants need no tracing: the front end pins them */
+void Closure::Trace(Heap& heap) {
+    for (Upvalue* upvalue: upvalues) {
+        heap.Mark(upvalue);
+    }
+}
+
+
+VM::VM(Heap& heap): heap(heap), stack(STACK_MAX), openUpvalues(heap) {
+    stackTop = stack.data();
+    frames.reserve(FRAMES_MAX);
+    heap.AddRoots(this);
+    defineNative("clock", heap.Allocate<Clock>());
+}
+
+VM::~VM() {
+    heap.RemoveRoots(this);
+}
+
+void VM::Interpret(std::shared_ptr<Function> script) {
+    auto closure = heap.Allocate<Closure>(script);
+    try {
+        push(Value(closure));
+        call(peek(0), 0);
+        if (!frames.empty()) run(0);
+        pop();
+    } catch(RuntimeError& e) {
+        openUpvalues.Close(stack.data());
+        frames.clear();
+        stackTop = stack.data();
+    }
+}
+
+bool VM::EnableJit() {
+    if (!Jit::Supported()) return false;
+    jit.reset(new Jit());
+    return true;
+}
+
+void VM::run(size_t base) {
+    CallFrame* frame = &frames.back();
+    const uint8_t* ip = frame->ip;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_SHORT()])
+#define SAVE_IP() (frame->ip = ip)
+#define NUMBER_OPERANDS(message)                                        \
+    do {                                                                \
+        if (!peek(0).IsNumber() || !peek(1).IsNumber()) {               \
+            SAVE_IP();                                                  \
+            runtimeError(message);                                      \
+        }                                                               \
+    } while (false)
+#define BINARY_OP(op)                                                   \
+    do {                                                                \
+        Value b = pop();                                                \
+        Value a = pop();                                                \
+        push(Value(a op b));                                            \
+    } while (false)
+#define COMPARE_OP(comparator)                                          \
+    do {                                                                \
+        if (!Value::Comparable(peek(1), peek(0))) {                     \
+            SAVE_IP();                                                  \
+            runtimeError("Operands must be two numbers or two strings"); \
+        }                                                               \
+        Value b = pop();                                                \
+        Value a = pop();                                                \
+        push(Value(compare(a, b, comparator)));                         \
+    } while (false)
+#define RUN_COMPILED()                                                  \
+    do {                                                                \
+        if (jit) {                                                      \
+            SAVE_IP();                                                  \
+            if (jit->Run(*this, *frame) && frames.size() == base) {     \
+                return;                                                 \
+            }                                                           \
+            frame = &frames.back();                                     \
+            ip = frame->ip;                                             \
+        }                                                               \
+    } while (false)
+
+    while (true) {
+        switch (static_cast<OpCode>(READ_BYTE())) {
+        case OpCode::CONSTANT:
+            push(READ_CONSTANT());
+            break;
+        case OpCode::NIL:
+            push(Value());
+            break;
+        case OpCode::TRUE:
+            push(Value(true));
+            break;
+        case OpCode::FALSE:
+            push(Value(false));
+            break;
+        case OpCode::POP:
+            pop();
+            break;
+        case OpCode::GET_LOCAL:
+            LOX_COUNT(localLookups);
+            push(frame->slots[READ_BYTE()]);
+            break;
+        case OpCode::SET_LOCAL:
+            LOX_COUNT(localLookups);
+            frame->slots[READ_BYTE()] = peek(0);
+            break;
+        case OpCode::GET_GLOBAL: {
+            LOX_COUNT(globalLookups);
+            ObjString* name = READ_CONSTANT().AsString();
+            auto it = globals.find(name);
+            if (it == globals.end()) {
+                SAVE_IP();
+                runtimeError("Variable undefined at Environment::Get");
+            }
+            push(it->second);
+            break;
+        }
+        case OpCode::DEFINE_GLOBAL: {
+            ObjString* name = READ_CONSTANT().AsString();
+            globals[name] = pop();
+            break;
+        }
+        case OpCode::SET_GLOBAL: {
+            LOX_COUNT(globalLookups);
+            ObjString* name = READ_CONSTANT().AsString();
+            auto it = globals.find(name);
+            if (it == globals.end()) {
+                SAVE_IP();
+                runtimeError("Variable undefined at Environment::Assign");
+            }
+            it->second = peek(0);
+            break;
+        }
+        case OpCode::GET_UPVALUE:
+            LOX_COUNT(upvalueLookups);
+            push(*frame->closure->upvalues[READ_BYTE()]->location);
+            break;
+        case OpCode::SET_UPVALUE:
+            LOX_COUNT(upvalueLookups);
+            *frame->closure->upvalues[READ_BYTE()]->location = peek(0);
+            break;
+        case OpCode::EQUAL:         BINARY_OP(==); break;
+        case OpCode::NOT_EQUAL:     BINARY_OP(!=); break;
+        case OpCode::GREATER:       COMPARE_OP(std::greater<>()); break;
+        case OpCode::GREATER_EQUAL: COMPARE_OP(std::greater_equal<>()); break;
+        case OpCode::LESS:          COMPARE_OP(std::less<>()); break;
+        case OpCode::LESS_EQUAL:    COMPARE_OP(std::less_equal<>()); break;
+        case OpCode::ADD: {
+            Value b = peek(0);
+            Value a = peek(1);
+            if (a.IsNumber() && b.IsNumber()) {
+                stackTop -= 2;
+                push(Value(a.AsNumber() + b.AsNumber()));
+            } else if (a.IsString() && b.IsString()) {
+                /* The operands stay on the stack in case concatenating collects */
+                Value result(heap.Concatenate(a.AsString(), b.AsString()));
+                stackTop -= 2;
+                push(result);
+            } else {
+                SAVE_IP();
+                runtimeError("Operands must be two numbers or two strings");
+            }
+            break;
+        }
+        case OpCode::SUBTRACT:
+            NUMBER_OPERANDS("Operand must be a number");
+            BINARY_OP(-);
+            break;
+        case OpCode::MULTIPLY:
+            NUMBER_OPERANDS("Operand must be a number");
+            BINARY_OP(*);
+            break;
+        case OpCode::DIVIDE:
+            NUMBER_OPERANDS("Operand must be a number");
+            BINARY_OP(/);
+            break;
+        case OpCode::NEGATE:
+            if (!peek(0).IsNumber()) {
+                SAVE_IP();
+                runtimeError("Operand must be a number");
+            }
+            push(-pop());
+            break;
+        case OpCode::POSITIVE:
+            if (!peek(0).IsNumber()) {
+                SAVE_IP();
+                runtimeError("Operand must be a number");
+            }
+            break;
+        case OpCode::NOT:
+            SAVE_IP();
+            runtimeError(!peek(0).IsNumber() ?
+                         "Operand must be a number" : "Unknown Unary Operand");
+        case OpCode::PRINT:
+            fmt::print("{}\n", pop());
+            break;
+        case OpCode::JUMP: {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            break;
+        }
+        case OpCode::JUMP_IF_FALSE: {
+            uint16_t offset = READ_SHORT();
+            if (!peek(0)) ip += offset;
+            break;
+        }
+        case OpCode::LOOP: {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            RUN_COMPILED();
+            break;
+        }
+        case OpCode::CALL: {
+            int argCount = READ_BYTE();
+            SAVE_IP();
+            call(peek(argCount), argCount);
+            frame = &frames.back();
+            ip = frame->ip;
+            break;
+        }
+        case OpCode::TAIL_CALL: {
+            int argCount = READ_BYTE();
+            SAVE_IP();
+            Value& callee = peek(argCount);
+            if (!callee.IsObj() || callee.AsObj()->type != ObjType::CLOSURE ||
+                callee.AsCallable()->Arity() != argCount) {
+                /* Natives have no frame to reuse and bad calls fail in call();
+                 * the RETURN that follows hands back the result */
+                call(callee, argCount);
+                break;
+            }
+            /* The callee and its arguments take over the returning frame */
+            auto closure = static_cast<Closure*>(callee.AsObj());
+            openUpvalues.Close(frame->slots);
+            Value* slots = frame->slots;
+            std::copy(stackTop - argCount - 1, stackTop, slots);
+            stackTop = slots + argCount + 1;
+            frame->closure = closure;
+            ip = closure->function->chunk.code.data();
+            LOX_COUNT(calls);
+            RUN_COMPILED();
+            break;
+        }
+        case OpCode::CLOSURE: {
+            auto& function = frame->closure->function->chunk.functions[READ_SHORT()];
+            auto closure = heap.Allocate<Closure>(function);
+            /* Reachable before capturing, which may allocate */
+            push(Value(closure));
+            for (int i = 0; i < function->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues.push_back(openUpvalues.Capture(frame->slots + index));
+                } else {
+                    closure->upvalues.push_back(frame->closure->upvalues[index]);
+                }
+            }
+            break;
+        }
+        case OpCode::CLOSE_UPVALUE:
+            openUpvalues.Close(stackTop - 1);
+            pop();
+            break;
+        case OpCode::RETURN: {
+            Value result = pop();
+            openUpvalues.Close(frame->slots);
+            Value* slots = frame->slots;
+            frames.pop_back();
+            stackTop = slots;
+            push(result);
+            if (frames.size() == base) {
+                return;
+            }
+            frame = &frames.back();
+            ip = frame->ip;
+            break;
+        }
+        }
+    }
+
+#undef RUN_COMPILED
+#undef COMPARE_OP
+#undef BINARY_OP
+#undef NUMBER_OPERANDS
+#undef SAVE_IP
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+}
+
+void VM::call(const Value& callee, int argCount) {
+    if (!callee.IsCallable()) {
+        runtimeError("Can only call functions");
+    }
+
+    LoxCallable* callable = callee.AsCallable();
+    if (callable->Arity() != argCount) {
+        runtimeError(fmt::format("Expected {} arguments but got {}", callable->Arity(), argCount));
+    }
+
+    if (callable->type == ObjType::CLOSURE) {
+        auto closure = static_cast<Closure*>(callable);
+        if (frames.size() == FRAMES_MAX) {
+            const Function& function = *closure->function;
+            runtimeError(Token(TokenType::IDENTIFIER, function.name.data(), function.name.size(), function.line),
+                         "Stack overflow");
+        }
+        frames.push_back(CallFrame {
+            closure, closure->function->chunk.code.data(), stackTop - argCount - 1 });
+        LOX_COUNT(calls);
+        LOX_COUNT(frames);
+        if (jit) jit->Run(*this, frames.back());
+        return;
+    }
+
+    auto native = static_cast<NativeFunction*>(callable);
+    Value result = native->Invoke(Span<Value>(stackTop - argCount, argCount));
+    stackTop -= argCount + 1;
+    push(result);
+}
+
+void VM::defineNative(const std::string& name, LoxCallable* native) {
+    /* Reachable while the name is made, which may collect */
+    push(Value(native));
+    ObjString* key = heap.MakeString(name);
+    globals[key] = pop();
+}
+
+void VM::MarkRoots(Heap&) {
+    for (Value* slot = stack.data(); slot < stackTop; slot++) {
+        heap.Mark(*slot);
+    }
+    for (auto& frame: frames) {
+        heap.Mark(frame.closure);
+    }
+    for (auto& global: globals) {
+        heap.Mark(global.first);
+        heap.Mark(global.second);
+    }
+    openUpvalues.Mark();
+}
+
+void VM::runtimeError(const std::string& message) {
+    Token token(TokenType::TEOF, "", 0, 0);
+    if (!frames.empty()) {
+        const CallFrame& frame = frames.back();
+        const Chunk& chunk = frame.closure->function->chunk;
+        token = chunk.GetToken(frame.ip - chunk.code.data() - 1);
+    }
+    runtimeError(token, message);
+}
+
+void VM::runtimeError(const Token& token, const std::string& message) {
+    Lox::Error(token, message);
+    throw RuntimeError(token, message);
+}
@@ -0,0 +1,94 @@
+#ifndef LOX_VM_H
+#define LOX_VM_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "chunk.h"
+#include "heap.h"
+#include "value.h"
+#include "lox_function.h"
+#include "upvalue.h"
+
+class Jit;
+
+class Closure: public LoxCallable {
+public:
+    Closure(std::shared_ptr<Function> function): LoxCallable(ObjType::CLOSURE), function(function) {
+        upvalues.reserve(function->upvalueCount);
+    }
+    Value Call(Interpreter&, Span<Value>) override;
+    int Arity() override;
+    void Trace(Heap&) override;
+
+    std::shared_ptr<Function> function;
+    std::vector<Upvalue*> upvalues;
+};
+
+
+/* Stack-based virtual machine executing the bytecode produced by Compiler */
+class VM: private Heap::Roots {
+public:
+    VM(Heap& heap);
+    ~VM();
+
+    void Interpret(std::shared_ptr<Function> script);
+
+    /* Compiles hot functions to machine code from now on; false where the
+     * Jit is not supported */
+    bool EnableJit();
+
+private:
+    friend class Jit;
+
+    struct CallFrame {
+        Closure* closure;
+        const uint8_t* ip;
+        Value* slots;
+    };
+
+    /* Runs until a RETURN leaves base frames, with its result pushed */
+    void run(size_t base);
+
+    void call(const Value& callee, int argCount);
+
+    void push(const Value& value) {
+        if (stackTop == stack.data() + stack.size()) {
+            runtimeError("Stack overflow");
+        }
+        *stackTop++ = value;
+    }
+
+    Value pop() {
+        return *--stackTop;
+    }
+
+    Value& peek(int distance) {
+        return stackTop[-1 - distance];
+    }
+
+    void defineNative(const std::string& name, LoxCallable* native);
+
+    void MarkRoots(Heap&) override;
+
+    /* Reports message at the token of the instruction being run */
+    [[noreturn]] void runtimeError(const std::string& message);
+
+    [[noreturn]] void runtimeError(const Token& token, const std::string& message);
+
+    /* The same stack as the Interpreter's, so that recursion goes as deep */
+    static constexpr size_t STACK_MAX = 1024 * 256;
+    static constexpr size_t FRAMES_MAX = STACK_MAX / 4;
+
+    Heap& heap;
+    std::vector<Value> stack;
+    Value* stackTop;
+    std::vector<CallFrame> frames;
+    OpenUpvalues openUpvalues;
+    std::unordered_map<ObjString*, Value, ObjStringHash> globals;
+    std::unique_ptr<Jit> jit;
+};
+
+#endif